@@ -0,0 +1,222 @@
+// Synthetic project tree generator for benchmarking the exporter.
+//
+// Writes a deterministic tree of source-like files: the same options and
+// seed always produce the same directories, names and bytes, so timings of
+// different builds can be compared. Directory shape (depth, fan-out), file
+// count and the size distribution can be varied; a share of the files can
+// be made binary or minified to exercise content sniffing.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#define MAX_PATH_LENGTH 4096
+
+typedef struct {
+    int depth;              // Directory levels below the root
+    int fanout;             // Subdirectories per directory
+    long files;             // Files in all
+    long median_size;       // Median file size in bytes
+    double size_spread;     // Sigma of the log-normal size distribution
+    int binary_percent;     // Files filled with random bytes
+    int minified_percent;   // Files written as one long line
+    uint64_t seed;
+} TreeOptions;
+
+// xorshift64*: fast, and the same sequence on every platform
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_uniform(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Log-normal size around the median, clamped to [16 bytes, 64 x median]
+static long rng_size(const TreeOptions *options) {
+    double u1 = rng_uniform(), u2 = rng_uniform();
+    double normal = sqrt(-2.0 * log(u1 > 0 ? u1 : 1e-12)) * cos(2.0 * M_PI * u2);
+    double size = options->median_size * exp(normal * options->size_spread);
+    if (size < 16) size = 16;
+    if (size > options->median_size * 64.0) size = options->median_size * 64.0;
+    return (long)size;
+}
+
+static const char *extensions[] = {"c", "h", "cpp", "py", "js", "ts", "java", "go", "rs", "json", "md", "txt"};
+static const char *words[] = {
+    "int", "return", "if", "else", "for", "while", "const", "static", "void", "struct", "self", "value",
+    "count", "buffer", "index", "result", "error", "length", "node", "table", "entry", "path", "file",
+    "size", "data", "next", "prev", "key", "list", "item", "state", "config", "handle", "options",
+};
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+static int make_dir(const char *path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Create the directories below root breadth first; paths[0] is root
+static char **make_dirs(const char *root, const TreeOptions *options, long *count) {
+    long total = 1, level = 1;
+    for (int d = 0; d < options->depth; d++) {
+        level *= options->fanout;
+        total += level;
+    }
+    char **paths = calloc(total, sizeof(char *));
+    paths[0] = strdup(root);
+    if (make_dir(root) == -1) return NULL;
+
+    long next = 1;
+    long level_start = 0, level_end = 1;
+    for (int d = 0; d < options->depth; d++) {
+        for (long parent = level_start; parent < level_end; parent++) {
+            for (int i = 0; i < options->fanout; i++) {
+                char path[MAX_PATH_LENGTH];
+                snprintf(path, sizeof(path), "%s/dir%02d_%d", paths[parent], d, i);
+                if (make_dir(path) == -1) return NULL;
+                paths[next++] = strdup(path);
+            }
+        }
+        level_start = level_end;
+        level_end = next;
+    }
+    *count = total;
+    return paths;
+}
+
+// Fill buffer with size bytes of indented, source-like lines
+static void fill_source(char *buffer, long size, int minified) {
+    long pos = 0;
+    int indent = 0;
+    while (pos < size) {
+        if (!minified) {
+            for (int i = 0; i < indent * 4 && pos < size; i++) buffer[pos++] = ' ';
+        }
+        int line_words = 2 + rng_next() % 8;
+        for (int w = 0; w < line_words && pos < size; w++) {
+            const char *word = words[rng_next() % WORD_COUNT];
+            for (const char *c = word; *c && pos < size; c++) buffer[pos++] = *c;
+            if (pos < size) buffer[pos++] = (rng_next() % 4 == 0) ? '_' : ' ';
+            if (rng_next() % 6 == 0 && pos < size) buffer[pos++] = '0' + rng_next() % 10;
+        }
+        if (pos < size) buffer[pos++] = minified ? ';' : (rng_next() % 5 == 0 ? '{' : ';');
+        if (!minified && pos < size) buffer[pos++] = '\n';
+        indent = (indent + (rng_next() % 3) - 1 + 4) % 4;
+    }
+}
+
+static int write_file(const char *path, const char *data, long size) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    size_t written = fwrite(data, 1, size, file);
+    if (fclose(file) != 0 || written != (size_t)size) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s DIR [options]\n"
+            "\n"
+            "Options:\n"
+            "  -d, --depth N        Directory levels below DIR (default: 3)\n"
+            "  -w, --fanout N       Subdirectories per directory (default: 6)\n"
+            "  -n, --files N        Number of files (default: 20000)\n"
+            "  -s, --size BYTES     Median file size (default: 4096)\n"
+            "  -v, --spread SIGMA   Spread of the log-normal file sizes (default: 1.0)\n"
+            "  -b, --binary PCT     Percentage of binary files (default: 1)\n"
+            "  -m, --minified PCT   Percentage of minified files (default: 1)\n"
+            "  -r, --seed N         Random seed (default: 1)\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"depth",    required_argument, NULL, 'd'},
+        {"fanout",   required_argument, NULL, 'w'},
+        {"files",    required_argument, NULL, 'n'},
+        {"size",     required_argument, NULL, 's'},
+        {"spread",   required_argument, NULL, 'v'},
+        {"binary",   required_argument, NULL, 'b'},
+        {"minified", required_argument, NULL, 'm'},
+        {"seed",     required_argument, NULL, 'r'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    TreeOptions options = {3, 6, 20000, 4096, 1.0, 1, 1, 1};
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "d:w:n:s:v:b:m:r:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd': options.depth = atoi(optarg); break;
+            case 'w': options.fanout = atoi(optarg); break;
+            case 'n': options.files = atol(optarg); break;
+            case 's': options.median_size = atol(optarg); break;
+            case 'v': options.size_spread = atof(optarg); break;
+            case 'b': options.binary_percent = atoi(optarg); break;
+            case 'm': options.minified_percent = atoi(optarg); break;
+            case 'r': options.seed = strtoull(optarg, NULL, 10); break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1 || options.depth < 0 || options.fanout < 1 || options.files < 0 ||
+        options.median_size < 1 || options.binary_percent + options.minified_percent > 100) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    rng_state = options.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    long dir_count = 0;
+    char **dirs = make_dirs(argv[optind], &options, &dir_count);
+    if (!dirs) return 1;
+
+    char *buffer = malloc(options.median_size * 64 + 1);
+    long long total_bytes = 0;
+    int status = 0;
+    for (long i = 0; i < options.files && status == 0; i++) {
+        const char *dir = dirs[rng_next() % dir_count];
+        const char *ext = extensions[rng_next() % (sizeof(extensions) / sizeof(extensions[0]))];
+        long size = rng_size(&options);
+        int kind = rng_next() % 100; // Below binary_percent: binary, then minified, then source
+
+        if (kind < options.binary_percent) {
+            for (long j = 0; j < size; j++) buffer[j] = (char)rng_next();
+        } else {
+            fill_source(buffer, size, kind < options.binary_percent + options.minified_percent);
+        }
+
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s/file%06ld.%s", dir, i, ext);
+        status = write_file(path, buffer, size);
+        total_bytes += size;
+    }
+
+    for (long i = 0; i < dir_count; i++) free(dirs[i]);
+    free(dirs);
+    free(buffer);
+    if (status == 0) {
+        fprintf(stderr, "Generated %ld files (%lld bytes) in %ld directories under %s\n",
+                options.files, total_bytes, dir_count, argv[optind]);
+    }
+    return status == 0 ? 0 : 1;
+}
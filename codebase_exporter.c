@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For copy_file_range
 #include <gtk/gtk.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,51 +8,183 @@
 #include <unistd.h> // For access, mkdir
 #include <errno.h>  // For errno
 #include <libgen.h> // For dirname
+#include <getopt.h> // For getopt_long
+#include <fcntl.h>  // For open, fstatat
+#include <sys/mman.h>     // For mmap
+#include <sys/sendfile.h> // For sendfile
+#include <sys/inotify.h>  // For inotify_init1
+#include <sys/resource.h> // For getrusage
+#include <sys/socket.h>   // For the daemon's socket
+#include <sys/un.h>       // For sockaddr_un
+#include <poll.h>         // For poll
+#include <signal.h>       // For ignoring SIGPIPE
+#include <zlib.h>  // For gzip output
+#include <zstd.h>  // For zstd output
 
-#define MAX_FILES 500
 #define MAX_PATH_LENGTH 1024
+#define EXPORT_CHUNK_SIZE (64 * 1024) // Read size used when streaming file content
+#define SCAN_MAX_THREADS 16 // Upper bound on directory walker threads
+#define MMAP_THRESHOLD (256 * 1024) // Files at least this large are mmap'ed for export
 #define OUTPUT_FILE "/home/mert/AndroidStudioProjects/antinsfw_copy/custom-codebase.md" // Kept for now, but should ideally use a save dialog
 #define CONFIG_DIR_SUFFIX ".config/codebase-exporter"
 #define CONFIG_FILE_NAME "last_dir.txt"
+#define INDEX_DIR_NAME "index" // Saved scan indexes, under the config directory
 
+typedef struct ScanIndex ScanIndex;
+
+// One scanned file. Paths are not stored per file: an entry refers to its
+// directory in the scan index and keeps only its basename, and both strings
+// live in the index's arenas, so memory grows with the real path lengths.
 typedef struct {
-    char filename[256];
-    char path[MAX_PATH_LENGTH];
-    GtkWidget *checkbox;
+    guint32 dir_index;
+    const char *filename;
+    guint32 tokens;         // Estimated tokens the file adds to an export
     gboolean selected;
+    guint8 skip;            // SkipReason it started out deselected for, or SKIP_NONE
+    guint16 root;           // Index of its root in the table's roots
 } FileEntry;
 
+// One scanned directory of a table; a workspace has several
+typedef struct {
+    ScanIndex *index;   // Owns the directory paths and file names
+    char *name;         // Last component of the root path
+    guint prefix_len;   // Bytes of a file's path up to and including the root's slash
+    guint parent_len;   // Bytes of a file's path before the root's name
+} FileTableRoot;
+
+// Growable table of the scanned files a project type allows, grouped by
+// root and directory. Reference counted so a background export can keep
+// using a table after a rescan replaced it.
+typedef struct {
+    gint ref_count;
+    GArray *entries;    // FileEntry
+    GArray *roots;      // FileTableRoot, in workspace order
+    guint64 selected_tokens; // Sum of the tokens of the selected entries
+    guint skipped;      // Entries that started out deselected by content limits
+} FileTable;
+
+// Every extension the built-in project types use. The IDs index bitsets,
+// so there can be at most 64 of them.
+typedef enum {
+    EXT_UNKNOWN,
+    EXT_JAVA, EXT_KT, EXT_KTS, EXT_XML, EXT_GRADLE,
+    EXT_HTML, EXT_CSS, EXT_JS, EXT_JSX, EXT_TS, EXT_TSX, EXT_JSON,
+    EXT_PY, EXT_PYW, EXT_PYX, EXT_PYD,
+    EXT_C, EXT_CPP, EXT_H, EXT_HPP, EXT_CC,
+    EXT_GO,
+    EXT_RS,
+    EXT_COUNT
+} KnownExtension;
+
+#define EXT_BIT(ext) (G_GUINT64_CONSTANT(1) << (ext))
+
+const char *known_extension_names[EXT_COUNT] = {
+    "",
+    "java", "kt", "kts", "xml", "gradle",
+    "html", "css", "js", "jsx", "ts", "tsx", "json",
+    "py", "pyw", "pyx", "pyd",
+    "c", "cpp", "h", "hpp", "cc",
+    "go",
+    "rs",
+};
+
+// Perfect hash of the known extensions, from their length and first and last
+// (lowercase) characters. The table is laid out by the compiler; two
+// extensions sharing a slot stop the build (the Makefile turns
+// -Woverride-init, which -Wall leaves off, into an error).
+#define KNOWN_EXTENSION_MAX_LEN 6
+#define EXTENSION_SLOT(len, first, last) (((len) + (first) + 2 * (last)) & 63)
+
+const guint8 known_extension_slots[64] = {
+    [EXTENSION_SLOT(4, 'j', 'a')] = EXT_JAVA,
+    [EXTENSION_SLOT(2, 'k', 't')] = EXT_KT,
+    [EXTENSION_SLOT(3, 'k', 's')] = EXT_KTS,
+    [EXTENSION_SLOT(3, 'x', 'l')] = EXT_XML,
+    [EXTENSION_SLOT(6, 'g', 'e')] = EXT_GRADLE,
+    [EXTENSION_SLOT(4, 'h', 'l')] = EXT_HTML,
+    [EXTENSION_SLOT(3, 'c', 's')] = EXT_CSS,
+    [EXTENSION_SLOT(2, 'j', 's')] = EXT_JS,
+    [EXTENSION_SLOT(3, 'j', 'x')] = EXT_JSX,
+    [EXTENSION_SLOT(2, 't', 's')] = EXT_TS,
+    [EXTENSION_SLOT(3, 't', 'x')] = EXT_TSX,
+    [EXTENSION_SLOT(4, 'j', 'n')] = EXT_JSON,
+    [EXTENSION_SLOT(2, 'p', 'y')] = EXT_PY,
+    [EXTENSION_SLOT(3, 'p', 'w')] = EXT_PYW,
+    [EXTENSION_SLOT(3, 'p', 'x')] = EXT_PYX,
+    [EXTENSION_SLOT(3, 'p', 'd')] = EXT_PYD,
+    [EXTENSION_SLOT(1, 'c', 'c')] = EXT_C,
+    [EXTENSION_SLOT(3, 'c', 'p')] = EXT_CPP,
+    [EXTENSION_SLOT(1, 'h', 'h')] = EXT_H,
+    [EXTENSION_SLOT(3, 'h', 'p')] = EXT_HPP,
+    [EXTENSION_SLOT(2, 'c', 'c')] = EXT_CC,
+    [EXTENSION_SLOT(2, 'g', 'o')] = EXT_GO,
+    [EXTENSION_SLOT(2, 'r', 's')] = EXT_RS,
+};
+
 typedef struct {
     const char *name;
-    int extension_count;
-    const char **extensions;
+    guint64 extensions; // Bitset of KnownExtension
 } ProjectType;
 
-// Define project types with their associated file extensions
-const char *android_extensions[] = {"java", "kt", "kts", "xml", "gradle"};
-const char *web_extensions[] = {"html", "css", "js", "jsx", "ts", "tsx", "json"};
-const char *python_extensions[] = {"py", "pyw", "pyx", "pyd"};
-const char *cpp_extensions[] = {"c", "cpp", "h", "hpp", "cc"};
-const char *golang_extensions[] = {"go"};
-const char *rust_extensions[] = {"rs"};
+// The built-in project types, as indexes into project_types
+typedef enum {
+    PROJECT_ANDROID,
+    PROJECT_WEB,
+    PROJECT_PYTHON,
+    PROJECT_C,
+    PROJECT_GO,
+    PROJECT_RUST,
+    PROJECT_TYPE_COUNT
+} ProjectTypeId;
 
+// Define project types with their associated file extensions
 ProjectType project_types[] = {
-    {"Android", 5, android_extensions},
-    {"Web/Node.js", 7, web_extensions},
-    {"Python", 4, python_extensions},
-    {"C/C++", 5, cpp_extensions},
-    {"Go", 1, golang_extensions},
-    {"Rust", 1, rust_extensions},
-    {NULL, 0, NULL} // Sentinel to mark the end
+    [PROJECT_ANDROID] = {"Android", EXT_BIT(EXT_JAVA) | EXT_BIT(EXT_KT) | EXT_BIT(EXT_KTS) | EXT_BIT(EXT_XML) |
+                                    EXT_BIT(EXT_GRADLE)},
+    [PROJECT_WEB] = {"Web/Node.js", EXT_BIT(EXT_HTML) | EXT_BIT(EXT_CSS) | EXT_BIT(EXT_JS) | EXT_BIT(EXT_JSX) |
+                                    EXT_BIT(EXT_TS) | EXT_BIT(EXT_TSX) | EXT_BIT(EXT_JSON)},
+    [PROJECT_PYTHON] = {"Python", EXT_BIT(EXT_PY) | EXT_BIT(EXT_PYW) | EXT_BIT(EXT_PYX) | EXT_BIT(EXT_PYD)},
+    [PROJECT_C] = {"C/C++", EXT_BIT(EXT_C) | EXT_BIT(EXT_CPP) | EXT_BIT(EXT_H) | EXT_BIT(EXT_HPP) | EXT_BIT(EXT_CC)},
+    [PROJECT_GO] = {"Go", EXT_BIT(EXT_GO)},
+    [PROJECT_RUST] = {"Rust", EXT_BIT(EXT_RS)},
+    [PROJECT_TYPE_COUNT] = {NULL, 0} // Sentinel to mark the end
 };
 
-FileEntry files[MAX_FILES];
-int file_count = 0;
-GtkWidget *project_path_entry;
+FileTable *file_table = NULL; // Files shown in the GUI; its index is the project's scan index
+GtkWidget *project_path_view; // Multi-line: a workspace takes a line per directory
 GtkWidget *project_type_combo;
 GtkWidget *status_label;
+GtkWidget *token_label;
+GtkWidget *budget_spin;
+GtkWidget *content_combo;
+GtkWidget *cancel_button;
+GtkWidget *stats_check;
 GtkClipboard *clipboard;
 
+// --- Workspaces ---
+
+// A workspace is one or more project directories that are scanned and
+// exported together, such as a backend, its protocol definitions and a
+// frontend. It is written one directory per line: unlike ':', a newline
+// cannot be part of a directory name anyone types or picks.
+#define WORKSPACE_SEPARATOR "\n"
+
+// Split a workspace into its root directories, dropping empty entries.
+// Free the result with g_strfreev().
+char **workspace_split(const char *workspace) {
+    char **roots = g_strsplit(workspace, WORKSPACE_SEPARATOR, -1);
+    guint kept = 0;
+    for (guint i = 0; roots[i]; i++) {
+        if (*roots[i]) {
+            roots[kept++] = roots[i];
+        } else {
+            g_free(roots[i]);
+        }
+    }
+    roots[kept] = NULL;
+    return roots;
+}
+
 // --- Configuration File Handling ---
 
 // Ensure the configuration directory exists
@@ -104,526 +237,6110 @@ int ensure_config_dir_exists() {
     return 0;
 }
 
-// Get the full path to the config file
-char* get_config_file_path() {
-    static char config_file_path[MAX_PATH_LENGTH]; // Static buffer
-    const char *home_dir = getenv("HOME");
-    if (!home_dir) return NULL;
-    snprintf(config_file_path, MAX_PATH_LENGTH, "%s/%s/%s", home_dir, CONFIG_DIR_SUFFIX, CONFIG_FILE_NAME);
-    return config_file_path;
+// Get the full path to the config file
+char* get_config_file_path() {
+    static char config_file_path[MAX_PATH_LENGTH]; // Static buffer
+    const char *home_dir = getenv("HOME");
+    if (!home_dir) return NULL;
+    snprintf(config_file_path, MAX_PATH_LENGTH, "%s/%s/%s", home_dir, CONFIG_DIR_SUFFIX, CONFIG_FILE_NAME);
+    return config_file_path;
+}
+
+// Read the last directory (or workspace) from the config file
+char* read_last_directory() {
+    char *config_file = get_config_file_path();
+    if (!config_file) return NULL;
+
+    // A workspace takes a line per directory
+    char *path = NULL;
+    if (!g_file_get_contents(config_file, &path, NULL, NULL)) {
+        // Don't print an error if the file just doesn't exist
+        return NULL;
+    }
+    g_strchomp(path); // Remove the trailing newline
+
+    // Check that every directory of the workspace still exists
+    char **roots = workspace_split(path);
+    gboolean valid = roots[0] != NULL;
+    for (char **root = roots; *root && valid; root++) {
+        struct stat st;
+        valid = stat(*root, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    g_strfreev(roots);
+    if (valid) {
+        return path;
+    }
+    if (*path) fprintf(stderr, "Warning: Last directory '%s' from config not found or not a directory.\n", path);
+    g_free(path);
+    return NULL; // File empty, or a directory is gone
+}
+
+// Write the last directory (or workspace) to the config file
+void write_last_directory(const char *path) {
+    if (!path) return;
+
+    char *config_file = get_config_file_path();
+    if (!config_file) return;
+
+    FILE *file = fopen(config_file, "w");
+    if (!file) {
+        perror("Could not open config file for writing");
+        return;
+    }
+
+    fprintf(file, "%s\n", path);
+    fclose(file);
+}
+
+// --- Task Progress ---
+
+// Counters a background scan or export updates as it goes. The UI polls
+// them on a timer, so workers never have to touch GTK.
+typedef struct {
+    GMutex lock;
+    int files;
+    int dirs;
+    guint64 bytes;
+} TaskProgress;
+
+void task_progress_add(TaskProgress *progress, int files, int dirs, guint64 bytes) {
+    if (!progress) return;
+    g_mutex_lock(&progress->lock);
+    progress->files += files;
+    progress->dirs += dirs;
+    progress->bytes += bytes;
+    g_mutex_unlock(&progress->lock);
+}
+
+// --- Instrumentation ---
+
+// Where scans and exports spend their time: spans around each phase,
+// counters of the files, directories, bytes and system calls they handle,
+// and the slowest single files and directories. Everything is off unless
+// stats_enable() was called, and then the hot paths pay a clock read or an
+// atomic add. With tracing on, every span is also kept for a Chrome trace
+// (chrome://tracing or Perfetto), written by --trace.
+
+typedef enum {
+    STAT_DIRS,          // Directories listed
+    STAT_FILES,         // Files read, for sniffing, counting or export
+    STAT_STAT_CALLS,    // stat, fstat and fstatat
+    STAT_OPEN_CALLS,
+    STAT_READ_CALLS,    // read and getdents (one per directory listed)
+    STAT_COPY_CALLS,    // copy_file_range and sendfile
+    STAT_BYTES_READ,    // Read or mapped from files
+    STAT_BYTES_WRITTEN, // Into export sinks
+    STAT_COUNT
+} StatCounter;
+
+static const char *stat_counter_names[] = {
+    "dirs", "files", "stat calls", "open calls", "read calls", "copy calls", "bytes read", "bytes written"
+};
+
+#define STATS_SLOWEST 10 // Slowest files and directories kept
+
+typedef struct {
+    const char *name;       // Static string
+    const char *category;   // Static string
+    char *detail;           // Path, or NULL
+    gint64 start;           // Microseconds since stats_enable()
+    gint64 duration;
+    int thread;
+} TraceEvent;
+
+typedef struct {
+    const char *name;
+    gint64 total;           // Microseconds
+    guint count;
+} StatsPhase;
+
+typedef struct {
+    const char *category;
+    char *path;
+    gint64 duration;
+} StatsSlowItem;
+
+static struct {
+    gboolean enabled;
+    gboolean tracing;
+    gint64 counters[STAT_COUNT];
+    gint64 slowest_floor;   // Duration an item must beat to enter the list once it is full
+    gint next_thread;
+    GMutex lock;            // Guards what follows
+    gint64 origin;
+    GArray *phases;         // StatsPhase
+    GArray *events;         // TraceEvent, while tracing
+    StatsSlowItem slowest[STATS_SLOWEST]; // Slowest first
+    guint slowest_len;
+} stats;
+
+static GPrivate stats_thread_id; // Small per-thread number for trace events, 0 until assigned
+
+// Start collecting (with every span kept if tracing), dropping what was
+// collected before
+void stats_enable(gboolean tracing) {
+    g_mutex_lock(&stats.lock);
+    if (!stats.phases) {
+        stats.phases = g_array_new(FALSE, FALSE, sizeof(StatsPhase));
+        stats.events = g_array_new(FALSE, FALSE, sizeof(TraceEvent));
+    }
+    for (guint i = 0; i < stats.events->len; i++) {
+        g_free(g_array_index(stats.events, TraceEvent, i).detail);
+    }
+    g_array_set_size(stats.events, 0);
+    g_array_set_size(stats.phases, 0);
+    for (guint i = 0; i < stats.slowest_len; i++) {
+        g_free(stats.slowest[i].path);
+    }
+    stats.slowest_len = 0;
+    stats.slowest_floor = 0;
+    for (int i = 0; i < STAT_COUNT; i++) {
+        __atomic_store_n(&stats.counters[i], 0, __ATOMIC_RELAXED);
+    }
+    stats.origin = g_get_monotonic_time();
+    stats.tracing = tracing;
+    stats.enabled = TRUE;
+    g_mutex_unlock(&stats.lock);
+}
+
+void stats_disable(void) {
+    stats.enabled = FALSE;
+}
+
+static inline void stats_count(StatCounter counter, gint64 amount) {
+    if (G_UNLIKELY(stats.enabled)) __atomic_fetch_add(&stats.counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+// Start timing a span; returns 0 when stats are off, which stats_end_*() ignore
+static inline gint64 stats_begin(void) {
+    return G_UNLIKELY(stats.enabled) ? g_get_monotonic_time() : 0;
+}
+
+// Must be called with the lock held
+static void stats_trace_locked(const char *name, const char *category, const char *detail,
+                               gint64 start, gint64 duration) {
+    int thread = GPOINTER_TO_INT(g_private_get(&stats_thread_id));
+    if (thread == 0) {
+        thread = ++stats.next_thread;
+        g_private_set(&stats_thread_id, GINT_TO_POINTER(thread));
+    }
+    TraceEvent event = {name, category, g_strdup(detail), start - stats.origin, duration, thread};
+    g_array_append_val(stats.events, event);
+}
+
+// End a phase (a scan, an export, filling the list...) started with
+// stats_begin(); phases of the same name are added up
+void stats_end_phase(const char *name, gint64 start) {
+    if (!start) return;
+    gint64 duration = g_get_monotonic_time() - start;
+    g_mutex_lock(&stats.lock);
+    StatsPhase *phase = NULL;
+    for (guint i = 0; i < stats.phases->len && !phase; i++) {
+        if (strcmp(g_array_index(stats.phases, StatsPhase, i).name, name) == 0) {
+            phase = &g_array_index(stats.phases, StatsPhase, i);
+        }
+    }
+    if (!phase) {
+        StatsPhase added = {name, 0, 0};
+        g_array_append_val(stats.phases, added);
+        phase = &g_array_index(stats.phases, StatsPhase, stats.phases->len - 1);
+    }
+    phase->total += duration;
+    phase->count++;
+    if (stats.tracing) stats_trace_locked(name, "phase", NULL, start, duration);
+    g_mutex_unlock(&stats.lock);
+}
+
+// End the span of one file or directory started with stats_begin(),
+// keeping it if it is among the slowest. Only the slow ones and, when
+// tracing, every one take the lock.
+void stats_end_item(const char *category, const char *path, gint64 start) {
+    if (!start) return;
+    gint64 duration = g_get_monotonic_time() - start;
+    if (!stats.tracing && duration <= __atomic_load_n(&stats.slowest_floor, __ATOMIC_RELAXED)) return;
+
+    g_mutex_lock(&stats.lock);
+    if (stats.tracing) stats_trace_locked(category, category, path, start, duration);
+    if (stats.slowest_len < STATS_SLOWEST || duration > stats.slowest[STATS_SLOWEST - 1].duration) {
+        guint i = MIN(stats.slowest_len, STATS_SLOWEST - 1);
+        if (stats.slowest_len == STATS_SLOWEST) {
+            g_free(stats.slowest[i].path);
+        } else {
+            stats.slowest_len++;
+        }
+        for (; i > 0 && stats.slowest[i - 1].duration < duration; i--) {
+            stats.slowest[i] = stats.slowest[i - 1];
+        }
+        stats.slowest[i] = (StatsSlowItem){category, g_strdup(path), duration};
+        if (stats.slowest_len == STATS_SLOWEST) {
+            __atomic_store_n(&stats.slowest_floor, stats.slowest[STATS_SLOWEST - 1].duration, __ATOMIC_RELAXED);
+        }
+    }
+    g_mutex_unlock(&stats.lock);
+}
+
+// Describe what was collected, for people: phase times, counters and the
+// slowest items
+void stats_summary(GString *out) {
+    if (!stats.enabled) return;
+    g_mutex_lock(&stats.lock);
+    for (guint i = 0; i < stats.phases->len; i++) {
+        const StatsPhase *phase = &g_array_index(stats.phases, StatsPhase, i);
+        g_string_append_printf(out, "%-14s %10.2f ms", phase->name, phase->total / 1000.0);
+        if (phase->count > 1) g_string_append_printf(out, " (%u times)", phase->count);
+        g_string_append_c(out, '\n');
+    }
+    for (int i = 0; i < STAT_COUNT; i++) {
+        g_string_append_printf(out, "%-14s %10" G_GINT64_FORMAT "\n", stat_counter_names[i],
+                               __atomic_load_n(&stats.counters[i], __ATOMIC_RELAXED));
+    }
+    if (stats.slowest_len > 0) g_string_append(out, "Slowest:\n");
+    for (guint i = 0; i < stats.slowest_len; i++) {
+        g_string_append_printf(out, "%10.2f ms  %-7s %s\n", stats.slowest[i].duration / 1000.0,
+                               stats.slowest[i].category, stats.slowest[i].path);
+    }
+    g_mutex_unlock(&stats.lock);
+}
+
+// --- Arenas ---
+
+// Bump allocator for small records that all die together, such as the
+// bookkeeping of one scan. Records are carved out of blocks of
+// ARENA_BLOCK_SIZE bytes, so a scan costs a handful of mallocs instead of
+// one per directory, and arena_clear() releases everything a block at a
+// time. Strings go into GStringChunks, which work the same way.
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    gsize used;
+    gsize size;
+    // Records follow, aligned for any type
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *blocks; // Newest first
+} Arena;
+
+#define ARENA_ALIGN(n) (((n) + 2 * sizeof(gpointer) - 1) & ~(gsize)(2 * sizeof(gpointer) - 1))
+#define ARENA_BLOCK_DATA(block) ((char *)(block) + ARENA_ALIGN(sizeof(ArenaBlock)))
+
+static void arena_init(Arena *arena) {
+    arena->blocks = NULL;
+}
+
+// Uninitialised memory for size bytes, valid until arena_clear()
+static gpointer arena_alloc(Arena *arena, gsize size) {
+    size = ARENA_ALIGN(size);
+    ArenaBlock *block = arena->blocks;
+    if (!block || block->size - block->used < size) {
+        gsize block_size = MAX(ARENA_BLOCK_SIZE, size);
+        block = g_malloc(ARENA_ALIGN(sizeof(ArenaBlock)) + block_size);
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = block_size;
+        arena->blocks = block;
+    }
+    gpointer record = ARENA_BLOCK_DATA(block) + block->used;
+    block->used += size;
+    return record;
+}
+
+static void arena_clear(Arena *arena) {
+    while (arena->blocks) {
+        ArenaBlock *next = arena->blocks->next;
+        g_free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+// --- Export Sinks ---
+
+// An export sink receives the generated markdown as it is produced, so the
+// document never has to be held in memory unless the destination needs it
+// (e.g. the clipboard). Each sink tracks how many bytes it has accepted.
+// Sinks that compress, escape or split what they are given keep their own
+// state and are completed with export_sink_finish().
+typedef enum {
+    EXPORT_MARKDOWN,    // A fenced code block per file
+    EXPORT_JSONL,       // A JSON object per file, one per line
+} ExportFormat;
+
+typedef enum {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+} ExportCompression;
+
+const char *export_format_names[] = {"markdown", "jsonl", NULL};
+const char *export_format_suffixes[] = {".md", ".jsonl"};
+const char *compression_names[] = {"none", "gzip", "zstd", NULL};
+const char *compression_suffixes[] = {"", ".gz", ".zst"};
+
+typedef struct ExportSink ExportSink;
+struct ExportSink {
+    gboolean (*write)(ExportSink *sink, const char *data, size_t len);
+    gboolean (*begin_file)(ExportSink *sink, const char *path, const char *relative_path, guint32 tokens); // Or NULL
+    gboolean (*finish)(ExportSink *sink); // Write out what the sink still holds, or NULL
+    FILE *file;           // Destination for file/stdout sinks
+    int fd;               // Descriptor behind file for kernel-side copies, or -1
+    GString *buffer;      // Destination for memory sinks
+    void *state;          // Private to compressing, escaping and splitting sinks
+    size_t bytes_written;
+    gboolean failed;      // Set once a write fails; later writes are dropped
+};
+
+static gboolean file_sink_write(ExportSink *sink, const char *data, size_t len) {
+    return fwrite(data, 1, len, sink->file) == len;
+}
+
+static gboolean buffer_sink_write(ExportSink *sink, const char *data, size_t len) {
+    g_string_append_len(sink->buffer, data, len);
+    return TRUE;
+}
+
+// Initialize a sink that streams into an open FILE (a regular file or stdout)
+void export_sink_init_file(ExportSink *sink, FILE *file) {
+    memset(sink, 0, sizeof(*sink));
+    sink->write = file_sink_write;
+    sink->file = file;
+    sink->fd = fileno(file);
+}
+
+// Initialize a sink that appends to a growable in-memory buffer
+void export_sink_init_buffer(ExportSink *sink, GString *buffer) {
+    memset(sink, 0, sizeof(*sink));
+    sink->write = buffer_sink_write;
+    sink->fd = -1;
+    sink->buffer = buffer;
+}
+
+gboolean export_sink_write(ExportSink *sink, const char *data, size_t len) {
+    if (sink->failed) return FALSE;
+    if (len == 0) return TRUE;
+    if (!sink->write(sink, data, len)) {
+        sink->failed = TRUE;
+        return FALSE;
+    }
+    sink->bytes_written += len;
+    return TRUE;
+}
+
+gboolean export_sink_puts(ExportSink *sink, const char *text) {
+    return export_sink_write(sink, text, strlen(text));
+}
+
+// Called before each exported file, so a splitting sink can start a new part
+gboolean export_sink_begin_file(ExportSink *sink, const char *path, const char *relative_path, guint32 tokens) {
+    if (sink->failed) return FALSE;
+    if (sink->begin_file && !sink->begin_file(sink, path, relative_path, tokens)) {
+        sink->failed = TRUE;
+    }
+    return !sink->failed;
+}
+
+// Write out anything the sink still buffers (e.g. the end of a compressed
+// stream). Returns FALSE if any write to the sink failed.
+gboolean export_sink_finish(ExportSink *sink) {
+    if (sink->finish && !sink->finish(sink)) {
+        sink->failed = TRUE;
+    }
+    return !sink->failed;
+}
+
+// gzip input is cut into blocks that worker threads compress as separate
+// gzip members, written out in order (as pigz does); concatenated members
+// are a valid gzip file. zstd spreads its work over threads of its own.
+#define GZIP_BLOCK_SIZE (1024 * 1024)
+
+typedef struct {
+    GByteArray *input;
+    GByteArray *output;
+    gboolean done;
+    gboolean ok;
+} GzipBlock;
+
+// State of a compressing sink
+typedef struct {
+    ExportCompression compression;
+    ZSTD_CCtx *zstd;
+    char *out;              // zstd output buffer
+    size_t out_size;
+    GThreadPool *gzip_pool; // Compresses GzipBlocks
+    GQueue gzip_blocks;     // Submitted blocks, in output order
+    GzipBlock *gzip_block;  // Block being filled, or NULL
+    guint gzip_max_blocks;  // Submitted blocks allowed before waiting for the oldest
+    GMutex lock;            // Guards GzipBlock.done
+    GCond cond;
+} ExportCodec;
+
+static void gzip_block_compress(gpointer data, gpointer user_data) {
+    GzipBlock *block = data;
+    ExportCodec *codec = user_data;
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    block->ok = deflateInit2(&stream, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK; // +16 for a gzip header
+    if (block->ok) {
+        g_byte_array_set_size(block->output, deflateBound(&stream, block->input->len));
+        stream.next_in = block->input->data;
+        stream.avail_in = block->input->len;
+        stream.next_out = block->output->data;
+        stream.avail_out = block->output->len;
+        block->ok = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+        g_byte_array_set_size(block->output, stream.total_out);
+        deflateEnd(&stream);
+    }
+
+    g_mutex_lock(&codec->lock);
+    block->done = TRUE;
+    g_cond_broadcast(&codec->cond);
+    g_mutex_unlock(&codec->lock);
+}
+
+// Wait for the oldest submitted block and write it out
+static gboolean gzip_write_oldest(ExportSink *sink) {
+    ExportCodec *codec = sink->state;
+    GzipBlock *block = g_queue_pop_head(&codec->gzip_blocks);
+
+    g_mutex_lock(&codec->lock);
+    while (!block->done) g_cond_wait(&codec->cond, &codec->lock);
+    g_mutex_unlock(&codec->lock);
+
+    gboolean ok = block->ok && fwrite(block->output->data, 1, block->output->len, sink->file) == block->output->len;
+    g_byte_array_free(block->input, TRUE);
+    g_byte_array_free(block->output, TRUE);
+    g_free(block);
+    return ok;
+}
+
+static gboolean gzip_submit_block(ExportSink *sink) {
+    ExportCodec *codec = sink->state;
+    g_queue_push_tail(&codec->gzip_blocks, codec->gzip_block);
+    g_thread_pool_push(codec->gzip_pool, codec->gzip_block, NULL);
+    codec->gzip_block = NULL;
+    // Bound the memory held by blocks waiting to be written
+    while (codec->gzip_blocks.length > codec->gzip_max_blocks) {
+        if (!gzip_write_oldest(sink)) return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean compressed_sink_write(ExportSink *sink, const char *data, size_t len) {
+    ExportCodec *codec = sink->state;
+    if (codec->compression == COMPRESS_ZSTD) {
+        ZSTD_inBuffer in = {data, len, 0};
+        while (in.pos < in.size) {
+            ZSTD_outBuffer out = {codec->out, codec->out_size, 0};
+            if (ZSTD_isError(ZSTD_compressStream2(codec->zstd, &out, &in, ZSTD_e_continue))) return FALSE;
+            if (out.pos > 0 && fwrite(codec->out, 1, out.pos, sink->file) != out.pos) return FALSE;
+        }
+        return TRUE;
+    }
+
+    while (len > 0) {
+        if (!codec->gzip_block) {
+            codec->gzip_block = g_new0(GzipBlock, 1);
+            codec->gzip_block->input = g_byte_array_sized_new(GZIP_BLOCK_SIZE);
+            codec->gzip_block->output = g_byte_array_new();
+        }
+        GByteArray *input = codec->gzip_block->input;
+        size_t part = MIN(len, GZIP_BLOCK_SIZE - input->len);
+        g_byte_array_append(input, (const guint8 *)data, part);
+        data += part;
+        len -= part;
+        if (input->len == GZIP_BLOCK_SIZE && !gzip_submit_block(sink)) return FALSE;
+    }
+    return TRUE;
+}
+
+// Complete the stream and free the compressor
+static gboolean compressed_sink_finish(ExportSink *sink) {
+    ExportCodec *codec = sink->state;
+    if (!codec) return TRUE;
+
+    gboolean ok = !sink->failed;
+    if (codec->compression == COMPRESS_ZSTD) {
+        size_t remaining = 1;
+        while (ok && remaining != 0) {
+            ZSTD_inBuffer in = {NULL, 0, 0};
+            ZSTD_outBuffer out = {codec->out, codec->out_size, 0};
+            remaining = ZSTD_compressStream2(codec->zstd, &out, &in, ZSTD_e_end);
+            ok = !ZSTD_isError(remaining) && fwrite(codec->out, 1, out.pos, sink->file) == out.pos;
+        }
+        ZSTD_freeCCtx(codec->zstd);
+        g_free(codec->out);
+    } else {
+        // An empty export still needs one (empty) member
+        if (ok && (codec->gzip_block || codec->gzip_blocks.length == 0)) {
+            if (!codec->gzip_block) {
+                codec->gzip_block = g_new0(GzipBlock, 1);
+                codec->gzip_block->input = g_byte_array_new();
+                codec->gzip_block->output = g_byte_array_new();
+            }
+            ok = gzip_submit_block(sink);
+        }
+        while (codec->gzip_blocks.length > 0) {
+            ok = gzip_write_oldest(sink) && ok;
+        }
+        if (codec->gzip_block) {
+            g_byte_array_free(codec->gzip_block->input, TRUE);
+            g_byte_array_free(codec->gzip_block->output, TRUE);
+            g_free(codec->gzip_block);
+        }
+        g_thread_pool_free(codec->gzip_pool, FALSE, TRUE);
+        g_mutex_clear(&codec->lock);
+        g_cond_clear(&codec->cond);
+    }
+    g_free(codec);
+    sink->state = NULL;
+    return ok;
+}
+
+// Initialize a sink that compresses into an open FILE. The stream is only
+// complete once export_sink_finish() was called.
+void export_sink_init_compressed(ExportSink *sink, FILE *file, ExportCompression compression) {
+    export_sink_init_file(sink, file);
+    if (compression == COMPRESS_NONE) return;
+
+    int threads = (int)g_get_num_processors();
+    ExportCodec *codec = g_new0(ExportCodec, 1);
+    codec->compression = compression;
+    if (compression == COMPRESS_ZSTD) {
+        codec->zstd = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(codec->zstd, ZSTD_c_compressionLevel, 3);
+        if (threads > 1) {
+            // Ignored by a libzstd built without threads
+            ZSTD_CCtx_setParameter(codec->zstd, ZSTD_c_nbWorkers, threads);
+        }
+        codec->out_size = ZSTD_CStreamOutSize();
+        codec->out = g_malloc(codec->out_size);
+    } else {
+        g_mutex_init(&codec->lock);
+        g_cond_init(&codec->cond);
+        g_queue_init(&codec->gzip_blocks);
+        codec->gzip_pool = g_thread_pool_new(gzip_block_compress, codec, threads, TRUE, NULL);
+        codec->gzip_max_blocks = 2 * threads;
+    }
+
+    sink->write = compressed_sink_write;
+    sink->finish = compressed_sink_finish;
+    sink->fd = -1; // Bytes have to pass through the compressor
+    sink->state = codec;
+}
+
+// Append text to out as the inside of a JSON string; bytes that are not
+// valid UTF-8 become U+FFFD. With partial set, an incomplete character at
+// the end is left alone and the number of bytes it has is returned, so the
+// caller can complete it from its next block.
+static size_t json_escape_append(GString *out, const char *text, size_t len, gboolean partial) {
+    const guchar *pos = (const guchar *)text;
+    const guchar *end = pos + len;
+    while (pos < end) {
+        const guchar *run = pos;
+        while (pos < end && *pos >= 0x20 && *pos < 0x80 && *pos != '"' && *pos != '\\') pos++;
+        g_string_append_len(out, (const char *)run, pos - run);
+        if (pos == end) break;
+
+        if (*pos < 0x80) {
+            switch (*pos) {
+                case '"':  g_string_append(out, "\\\""); break;
+                case '\\': g_string_append(out, "\\\\"); break;
+                case '\n': g_string_append(out, "\\n"); break;
+                case '\r': g_string_append(out, "\\r"); break;
+                case '\t': g_string_append(out, "\\t"); break;
+                default:   g_string_append_printf(out, "\\u%04x", *pos); break;
+            }
+            pos++;
+            continue;
+        }
+
+        gunichar ch = g_utf8_get_char_validated((const char *)pos, end - pos);
+        if (ch == (gunichar)-2 && partial) return end - pos;
+        if (ch == (gunichar)-1 || ch == (gunichar)-2) {
+            g_string_append(out, "\\ufffd");
+            pos++;
+            continue;
+        }
+        const guchar *next = (const guchar *)g_utf8_next_char(pos);
+        g_string_append_len(out, (const char *)pos, next - pos);
+        pos = next;
+    }
+    return 0;
+}
+
+// State of a sink that writes what it is given into another sink as the
+// contents of a JSON string
+typedef struct {
+    ExportSink *target;
+    GString *input;     // Not escaped yet: an incomplete character between writes
+    GString *escaped;
+} JsonStringState;
+
+static gboolean json_sink_escape(ExportSink *sink, gboolean partial) {
+    JsonStringState *state = sink->state;
+    g_string_truncate(state->escaped, 0);
+    size_t left = json_escape_append(state->escaped, state->input->str, state->input->len, partial);
+    g_string_erase(state->input, 0, state->input->len - left);
+    return export_sink_write(state->target, state->escaped->str, state->escaped->len);
+}
+
+static gboolean json_sink_write(ExportSink *sink, const char *data, size_t len) {
+    JsonStringState *state = sink->state;
+    while (len > 0) {
+        size_t part = MIN(len, EXPORT_CHUNK_SIZE);
+        g_string_append_len(state->input, data, part);
+        if (!json_sink_escape(sink, TRUE)) return FALSE;
+        data += part;
+        len -= part;
+    }
+    return TRUE;
+}
+
+// Ends one string; the sink can be used for the next one
+static gboolean json_sink_finish(ExportSink *sink) {
+    return json_sink_escape(sink, FALSE);
+}
+
+void export_sink_init_json_string(ExportSink *sink, JsonStringState *state, ExportSink *target) {
+    memset(sink, 0, sizeof(*sink));
+    state->target = target;
+    state->input = g_string_new(NULL);
+    state->escaped = g_string_new(NULL);
+    sink->write = json_sink_write;
+    sink->finish = json_sink_finish;
+    sink->fd = -1;
+    sink->state = state;
+}
+
+void json_string_state_clear(JsonStringState *state) {
+    g_string_free(state->input, TRUE);
+    g_string_free(state->escaped, TRUE);
+}
+
+// Write text into sink as a quoted JSON string, using scratch for the escaping
+gboolean export_sink_put_json(ExportSink *sink, GString *scratch, const char *text) {
+    g_string_assign(scratch, "\"");
+    json_escape_append(scratch, text, strlen(text), FALSE);
+    g_string_append_c(scratch, '"');
+    return export_sink_write(sink, scratch->str, scratch->len);
+}
+
+// Let the kernel copy in_fd into the sink's descriptor (copy_file_range,
+// or sendfile when the two files cannot share a copy, e.g. across
+// filesystems or into a pipe), so the bytes never enter user space.
+// Returns FALSE without writing anything if neither call is supported for
+// this pair of descriptors; otherwise check sink->failed.
+static gboolean sink_copy_from_fd(ExportSink *sink, int in_fd, size_t size_hint) {
+    if (fflush(sink->file) != 0) {
+        sink->failed = TRUE;
+        return TRUE;
+    }
+
+    gboolean use_sendfile = FALSE;
+    size_t copied = 0;
+    for (;;) {
+        // Ask for the rest of the file; keep going until EOF in case it grew
+        size_t want = size_hint > copied ? size_hint - copied : EXPORT_CHUNK_SIZE;
+        stats_count(STAT_COPY_CALLS, 1);
+        ssize_t n = use_sendfile ? sendfile(sink->fd, in_fd, NULL, want)
+                                 : copy_file_range(in_fd, NULL, sink->fd, NULL, want, 0);
+        if (n > 0) {
+            copied += n;
+            continue;
+        }
+        if (n == 0) break;
+        if (errno == EINTR) continue;
+        if (copied == 0 && !use_sendfile &&
+            (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+            use_sendfile = TRUE;
+            continue;
+        }
+        if (copied == 0 && use_sendfile && (errno == EINVAL || errno == ENOSYS)) {
+            return FALSE;
+        }
+        sink->failed = TRUE;
+        break;
+    }
+
+    sink->bytes_written += copied;
+    return TRUE;
+}
+
+// Write a file's content into the sink, touching each byte as little as possible:
+//  - file sinks get a kernel-side copy (no user-space buffer at all)
+//  - large files are mmap'ed and written straight from the page cache
+//  - small files are read into the caller's reusable chunk buffer
+// Returns FALSE if the file could not be opened or read.
+gboolean stream_file_content(const char *path, ExportSink *sink, char *chunk, size_t chunk_size) {
+    stats_count(STAT_OPEN_CALLS, 1);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open file %s\n", path);
+        return FALSE;
+    }
+    stats_count(STAT_STAT_CALLS, 1);
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        return FALSE;
+    }
+    size_t file_size = S_ISREG(file_stat.st_mode) ? (size_t)file_stat.st_size : 0;
+    stats_count(STAT_BYTES_READ, file_size); // Copied, mapped or read below
+
+    if (sink->fd != -1 && file_size > 0 && sink_copy_from_fd(sink, fd, file_size)) {
+        close(fd);
+        return TRUE;
+    }
+
+    if (file_size >= MMAP_THRESHOLD) {
+        void *map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, file_size, MADV_SEQUENTIAL);
+            export_sink_write(sink, map, file_size);
+            munmap(map, file_size);
+            close(fd);
+            return TRUE;
+        }
+    }
+
+    gboolean ok = TRUE;
+    for (;;) {
+        stats_count(STAT_READ_CALLS, 1);
+        ssize_t read_size = read(fd, chunk, chunk_size);
+        if (read_size > 0) {
+            if (!export_sink_write(sink, chunk, read_size)) break;
+        } else if (read_size == 0) {
+            break;
+        } else if (errno != EINTR) {
+            ok = FALSE;
+            break;
+        }
+    }
+
+    close(fd);
+    return ok;
+}
+
+// Function to determine file language extension
+const char* get_language_extension(const char *filename) {
+    char *dot = strrchr(filename, '.');
+    if (dot) {
+        return dot + 1;  // Return extension without the dot
+    }
+    return "";
+}
+
+// Find the KnownExtension of an extension (without the dot), ignoring case
+KnownExtension lookup_known_extension(const char *ext) {
+    char lower[KNOWN_EXTENSION_MAX_LEN + 1];
+    size_t len = 0;
+    for (; ext[len]; len++) {
+        if (len == KNOWN_EXTENSION_MAX_LEN) return EXT_UNKNOWN;
+        lower[len] = g_ascii_tolower(ext[len]);
+    }
+    if (len == 0) return EXT_UNKNOWN;
+    lower[len] = '\0';
+
+    KnownExtension id = known_extension_slots[EXTENSION_SLOT(len, (guchar)lower[0], (guchar)lower[len - 1])];
+    return strcmp(known_extension_names[id], lower) == 0 ? id : EXT_UNKNOWN;
+}
+
+// Number of known project types
+int project_type_count(void) {
+    int count = 0;
+    while (project_types[count].name != NULL) count++;
+    return count;
+}
+
+// Look up a project type by name (case-insensitive), e.g. "C/C++" or "python"
+int find_project_type(const char *name) {
+    for (int i = 0; project_types[i].name != NULL; i++) {
+        if (strcasecmp(name, project_types[i].name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// --- Extension Filters ---
+
+// Which files to export: the union of any number of project types and extra
+// extensions, compiled to a bitset of known extensions plus a set for the
+// rest. Checking an extension costs the same however many are enabled.
+typedef struct {
+    gboolean allow_all;
+    guint64 known;          // Bitset of KnownExtension
+    GHashTable *custom;     // Lowercase extensions that have no KnownExtension, or NULL
+} ExtensionFilter;
+
+void extension_filter_init(ExtensionFilter *filter) {
+    filter->allow_all = FALSE;
+    filter->known = 0;
+    filter->custom = NULL;
+}
+
+void extension_filter_clear(ExtensionFilter *filter) {
+    if (filter->custom) g_hash_table_destroy(filter->custom);
+    extension_filter_init(filter);
+}
+
+void extension_filter_copy(ExtensionFilter *dest, const ExtensionFilter *src) {
+    dest->allow_all = src->allow_all;
+    dest->known = src->known;
+    dest->custom = NULL;
+    if (src->custom) {
+        GHashTableIter iter;
+        gpointer ext;
+        dest->custom = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        g_hash_table_iter_init(&iter, src->custom);
+        while (g_hash_table_iter_next(&iter, &ext, NULL)) {
+            g_hash_table_add(dest->custom, g_strdup(ext));
+        }
+    }
+}
+
+// Allow a project type's extensions; a negative index allows every file
+void extension_filter_add_project_type(ExtensionFilter *filter, int project_type_index) {
+    if (project_type_index < 0) {
+        filter->allow_all = TRUE;
+    } else {
+        filter->known |= project_types[project_type_index].extensions;
+    }
+}
+
+// Allow one extension (without the dot), e.g. "md"
+void extension_filter_add_extension(ExtensionFilter *filter, const char *ext) {
+    KnownExtension id = lookup_known_extension(ext);
+    if (id != EXT_UNKNOWN) {
+        filter->known |= EXT_BIT(id);
+        return;
+    }
+    if (!filter->custom) {
+        filter->custom = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    g_hash_table_add(filter->custom, g_ascii_strdown(ext, -1));
+}
+
+// Check an extension whose KnownExtension was already looked up
+gboolean extension_filter_matches(const ExtensionFilter *filter, KnownExtension id, const char *ext) {
+    if (filter->allow_all) return TRUE;
+    if (id != EXT_UNKNOWN) return (filter->known & EXT_BIT(id)) != 0;
+    if (!filter->custom || !ext) return FALSE;
+
+    char *lower = g_ascii_strdown(ext, -1);
+    gboolean found = g_hash_table_contains(filter->custom, lower);
+    g_free(lower);
+    return found;
+}
+
+// --- Token Estimation ---
+
+// Approximate token counts, for fitting an export into a model's context
+// window. Text is split into runs of one byte class (letters, digits,
+// punctuation, spaces, line breaks), roughly where BPE tokenizers split it,
+// and each run is charged what such a tokenizer typically spends on it. A
+// single table lookup per byte, so counting is far cheaper than reading.
+
+#define TOKENS_UNKNOWN G_MAXUINT32              // Not counted yet
+#define TOKEN_COUNT_MAX_FILE (4 * 1024 * 1024)  // Larger files are estimated from their size
+#define TOKENS_PER_FILE_HEADER 6                // Markdown around each exported file, besides its path
+
+enum {
+    BYTE_PUNCT,     // Also control characters
+    BYTE_SPACE,
+    BYTE_NEWLINE,
+    BYTE_WORD,
+    BYTE_DIGIT,
+    BYTE_HIGH,      // Part of a multi-byte UTF-8 character
+};
+
+static const guint8 token_byte_classes[256] = {
+    [' '] = BYTE_SPACE, ['\t'] = BYTE_SPACE,
+    ['\n'] = BYTE_NEWLINE, ['\r'] = BYTE_NEWLINE,
+    ['a' ... 'z'] = BYTE_WORD, ['A' ... 'Z'] = BYTE_WORD,
+    ['0' ... '9'] = BYTE_DIGIT,
+    [0x80 ... 0xff] = BYTE_HIGH,
+};
+
+guint64 estimate_tokens(const char *text, size_t len) {
+    const guchar *pos = (const guchar *)text;
+    const guchar *end = pos + len;
+    guint64 tokens = 0;
+    while (pos < end) {
+        guint8 byte_class = token_byte_classes[*pos];
+        const guchar *start = pos++;
+        while (pos < end && token_byte_classes[*pos] == byte_class) pos++;
+        size_t run = pos - start;
+
+        switch (byte_class) {
+            case BYTE_WORD:    tokens += (run + 4) / 5; break;
+            case BYTE_DIGIT:   tokens += (run + 2) / 3; break;
+            case BYTE_SPACE:   tokens += (run > 1); break; // A single space joins the next word
+            case BYTE_NEWLINE: tokens += 1; break;
+            default:           tokens += (run + 1) / 2; break;
+        }
+    }
+    return tokens;
+}
+
+// For files too large to count or not counted yet
+guint64 estimate_tokens_from_size(guint64 size) {
+    return (size + 3) / 4;
+}
+
+// --- Content Sniffing ---
+
+// An extension says little about what a file holds: a .js can be a minified
+// bundle, a .json megabytes of generated data, a .c a binary that happens to
+// be named like one. The walker sniffs the first SNIFF_BYTES of the files it
+// inspects, eight bytes at a time, and files that look binary or generated
+// start out deselected. Only the raw findings are kept in the index, so
+// changing the limits does not mean reading the files again.
+
+#define SNIFF_BYTES 8192                // Bytes looked at from the start of a file
+#define SNIFF_DENSE_MIN_BYTES 2048      // Smaller samples are never called dense
+#define SNIFF_DENSE_LINE 250            // Average line length of a minified file
+#define DEFAULT_MAX_FILE_SIZE (1024 * 1024)
+#define DEFAULT_MAX_LINE_LENGTH 2000
+
+enum {
+    CONTENT_SNIFFED = 1 << 0,
+    CONTENT_BINARY  = 1 << 1,   // NUL bytes or invalid UTF-8
+    CONTENT_DENSE   = 1 << 2,   // Few line breaks for its size, as in minified code
+};
+
+typedef enum {
+    SKIP_NONE,
+    SKIP_TOO_LARGE,
+    SKIP_BINARY,
+    SKIP_GENERATED,
+} SkipReason;
+
+static const char *skip_reason_names[] = {"", "too large", "binary", "generated"};
+
+// Which files the file table leaves deselected
+typedef struct {
+    guint64 max_file_size;      // 0 for no limit
+    guint32 max_line_length;    // Within the sniffed start; 0 for no limit
+} ContentLimits;
+
+#define SWAR_ONES  G_GUINT64_CONSTANT(0x0101010101010101)
+#define SWAR_LOWS  G_GUINT64_CONSTANT(0x7f7f7f7f7f7f7f7f)
+#define SWAR_HIGHS G_GUINT64_CONSTANT(0x8080808080808080)
+
+// High bit set in each byte of word that is zero, and nowhere else
+static inline guint64 swar_zero_bytes(guint64 word) {
+    return ~(((word & SWAR_LOWS) + SWAR_LOWS) | word | SWAR_LOWS);
+}
+
+// Sniff a file from the first len bytes of its content (complete if that is
+// all of it). Returns CONTENT_* flags and the longest line seen.
+guint8 sniff_content(const char *data, size_t len, gboolean complete, guint16 *longest_line) {
+    const guchar *bytes = (const guchar *)data;
+    size_t line_start = 0, longest = 0, lines = 0;
+    guint64 high_bits = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        guint64 word;
+        memcpy(&word, bytes + i, 8);
+        word = GUINT64_FROM_LE(word); // Lowest address in the lowest byte
+        if (swar_zero_bytes(word)) return CONTENT_SNIFFED | CONTENT_BINARY;
+        high_bits |= word & SWAR_HIGHS;
+        for (guint64 newlines = swar_zero_bytes(word ^ (SWAR_ONES * '\n')); newlines; newlines &= newlines - 1) {
+            size_t pos = i + __builtin_ctzll(newlines) / 8;
+            longest = MAX(longest, pos - line_start);
+            line_start = pos + 1;
+            lines++;
+        }
+    }
+    for (; i < len; i++) {
+        if (bytes[i] == '\0') return CONTENT_SNIFFED | CONTENT_BINARY;
+        high_bits |= bytes[i] & 0x80;
+        if (bytes[i] == '\n') {
+            longest = MAX(longest, i - line_start);
+            line_start = i + 1;
+            lines++;
+        }
+    }
+    longest = MAX(longest, len - line_start);
+    *longest_line = MIN(longest, G_MAXUINT16);
+
+    guint8 flags = CONTENT_SNIFFED;
+    const char *end = NULL;
+    // Pure ASCII needs no further checks; a sample may cut the last character short
+    if (high_bits && !g_utf8_validate(data, len, &end) && (complete || (size_t)(end - data) + 4 <= len)) {
+        flags |= CONTENT_BINARY;
+    }
+    if (len >= SNIFF_DENSE_MIN_BYTES && len / (lines + 1) > SNIFF_DENSE_LINE) {
+        flags |= CONTENT_DENSE;
+    }
+    return flags;
+}
+
+// Decide whether a file of size bytes with the given sniffing results is
+// left out, or SKIP_NONE
+SkipReason content_skip_reason(const ContentLimits *limits, guint64 size, guint8 flags, guint16 longest_line) {
+    if (!limits) return SKIP_NONE;
+    if (limits->max_file_size > 0 && size > limits->max_file_size) return SKIP_TOO_LARGE;
+    if (flags & CONTENT_BINARY) return SKIP_BINARY;
+    if ((flags & CONTENT_DENSE) || (limits->max_line_length > 0 && longest_line > limits->max_line_length)) {
+        return SKIP_GENERATED;
+    }
+    return SKIP_NONE;
+}
+
+// --- Scan Index ---
+
+// Everything the last walk of a project found: every regular file (not just
+// the ones the current project type allows) with its size, mtime, inode,
+// token count and sniffing results, grouped by directory. The index is
+// saved in the config directory, and the next scan of the same root only
+// lists directories whose mtime changed.
+
+#define INDEX_MAGIC "CBEIDX04"
+
+typedef struct {
+    const char *name;
+    guint64 size;
+    gint64 mtime;       // Nanoseconds since the epoch
+    guint64 inode;
+    guint32 tokens;     // Estimated tokens of the content, or TOKENS_UNKNOWN
+    guint8 content;     // CONTENT_* flags, 0 if not sniffed
+    guint16 longest_line; // Within the sniffed start
+} IndexFile;
+
+// A directory's files and subdirectory names are sorted by name
+typedef struct {
+    const char *path;
+    gint64 mtime;
+    guint64 device;
+    guint64 inode;
+    guint first_file;       // This directory's files are files[first_file...]
+    guint file_count;
+    guint first_subdir;     // Its subdirectory names are subdirs[first_subdir...]
+    guint subdir_count;
+    gint64 ignore_stamp;    // Identifies its .gitignore/.ignore files, 0 if it has none
+    gboolean rescanned;     // Listed by the last walk rather than taken from the index (not saved)
+} IndexDir;
+
+struct ScanIndex {
+    gint ref_count;
+    char *root;
+    guint32 ignore_signature; // Global exclude settings the walk used
+    GArray *dirs;           // IndexDir, sorted with compare_paths
+    GArray *files;          // IndexFile
+    GPtrArray *subdirs;     // Subdirectory names (const char *)
+    GPtrArray *arenas;      // GStringChunk * holding every string above
+    GArray *ext_ids;        // guint32 per file, into extensions (not saved)
+    GPtrArray *extensions;  // Distinct extensions, pointing into file names; [0] is NULL for none
+    GByteArray *extension_kinds; // KnownExtension of each of extensions
+    gboolean dirty;         // Differs from the copy saved on disk
+};
+
+#define INDEX_DIR(index, i) (&g_array_index((index)->dirs, IndexDir, (i)))
+#define INDEX_FILE(index, i) (&g_array_index((index)->files, IndexFile, (i)))
+
+static ScanIndex *scan_index_new(const char *root) {
+    ScanIndex *index = g_new0(ScanIndex, 1);
+    index->ref_count = 1;
+    index->root = g_strdup(root);
+    index->dirs = g_array_new(FALSE, FALSE, sizeof(IndexDir));
+    index->files = g_array_new(FALSE, FALSE, sizeof(IndexFile));
+    index->subdirs = g_ptr_array_new();
+    index->arenas = g_ptr_array_new_with_free_func((GDestroyNotify)g_string_chunk_free);
+    index->ext_ids = g_array_new(FALSE, FALSE, sizeof(guint32));
+    index->extensions = g_ptr_array_new();
+    index->extension_kinds = g_byte_array_new();
+    return index;
+}
+
+ScanIndex *scan_index_ref(ScanIndex *index) {
+    g_atomic_int_inc(&index->ref_count);
+    return index;
+}
+
+void scan_index_unref(ScanIndex *index) {
+    if (!index || !g_atomic_int_dec_and_test(&index->ref_count)) return;
+    g_free(index->root);
+    g_array_free(index->dirs, TRUE);
+    g_array_free(index->files, TRUE);
+    g_ptr_array_free(index->subdirs, TRUE);
+    g_ptr_array_free(index->arenas, TRUE);
+    g_array_free(index->ext_ids, TRUE);
+    g_ptr_array_free(index->extensions, TRUE);
+    g_byte_array_free(index->extension_kinds, TRUE);
+    g_free(index);
+}
+
+// Give every file of the index the ID of its extension, so a filter is
+// decided once per distinct extension rather than once per file
+static void scan_index_intern_extensions(ScanIndex *index) {
+    GHashTable *ids = g_hash_table_new(g_str_hash, g_str_equal);
+    guint8 unknown = EXT_UNKNOWN;
+    g_ptr_array_set_size(index->extensions, 0);
+    g_ptr_array_add(index->extensions, NULL);
+    g_byte_array_set_size(index->extension_kinds, 0);
+    g_byte_array_append(index->extension_kinds, &unknown, 1);
+    g_array_set_size(index->ext_ids, index->files->len);
+
+    guint32 *ext_ids = (guint32 *)index->ext_ids->data;
+    for (guint i = 0; i < index->files->len; i++) {
+        const char *dot = strrchr(INDEX_FILE(index, i)->name, '.');
+        if (!dot) {
+            ext_ids[i] = 0;
+            continue;
+        }
+        gpointer id;
+        if (!g_hash_table_lookup_extended(ids, dot + 1, NULL, &id)) {
+            id = GUINT_TO_POINTER(index->extensions->len);
+            guint8 kind = lookup_known_extension(dot + 1);
+            g_ptr_array_add(index->extensions, (gpointer)(dot + 1));
+            g_byte_array_append(index->extension_kinds, &kind, 1);
+            g_hash_table_insert(ids, (gpointer)(dot + 1), id);
+        }
+        ext_ids[i] = GPOINTER_TO_UINT(id);
+    }
+    g_hash_table_destroy(ids);
+}
+
+static gint64 stat_mtime_ns(const struct stat *st) {
+    return (gint64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Where the index of root is saved; free with g_free. Indexes are named by
+// a hash of the root, which is also stored inside to catch collisions.
+static char *scan_index_file_path(const char *root) {
+    const char *home_dir = getenv("HOME");
+    if (!home_dir) return NULL;
+    return g_strdup_printf("%s/%s/%s/%08x.idx", home_dir, CONFIG_DIR_SUFFIX, INDEX_DIR_NAME, g_str_hash(root));
+}
+
+static void index_put(GString *out, const void *data, size_t len) {
+    g_string_append_len(out, data, len);
+}
+
+static void index_put_string(GString *out, const char *text) {
+    guint32 len = strlen(text);
+    index_put(out, &len, sizeof(len));
+    index_put(out, text, len);
+}
+
+// Save the index so the next scan of its root can start from it. The file
+// is written with native byte order; it is a cache, not a format to share.
+gboolean scan_index_save(ScanIndex *index) {
+    char *path = scan_index_file_path(index->root);
+    if (!path) return FALSE;
+    gint64 started = stats_begin();
+
+    char *dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+
+    GString *out = g_string_sized_new(64 * 1024);
+    guint32 dir_count = index->dirs->len;
+    index_put(out, INDEX_MAGIC, strlen(INDEX_MAGIC));
+    index_put_string(out, index->root);
+    index_put(out, &index->ignore_signature, sizeof(index->ignore_signature));
+    index_put(out, &dir_count, sizeof(dir_count));
+    for (guint i = 0; i < index->dirs->len; i++) {
+        const IndexDir *index_dir = INDEX_DIR(index, i);
+        guint32 counts[2] = {index_dir->file_count, index_dir->subdir_count};
+        index_put_string(out, index_dir->path);
+        index_put(out, &index_dir->mtime, sizeof(index_dir->mtime));
+        index_put(out, &index_dir->device, sizeof(index_dir->device));
+        index_put(out, &index_dir->inode, sizeof(index_dir->inode));
+        index_put(out, &index_dir->ignore_stamp, sizeof(index_dir->ignore_stamp));
+        index_put(out, counts, sizeof(counts));
+        for (guint j = 0; j < index_dir->file_count; j++) {
+            const IndexFile *file = INDEX_FILE(index, index_dir->first_file + j);
+            index_put_string(out, file->name);
+            index_put(out, &file->size, sizeof(file->size));
+            index_put(out, &file->mtime, sizeof(file->mtime));
+            index_put(out, &file->inode, sizeof(file->inode));
+            index_put(out, &file->tokens, sizeof(file->tokens));
+            index_put(out, &file->content, sizeof(file->content));
+            index_put(out, &file->longest_line, sizeof(file->longest_line));
+        }
+        for (guint j = 0; j < index_dir->subdir_count; j++) {
+            index_put_string(out, g_ptr_array_index(index->subdirs, index_dir->first_subdir + j));
+        }
+    }
+
+    GError *error = NULL;
+    gboolean saved = g_file_set_contents(path, out->str, out->len, &error);
+    if (saved) {
+        index->dirty = FALSE;
+    } else {
+        fprintf(stderr, "Failed to save scan index %s: %s\n", path, error->message);
+        g_error_free(error);
+    }
+    g_string_free(out, TRUE);
+    g_free(path);
+    stats_end_phase("save index", started);
+    return saved;
+}
+
+// Cursor over a saved index. Reads past the end set failed instead of
+// crashing, so a truncated or foreign file is simply ignored.
+typedef struct {
+    const char *pos;
+    const char *end;
+    gboolean failed;
+} IndexReader;
+
+static void index_get(IndexReader *reader, void *data, size_t len) {
+    if (reader->failed || (size_t)(reader->end - reader->pos) < len) {
+        reader->failed = TRUE;
+        memset(data, 0, len);
+        return;
+    }
+    memcpy(data, reader->pos, len);
+    reader->pos += len;
+}
+
+static const char *index_get_string(IndexReader *reader, GStringChunk *arena) {
+    guint32 len;
+    index_get(reader, &len, sizeof(len));
+    if (reader->failed || (size_t)(reader->end - reader->pos) < len) {
+        reader->failed = TRUE;
+        return "";
+    }
+    const char *text = g_string_chunk_insert_len(arena, reader->pos, len);
+    reader->pos += len;
+    return text;
+}
+
+// Load the saved index of root. Returns NULL if there is none or it cannot
+// be used.
+ScanIndex *scan_index_load(const char *root) {
+    gint64 started = stats_begin();
+    char *path = scan_index_file_path(root);
+    char *contents = NULL;
+    gsize length = 0;
+    ScanIndex *index = NULL;
+    if (!path || !g_file_get_contents(path, &contents, &length, NULL)) goto done;
+
+    index = scan_index_new(root);
+    GStringChunk *arena = g_string_chunk_new(MAX(length, 256));
+    g_ptr_array_add(index->arenas, arena);
+
+    // An index from another version is silently replaced
+    size_t magic_len = strlen(INDEX_MAGIC);
+    if (length < magic_len || memcmp(contents, INDEX_MAGIC, magic_len) != 0) {
+        g_clear_pointer(&index, scan_index_unref);
+        goto done;
+    }
+
+    IndexReader reader = {contents + magic_len, contents + length, FALSE};
+    guint32 dir_count = 0;
+    if (strcmp(index_get_string(&reader, arena), root) != 0) {
+        reader.failed = TRUE;
+    }
+    index_get(&reader, &index->ignore_signature, sizeof(index->ignore_signature));
+    index_get(&reader, &dir_count, sizeof(dir_count));
+
+    for (guint32 i = 0; i < dir_count && !reader.failed; i++) {
+        IndexDir index_dir = {0};
+        guint32 counts[2];
+        index_dir.path = index_get_string(&reader, arena);
+        index_get(&reader, &index_dir.mtime, sizeof(index_dir.mtime));
+        index_get(&reader, &index_dir.device, sizeof(index_dir.device));
+        index_get(&reader, &index_dir.inode, sizeof(index_dir.inode));
+        index_get(&reader, &index_dir.ignore_stamp, sizeof(index_dir.ignore_stamp));
+        index_get(&reader, counts, sizeof(counts));
+        index_dir.first_file = index->files->len;
+        index_dir.file_count = counts[0];
+        index_dir.first_subdir = index->subdirs->len;
+        index_dir.subdir_count = counts[1];
+        for (guint32 j = 0; j < counts[0] && !reader.failed; j++) {
+            IndexFile file;
+            file.name = index_get_string(&reader, arena);
+            index_get(&reader, &file.size, sizeof(file.size));
+            index_get(&reader, &file.mtime, sizeof(file.mtime));
+            index_get(&reader, &file.inode, sizeof(file.inode));
+            index_get(&reader, &file.tokens, sizeof(file.tokens));
+            index_get(&reader, &file.content, sizeof(file.content));
+            index_get(&reader, &file.longest_line, sizeof(file.longest_line));
+            g_array_append_val(index->files, file);
+        }
+        for (guint32 j = 0; j < counts[1] && !reader.failed; j++) {
+            g_ptr_array_add(index->subdirs, (gpointer)index_get_string(&reader, arena));
+        }
+        g_array_append_val(index->dirs, index_dir);
+    }
+
+    if (reader.failed) {
+        fprintf(stderr, "Ignoring unreadable scan index for %s\n", root);
+        g_clear_pointer(&index, scan_index_unref);
+    } else {
+        scan_index_intern_extensions(index);
+    }
+
+done:
+    // Every return goes through here, so a rejected index is timed too
+    g_free(contents);
+    g_free(path);
+    stats_end_phase("load index", started);
+    return index;
+}
+
+// --- Project Type Detection ---
+
+// A project's types are scored from one listing of its root directory:
+// build and manifest files there vote for the type they belong to, and so
+// do source files next to them. When a scan index of the project is at
+// hand, the extensions of all its files vote too. Every type that scores
+// well enough is returned, so a Gradle app with a package.json is both
+// Android and Web/Node.js. Costs one directory read and a pass over memory.
+
+#define DETECT_MIN_SCORE 6          // Below this a type is not detected
+#define DETECT_SOURCE_WEIGHT 2      // Per source file in the root
+#define DETECT_SOURCE_MAX 6         // Cap on what root source files add per type
+#define DETECT_INDEX_WEIGHT 12      // What a type's share of the indexed source files can add
+// Configuration formats every kind of project has; they say nothing about its type
+#define DETECT_NEUTRAL_EXTENSIONS (EXT_BIT(EXT_JSON) | EXT_BIT(EXT_XML))
+
+typedef struct {
+    const char *name;   // File or directory in the project root
+    ProjectTypeId type;
+    int weight;
+} ProjectMarker;
+
+static const ProjectMarker project_markers[] = {
+    {"build.gradle", PROJECT_ANDROID, 10},
+    {"build.gradle.kts", PROJECT_ANDROID, 10},
+    {"settings.gradle", PROJECT_ANDROID, 8},
+    {"settings.gradle.kts", PROJECT_ANDROID, 8},
+    {"gradlew", PROJECT_ANDROID, 4},
+    {"AndroidManifest.xml", PROJECT_ANDROID, 10},
+    {"package.json", PROJECT_WEB, 10},
+    {"tsconfig.json", PROJECT_WEB, 8},
+    {"index.html", PROJECT_WEB, 6},
+    {"requirements.txt", PROJECT_PYTHON, 10},
+    {"pyproject.toml", PROJECT_PYTHON, 10},
+    {"setup.py", PROJECT_PYTHON, 10},
+    {"setup.cfg", PROJECT_PYTHON, 6},
+    {"Pipfile", PROJECT_PYTHON, 8},
+    {"CMakeLists.txt", PROJECT_C, 10},
+    {"meson.build", PROJECT_C, 10},
+    {"configure.ac", PROJECT_C, 8},
+    {"Makefile", PROJECT_C, 3},
+    {"go.mod", PROJECT_GO, 10},
+    {"go.sum", PROJECT_GO, 4},
+    {"Cargo.toml", PROJECT_RUST, 10},
+    {"Cargo.lock", PROJECT_RUST, 4},
+    {NULL, 0, 0}
+};
+
+// Add the votes of one file or directory name in the root to scores
+static void detect_score_name(const char *name, int *scores, int *source_scores) {
+    for (const ProjectMarker *marker = project_markers; marker->name; marker++) {
+        if (strcmp(name, marker->name) == 0) {
+            scores[marker->type] += marker->weight;
+            return;
+        }
+    }
+    const char *dot = strrchr(name, '.');
+    KnownExtension kind = dot ? lookup_known_extension(dot + 1) : EXT_UNKNOWN;
+    if (kind == EXT_UNKNOWN || (EXT_BIT(kind) & DETECT_NEUTRAL_EXTENSIONS)) return;
+    for (int i = 0; project_types[i].name != NULL; i++) {
+        if (project_types[i].extensions & EXT_BIT(kind)) {
+            source_scores[i] = MIN(source_scores[i] + DETECT_SOURCE_WEIGHT, DETECT_SOURCE_MAX);
+        }
+    }
+}
+
+// Add what share of the source files in index each type has to scores
+static void detect_score_index(const ScanIndex *index, int *scores) {
+    guint counts[EXT_COUNT] = {0};
+    const guint32 *ext_ids = (const guint32 *)index->ext_ids->data;
+    for (guint i = 0; i < index->ext_ids->len; i++) {
+        counts[index->extension_kinds->data[ext_ids[i]]]++;
+    }
+    guint64 *type_files = g_new0(guint64, project_type_count());
+    guint64 total = 0;
+    for (int kind = EXT_UNKNOWN + 1; kind < EXT_COUNT; kind++) {
+        if (EXT_BIT(kind) & DETECT_NEUTRAL_EXTENSIONS) continue;
+        total += counts[kind];
+        for (int i = 0; project_types[i].name != NULL; i++) {
+            if (project_types[i].extensions & EXT_BIT(kind)) type_files[i] += counts[kind];
+        }
+    }
+    for (int i = 0; total > 0 && project_types[i].name != NULL; i++) {
+        scores[i] += (int)(DETECT_INDEX_WEIGHT * type_files[i] / total);
+    }
+    g_free(type_files);
+}
+
+// Score every project type for the project at project_path; index (a scan
+// of the same root) is optional. scores must have project_type_count() slots.
+static void detect_score_project_types(const char *project_path, const ScanIndex *index, int *scores) {
+    int type_count = project_type_count();
+    int *source_scores = g_new0(int, type_count);
+    memset(scores, 0, type_count * sizeof(int));
+
+    DIR *dir = opendir(project_path);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') detect_score_name(entry->d_name, scores, source_scores);
+        }
+        closedir(dir);
+    }
+    for (int i = 0; i < type_count; i++) {
+        scores[i] += source_scores[i];
+    }
+    if (index) detect_score_index(index, scores);
+    g_free(source_scores);
+}
+
+// Detect the project types of project_path: a bitset with bit i set for
+// project_types[i], 0 if none is recognised. Types scoring at least half
+// of the best one are included. index is optional, as above.
+guint64 detect_project_types(const char *project_path, const ScanIndex *index) {
+    int type_count = project_type_count();
+    int *scores = g_new(int, type_count);
+    detect_score_project_types(project_path, index, scores);
+    int best = 0;
+    for (int i = 0; i < type_count; i++) {
+        best = MAX(best, scores[i]);
+    }
+    guint64 types = 0;
+    for (int i = 0; i < type_count && best >= DETECT_MIN_SCORE; i++) {
+        if (scores[i] >= DETECT_MIN_SCORE && 2 * scores[i] >= best) types |= G_GUINT64_CONSTANT(1) << i;
+    }
+    g_free(scores);
+    return types;
+}
+
+// Add every type in types (from detect_project_types()) to filter
+void extension_filter_add_project_types(ExtensionFilter *filter, guint64 types) {
+    for (int i = 0; project_types[i].name != NULL; i++) {
+        if (types & (G_GUINT64_CONSTANT(1) << i)) extension_filter_add_project_type(filter, i);
+    }
+}
+
+// --- File Table ---
+
+#define FILE_TABLE_ENTRY(table, i) (&g_array_index((table)->entries, FileEntry, (i)))
+#define FILE_TABLE_ROOT(table, i) (&g_array_index((table)->roots, FileTableRoot, (i)))
+
+FileTable *file_table_new(void) {
+    FileTable *table = g_new(FileTable, 1);
+    table->ref_count = 1;
+    table->entries = g_array_new(FALSE, FALSE, sizeof(FileEntry));
+    table->roots = g_array_new(FALSE, FALSE, sizeof(FileTableRoot));
+    table->selected_tokens = 0;
+    table->skipped = 0;
+    return table;
+}
+
+// Add the files in index that the filter allows as the table's next root,
+// in index order. Every file starts out selected, except those that limits
+// (if not NULL) leave out. This is a pass over memory only, so changing the
+// project type never touches the disk. Files the scan did not count tokens
+// for are estimated from their size.
+void file_table_add_index(FileTable *table, ScanIndex *index, const ExtensionFilter *filter,
+                          const ContentLimits *limits) {
+    gint64 started = stats_begin();
+    const char *root_path = index->root;
+    size_t name_end = strlen(root_path);
+    while (name_end > 1 && root_path[name_end - 1] == '/') name_end--;
+    size_t parent_len = name_end;
+    while (parent_len > 0 && root_path[parent_len - 1] != '/') parent_len--;
+    FileTableRoot root = {scan_index_ref(index), g_strndup(root_path + parent_len, name_end - parent_len),
+                          name_end > 0 && root_path[name_end - 1] == '/' ? name_end : name_end + 1, parent_len};
+    g_array_append_val(table->roots, root);
+
+    // Decide each distinct extension once, then test files by their IDs
+    guint8 *allowed = g_new(guint8, index->extensions->len);
+    for (guint i = 0; i < index->extensions->len; i++) {
+        allowed[i] = extension_filter_matches(filter, index->extension_kinds->data[i],
+                                              g_ptr_array_index(index->extensions, i));
+    }
+
+    const guint32 *ext_ids = (const guint32 *)index->ext_ids->data;
+    size_t root_len = strlen(index->root);
+    for (guint i = 0; i < index->dirs->len; i++) {
+        const IndexDir *index_dir = INDEX_DIR(index, i);
+        FileEntry entry = {i, NULL, 0, TRUE, SKIP_NONE, table->roots->len - 1};
+        guint64 dir_tokens = 0; // Of the path in each file's header
+        if (strlen(index_dir->path) > root_len) {
+            dir_tokens = estimate_tokens(index_dir->path + root_len, strlen(index_dir->path + root_len));
+        }
+        for (guint j = index_dir->first_file; j < index_dir->first_file + index_dir->file_count; j++) {
+            if (allowed[ext_ids[j]]) {
+                const IndexFile *file = INDEX_FILE(index, j);
+                guint64 tokens = file->tokens != TOKENS_UNKNOWN ? file->tokens : estimate_tokens_from_size(file->size);
+                tokens += TOKENS_PER_FILE_HEADER + dir_tokens + estimate_tokens(file->name, strlen(file->name));
+                entry.filename = file->name;
+                entry.tokens = MIN(tokens, G_MAXUINT32);
+                entry.skip = content_skip_reason(limits, file->size, file->content, file->longest_line);
+                entry.selected = entry.skip == SKIP_NONE;
+                if (entry.selected) {
+                    table->selected_tokens += entry.tokens;
+                } else {
+                    table->skipped++;
+                }
+                g_array_append_val(table->entries, entry);
+            }
+        }
+    }
+    g_free(allowed);
+    stats_end_phase("filter", started);
+}
+
+// Build the table of the files in index that the filter allows; see
+// file_table_add_index()
+FileTable *file_table_new_from_index(ScanIndex *index, const ExtensionFilter *filter, const ContentLimits *limits) {
+    FileTable *table = file_table_new();
+    file_table_add_index(table, index, filter, limits);
+    return table;
+}
+
+FileTable *file_table_ref(FileTable *table) {
+    g_atomic_int_inc(&table->ref_count);
+    return table;
+}
+
+void file_table_unref(FileTable *table) {
+    if (!table || !g_atomic_int_dec_and_test(&table->ref_count)) return;
+    g_array_free(table->entries, TRUE);
+    for (guint i = 0; i < table->roots->len; i++) {
+        scan_index_unref(FILE_TABLE_ROOT(table, i)->index);
+        g_free(FILE_TABLE_ROOT(table, i)->name);
+    }
+    g_array_free(table->roots, TRUE);
+    g_free(table);
+}
+
+guint file_table_count(const FileTable *table) {
+    return table ? table->entries->len : 0;
+}
+
+// Write the full path of entry into out, replacing its previous content
+void file_table_entry_path(const FileTable *table, const FileEntry *entry, GString *out) {
+    g_string_assign(out, INDEX_DIR(FILE_TABLE_ROOT(table, entry->root)->index, entry->dir_index)->path);
+    if (out->len == 0 || out->str[out->len - 1] != '/') {
+        g_string_append_c(out, '/');
+    }
+    g_string_append(out, entry->filename);
+}
+
+// The index record of entry, found by name among its directory's files
+const IndexFile *file_table_entry_file(const FileTable *table, const FileEntry *entry) {
+    const ScanIndex *index = FILE_TABLE_ROOT(table, entry->root)->index;
+    const IndexDir *dir = INDEX_DIR(index, entry->dir_index);
+    guint low = dir->first_file, high = dir->first_file + dir->file_count;
+    while (low < high) {
+        guint middle = low + (high - low) / 2;
+        int order = strcmp(INDEX_FILE(index, middle)->name, entry->filename);
+        if (order == 0) return INDEX_FILE(index, middle);
+        if (order < 0) low = middle + 1; else high = middle;
+    }
+    return NULL;
+}
+
+// Where the path of entry, as shown in exports and the file list, starts in
+// its full path: after its root, or in a table of several roots, at the
+// root's name so that paths from different roots stay apart
+size_t file_table_relative_offset(const FileTable *table, const FileEntry *entry) {
+    const FileTableRoot *root = FILE_TABLE_ROOT(table, entry->root);
+    return table->roots->len > 1 ? root->parent_len : root->prefix_len;
+}
+
+// Whether a and b were built from the same roots, in the same order
+gboolean file_table_same_roots(const FileTable *a, const FileTable *b) {
+    if (!a || !b || a->roots->len != b->roots->len) return FALSE;
+    for (guint i = 0; i < a->roots->len; i++) {
+        if (strcmp(FILE_TABLE_ROOT(a, i)->index->root, FILE_TABLE_ROOT(b, i)->index->root) != 0) return FALSE;
+    }
+    return TRUE;
+}
+
+// Whether table holds exactly the roots of workspace, in that order
+gboolean file_table_is_workspace(const FileTable *table, const char *workspace) {
+    if (!table) return FALSE;
+    char **roots = workspace_split(workspace);
+    gboolean same = g_strv_length(roots) == table->roots->len;
+    for (guint i = 0; same && i < table->roots->len; i++) {
+        same = strcmp(FILE_TABLE_ROOT(table, i)->index->root, roots[i]) == 0;
+    }
+    g_strfreev(roots);
+    return same;
+}
+
+// Select or deselect an entry, keeping the token total current
+void file_table_set_selected(FileTable *table, FileEntry *entry, gboolean selected) {
+    if (entry->selected == selected) return;
+    entry->selected = selected;
+    if (selected) {
+        table->selected_tokens += entry->tokens;
+    } else {
+        table->selected_tokens -= entry->tokens;
+    }
+}
+
+// Select exactly the entries whose path as shown in exports is one of
+// paths, or lies under one of them that ends in '/'. Files that content
+// limits left out are selected too when asked for. Returns the number of
+// entries selected.
+guint file_table_select_paths(FileTable *table, char **paths) {
+    GHashTable *files = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTable *names = g_hash_table_new(g_str_hash, g_str_equal); // Last components of files
+    GPtrArray *dirs = g_ptr_array_new();
+    for (char **path = paths; *path; path++) {
+        if (g_str_has_suffix(*path, "/")) {
+            g_ptr_array_add(dirs, *path);
+        } else {
+            const char *slash = strrchr(*path, '/');
+            g_hash_table_add(files, *path);
+            g_hash_table_add(names, (gpointer)(slash ? slash + 1 : *path));
+        }
+    }
+
+    // Only entries that can match need their path built
+    GString *path = g_string_new(NULL);
+    guint selected = 0;
+    for (guint i = 0; i < table->entries->len; i++) {
+        FileEntry *entry = FILE_TABLE_ENTRY(table, i);
+        gboolean wanted = FALSE;
+        if (dirs->len > 0 || g_hash_table_contains(names, entry->filename)) {
+            file_table_entry_path(table, entry, path);
+            const char *relative = path->str + file_table_relative_offset(table, entry);
+            wanted = g_hash_table_contains(files, relative);
+            for (guint d = 0; d < dirs->len && !wanted; d++) {
+                wanted = g_str_has_prefix(relative, g_ptr_array_index(dirs, d));
+            }
+        }
+        file_table_set_selected(table, entry, wanted);
+        selected += wanted;
+    }
+    g_string_free(path, TRUE);
+    g_ptr_array_free(dirs, TRUE);
+    g_hash_table_destroy(names);
+    g_hash_table_destroy(files);
+    return selected;
+}
+
+// Make the selection fit in budget tokens: going through the selected files
+// in table order, keep each one that still fits next to those kept before
+// it and deselect the rest. Returns the number of files deselected.
+guint file_table_fit_budget(FileTable *table, guint64 budget) {
+    guint64 used = 0;
+    guint dropped = 0;
+    for (guint i = 0; i < table->entries->len; i++) {
+        FileEntry *entry = FILE_TABLE_ENTRY(table, i);
+        if (!entry->selected) continue;
+        if (used + entry->tokens <= budget) {
+            used += entry->tokens;
+        } else {
+            file_table_set_selected(table, entry, FALSE);
+            dropped++;
+        }
+    }
+    return dropped;
+}
+
+// Lower the estimate of every entry to at most max_tokens, for an export
+// that cuts large files down to an excerpt of about that size
+void file_table_cap_tokens(FileTable *table, guint32 max_tokens) {
+    for (guint i = 0; i < table->entries->len; i++) {
+        FileEntry *entry = FILE_TABLE_ENTRY(table, i);
+        if (entry->tokens <= max_tokens) continue;
+        if (entry->selected) table->selected_tokens -= entry->tokens - max_tokens;
+        entry->tokens = max_tokens;
+    }
+}
+
+// Carry the unchecked files of from over to the same paths in to, so a
+// refresh of the same project keeps the user's choices
+void file_table_copy_selection(FileTable *to, const FileTable *from) {
+    GHashTable *unselected = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GString *path = g_string_new(NULL);
+    for (guint i = 0; i < from->entries->len; i++) {
+        const FileEntry *entry = FILE_TABLE_ENTRY(from, i);
+        if (!entry->selected) {
+            file_table_entry_path(from, entry, path);
+            g_hash_table_add(unselected, g_strdup(path->str));
+        }
+    }
+
+    if (g_hash_table_size(unselected) > 0) {
+        for (guint i = 0; i < to->entries->len; i++) {
+            FileEntry *entry = FILE_TABLE_ENTRY(to, i);
+            file_table_entry_path(to, entry, path);
+            if (g_hash_table_contains(unselected, path->str)) {
+                file_table_set_selected(to, entry, FALSE);
+            }
+        }
+    }
+    g_string_free(path, TRUE);
+    g_hash_table_destroy(unselected);
+}
+
+// --- Ignore Rules ---
+
+// The walker prunes what .gitignore and .ignore files exclude, plus a set of
+// global excludes (dependency caches and build output by default, the
+// user's own globs from the config directory and --exclude). Every
+// directory being walked carries the rules that apply to it as a chain of
+// IgnoreFrames: one per directory with ignore files, linked to the frame of
+// its parent. Excluded subdirectories are never opened.
+
+#define EXCLUDE_FILE_NAME "exclude" // Global exclude globs, gitignore syntax, in the config directory
+
+// Pruned unless an ignore file says otherwise (e.g. "!build/")
+static const char *default_excludes[] = {
+    "node_modules/", "bower_components/", "build/", "target/", "vendor/", "__pycache__/", NULL
+};
+
+typedef enum {
+    IGNORE_LITERAL,     // Plain name, e.g. "node_modules"
+    IGNORE_EXTENSION,   // "*.ext"
+    IGNORE_GLOB,        // Anything else, matched with glob_match()
+} IgnoreRuleKind;
+
+typedef struct {
+    char *pattern;
+    IgnoreRuleKind kind;
+    gboolean negated;   // "!pattern" re-includes
+    gboolean dir_only;  // "pattern/" only matches directories
+    gboolean anchored;  // Matched against the path below the frame's directory, not just the name
+} IgnoreRule;
+
+// The rules of one directory's ignore files. Rules are indexed by how they
+// match, so checking a name costs a couple of hash lookups plus the few real
+// globs, however many rules there are.
+typedef struct IgnoreFrame IgnoreFrame;
+struct IgnoreFrame {
+    gint ref_count;
+    IgnoreFrame *parent;    // Rules of the enclosing directories, checked after these
+    char *base;             // Directory the rules belong to, with a trailing '/'
+    size_t base_len;
+    GArray *rules;          // IgnoreRule, in file order; later rules win
+    GHashTable *literals;   // Name -> GArray of rule indices
+    GHashTable *extensions; // Extension -> GArray of rule indices
+    GArray *globs;          // Indices of the IGNORE_GLOB rules
+    guint32 signature;      // Hash of the rules, to notice when they change
+};
+
+IgnoreFrame *ignore_frame_new(IgnoreFrame *parent, const char *dir_path) {
+    IgnoreFrame *frame = g_new0(IgnoreFrame, 1);
+    frame->ref_count = 1;
+    frame->parent = parent;
+    frame->base = g_str_has_suffix(dir_path, "/") ? g_strdup(dir_path) : g_strconcat(dir_path, "/", NULL);
+    frame->base_len = strlen(frame->base);
+    frame->rules = g_array_new(FALSE, FALSE, sizeof(IgnoreRule));
+    frame->literals = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_array_unref);
+    frame->extensions = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_array_unref);
+    frame->globs = g_array_new(FALSE, FALSE, sizeof(guint));
+    frame->signature = 5381;
+    return frame;
+}
+
+IgnoreFrame *ignore_frame_ref(IgnoreFrame *frame) {
+    if (frame) g_atomic_int_inc(&frame->ref_count);
+    return frame;
+}
+
+void ignore_frame_unref(IgnoreFrame *frame) {
+    while (frame && g_atomic_int_dec_and_test(&frame->ref_count)) {
+        IgnoreFrame *parent = frame->parent;
+        for (guint i = 0; i < frame->rules->len; i++) {
+            g_free(g_array_index(frame->rules, IgnoreRule, i).pattern);
+        }
+        g_array_free(frame->rules, TRUE);
+        g_hash_table_destroy(frame->literals);
+        g_hash_table_destroy(frame->extensions);
+        g_array_free(frame->globs, TRUE);
+        g_free(frame->base);
+        g_free(frame);
+        frame = parent; // Drop the reference this frame held
+    }
+}
+
+static gboolean has_glob_chars(const char *text) {
+    return strpbrk(text, "*?[\\") != NULL;
+}
+
+static void ignore_frame_index_rule(GHashTable *table, const char *key, guint rule_index) {
+    GArray *indices = g_hash_table_lookup(table, key);
+    if (!indices) {
+        indices = g_array_new(FALSE, FALSE, sizeof(guint));
+        g_hash_table_insert(table, (gpointer)key, indices);
+    }
+    g_array_append_val(indices, rule_index);
+}
+
+// Add one line of gitignore syntax. Comments and blank lines are skipped.
+void ignore_frame_add_rule(IgnoreFrame *frame, const char *line) {
+    char *pattern = g_strdup(line);
+    size_t len = strlen(pattern);
+    // Trailing spaces are dropped unless escaped
+    while (len > 0 && (pattern[len - 1] == '\r' || pattern[len - 1] == '\n' ||
+                       (pattern[len - 1] == ' ' && (len < 2 || pattern[len - 2] != '\\')))) {
+        pattern[--len] = '\0';
+    }
+    if (len == 0 || pattern[0] == '#') {
+        g_free(pattern);
+        return;
+    }
+
+    IgnoreRule rule = {0};
+    char *start = pattern;
+    if (*start == '!') {
+        rule.negated = TRUE;
+        start++;
+    } else if (*start == '\\' && (start[1] == '!' || start[1] == '#')) {
+        start++;
+    }
+    len = strlen(start);
+    if (len > 0 && start[len - 1] == '/') {
+        rule.dir_only = TRUE;
+        start[--len] = '\0';
+    }
+    rule.anchored = strchr(start, '/') != NULL;
+    if (*start == '/') start++;
+    if (*start == '\0') {
+        g_free(pattern);
+        return;
+    }
+    rule.pattern = g_strdup(start);
+    g_free(pattern);
+
+    frame->signature = (frame->signature * 33) ^ g_str_hash(line);
+    guint rule_index = frame->rules->len;
+    if (!rule.anchored && !has_glob_chars(rule.pattern)) {
+        rule.kind = IGNORE_LITERAL;
+        g_array_append_val(frame->rules, rule);
+        ignore_frame_index_rule(frame->literals, rule.pattern, rule_index);
+    } else if (!rule.anchored && g_str_has_prefix(rule.pattern, "*.") &&
+               !has_glob_chars(rule.pattern + 2) && !strchr(rule.pattern + 2, '.')) {
+        rule.kind = IGNORE_EXTENSION;
+        g_array_append_val(frame->rules, rule);
+        ignore_frame_index_rule(frame->extensions, rule.pattern + 2, rule_index);
+    } else {
+        rule.kind = IGNORE_GLOB;
+        g_array_append_val(frame->rules, rule);
+        g_array_append_val(frame->globs, rule_index);
+    }
+}
+
+// Add the rules of an ignore file. Returns FALSE if it cannot be read.
+gboolean ignore_frame_add_file(IgnoreFrame *frame, const char *path) {
+    char *contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) return FALSE;
+
+    char **lines = g_strsplit(contents, "\n", -1);
+    for (char **line = lines; *line; line++) {
+        ignore_frame_add_rule(frame, *line);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return TRUE;
+}
+
+// Match text against a gitignore glob: * and ? stay within one path
+// component, ** spans any number of them and [...] is a character class
+static gboolean glob_match(const char *pattern, const char *text) {
+    while (*pattern) {
+        switch (*pattern) {
+            case '*':
+                if (pattern[1] == '*') {
+                    const char *rest = pattern + 2;
+                    if (*rest == '/') {
+                        // "**/" matches zero or more whole directories
+                        rest++;
+                        for (const char *t = text; ; t = strchr(t, '/') + 1) {
+                            if (glob_match(rest, t)) return TRUE;
+                            if (!strchr(t, '/')) return FALSE;
+                        }
+                    }
+                    for (const char *t = text; ; t++) {
+                        if (glob_match(rest, t)) return TRUE;
+                        if (!*t) return FALSE;
+                    }
+                }
+                for (const char *t = text; ; t++) {
+                    if (glob_match(pattern + 1, t)) return TRUE;
+                    if (!*t || *t == '/') return FALSE;
+                }
+            case '?':
+                if (!*text || *text == '/') return FALSE;
+                pattern++;
+                text++;
+                break;
+            case '[': {
+                const char *p = pattern + 1;
+                gboolean negate = (*p == '!' || *p == '^');
+                if (negate) p++;
+                gboolean found = FALSE;
+                if (!*p) goto literal; // "[" or "[!" ends the pattern: nothing to scan
+                // A ']' right after the bracket is a literal
+                do {
+                    if (p[1] == '-' && p[2] && p[2] != ']') {
+                        found |= (*text >= p[0] && *text <= p[2]);
+                        p += 3;
+                    } else {
+                        found |= (*text == *p);
+                        p++;
+                    }
+                } while (*p && *p != ']');
+                if (!*p) goto literal; // Unterminated: treat '[' literally
+                if (!*text || *text == '/' || found == negate) return FALSE;
+                pattern = p + 1;
+                text++;
+                break;
+            }
+            case '\\':
+                if (pattern[1]) pattern++;
+                /* fall through */
+            default:
+            literal:
+                if (*pattern != *text) return FALSE;
+                pattern++;
+                text++;
+                break;
+        }
+    }
+    return *text == '\0';
+}
+
+static gboolean ignore_rule_matches(const IgnoreRule *rule, const char *name, const char *rel_path, gboolean is_dir) {
+    if (rule->dir_only && !is_dir) return FALSE;
+    switch (rule->kind) {
+        case IGNORE_LITERAL:
+        case IGNORE_EXTENSION:
+            return TRUE; // Already matched by the hash lookup
+        default:
+            return glob_match(rule->pattern, rule->anchored ? rel_path : name);
+    }
+}
+
+// Return the index of the last rule among candidates that matches, if it
+// comes after rule best; otherwise best
+static gint ignore_frame_last_match(const IgnoreFrame *frame, GArray *candidates, gint best,
+                                    const char *name, const char *rel_path, gboolean is_dir) {
+    if (!candidates) return best;
+    for (guint i = candidates->len; i-- > 0; ) {
+        guint rule_index = g_array_index(candidates, guint, i);
+        if ((gint)rule_index <= best) break;
+        if (ignore_rule_matches(&g_array_index(frame->rules, IgnoreRule, rule_index), name, rel_path, is_dir)) {
+            return rule_index;
+        }
+    }
+    return best;
+}
+
+// Decide whether the entry at path (whose last component is name) is
+// excluded. The innermost frame with a matching rule decides, and within a
+// frame the last matching rule wins, as in git.
+gboolean ignore_frame_excludes(const IgnoreFrame *frame, const char *path, const char *name, gboolean is_dir) {
+    const char *dot = strrchr(name, '.');
+    for (; frame; frame = frame->parent) {
+        if (frame->rules->len == 0 || strncmp(path, frame->base, frame->base_len) != 0) continue;
+        const char *rel_path = path + frame->base_len;
+
+        gint best = -1;
+        best = ignore_frame_last_match(frame, g_hash_table_lookup(frame->literals, name), best, name, rel_path, is_dir);
+        if (dot) {
+            best = ignore_frame_last_match(frame, g_hash_table_lookup(frame->extensions, dot + 1), best,
+                                           name, rel_path, is_dir);
+        }
+        best = ignore_frame_last_match(frame, frame->globs, best, name, rel_path, is_dir);
+        if (best >= 0) {
+            return !g_array_index(frame->rules, IgnoreRule, best).negated;
+        }
+    }
+    return FALSE;
+}
+
+// The frame of global excludes for a walk of root: the defaults (unless
+// use_defaults is FALSE), the user's exclude file and extra globs.
+IgnoreFrame *ignore_frame_new_global(const char *root, gboolean use_defaults, char **extra_excludes) {
+    IgnoreFrame *frame = ignore_frame_new(NULL, root);
+    if (use_defaults) {
+        for (int i = 0; default_excludes[i] != NULL; i++) {
+            ignore_frame_add_rule(frame, default_excludes[i]);
+        }
+    }
+
+    const char *home_dir = getenv("HOME");
+    if (home_dir) {
+        char *path = g_strdup_printf("%s/%s/%s", home_dir, CONFIG_DIR_SUFFIX, EXCLUDE_FILE_NAME);
+        ignore_frame_add_file(frame, path);
+        g_free(path);
+    }
+
+    for (char **exclude = extra_excludes; exclude && *exclude; exclude++) {
+        ignore_frame_add_rule(frame, *exclude);
+    }
+    return frame;
+}
+
+// --- Directory Scanning ---
+
+// What a walk leaves out, besides hidden entries
+typedef struct {
+    IgnoreFrame *excludes;      // Global excludes, or NULL
+    gboolean use_ignore_files;  // Honour .gitignore and .ignore files
+    const ExtensionFilter *count_tokens; // Count the tokens of the files it allows, or NULL
+    const ExtensionFilter *sniff;       // Sniff the content of the files it allows, or NULL
+} ScanOptions;
+
+// A directory waiting to be walked
+typedef struct {
+    const char *path;       // In a worker arena
+    IgnoreFrame *ignore;    // Rules that apply inside it (a reference), or NULL
+    gboolean force;         // Rules above it changed, so its index entry cannot be trusted
+} ScanItem;
+
+static void scan_item_clear(ScanItem *item) {
+    ignore_frame_unref(item->ignore);
+}
+
+// Identifies a directory however it was reached
+typedef struct {
+    guint64 device;
+    guint64 inode;
+} DirIdentity;
+
+static guint dir_identity_hash(gconstpointer key) {
+    const DirIdentity *id = key;
+    return g_int64_hash(&id->inode) * 31 + g_int64_hash(&id->device);
+}
+
+static gboolean dir_identity_equal(gconstpointer a, gconstpointer b) {
+    const DirIdentity *x = a, *y = b;
+    return x->inode == y->inode && x->device == y->device;
+}
+
+// Shared state of one parallel walk. Worker threads pull directories from a
+// shared stack, list them, push the subdirectories they find back and keep
+// what they found in per-worker lists, so the only contended operation is
+// the queue hand-off.
+typedef struct {
+    GMutex lock;
+    GCond cond;
+    GArray *pending;        // ScanItem, directories waiting to be listed
+    GHashTable *visited;    // DirIdentity of every directory entered, breaks symlink loops
+    GHashTable *previous;   // Path -> IndexDir of the previous walk, read-only
+    const ScanIndex *previous_index;
+    gboolean use_ignore_files;
+    const ExtensionFilter *token_filter; // Files to count tokens of, or NULL
+    const ExtensionFilter *sniff_filter; // Files to sniff, or NULL
+    int busy_workers;       // Workers currently listing a directory
+    GCancellable *cancellable;
+    TaskProgress *progress;
+} ScanContext;
+
+typedef struct {
+    ScanContext *ctx;
+    GStringChunk *arena;    // Directory paths and names found by this worker
+    GArray *files;          // IndexFile, grouped per directory
+    GPtrArray *subdirs;     // Subdirectory names, grouped per directory
+    GArray *dirs;           // ScanDir
+    GString *scratch;       // Path building buffer
+    GByteArray *content;    // File being inspected
+    Arena records;          // Visited keys, freed with the walk
+    gboolean inspected;     // Counted or sniffed files, so the index changed even where no listing did
+} ScanWorker;
+
+// A directory listed by a walker thread. dir.first_file and dir.first_subdir
+// point into the worker's lists until the walk is merged into an index.
+typedef struct {
+    IndexDir dir;
+    const ScanWorker *worker;
+} ScanDir;
+
+// Resolve the type of a directory entry, using d_type when the filesystem
+// provides it and falling back to fstatat() (which follows symlinks) otherwise.
+// Regular files are always stat'ed, since the index records their size and mtime.
+static int scan_entry_stat(int dir_fd, struct dirent *entry, struct stat *file_stat) {
+    if (entry->d_type == DT_DIR) return DT_DIR;
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK && entry->d_type != DT_REG) {
+        return entry->d_type;
+    }
+
+    stats_count(STAT_STAT_CALLS, 1);
+    if (fstatat(dir_fd, entry->d_name, file_stat, 0) == -1) {
+        return DT_UNKNOWN;
+    }
+    if (S_ISDIR(file_stat->st_mode)) return DT_DIR;
+    if (S_ISREG(file_stat->st_mode)) return DT_REG;
+    return DT_UNKNOWN;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static int compare_index_files(const void *a, const void *b) {
+    return strcmp(((const IndexFile *)a)->name, ((const IndexFile *)b)->name);
+}
+
+// Identify a directory's ignore files by their size, mtime and inode, so
+// that editing one is noticed. Returns 0 if the directory has none.
+static gint64 scan_ignore_stamp(GString *scratch, const char *dir_path) {
+    static const char *ignore_names[] = {".gitignore", ".ignore"};
+    gint64 stamp = 0;
+    for (int i = 0; i < 2; i++) {
+        g_string_printf(scratch, "%s/%s", dir_path, ignore_names[i]);
+        struct stat file_stat;
+        if (stat(scratch->str, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+            stamp = (stamp * 1000003) ^ stat_mtime_ns(&file_stat) ^ ((gint64)file_stat.st_size << 32) ^
+                    (gint64)file_stat.st_ino ^ (i + 1);
+            if (stamp == 0) stamp = 1;
+        }
+    }
+    return stamp;
+}
+
+// The rules for the inside of a directory: its own ignore files on top of
+// the rules it inherits. Returns a new reference.
+static IgnoreFrame *scan_ignore_frame(GString *scratch, const char *dir_path, IgnoreFrame *inherited) {
+    IgnoreFrame *frame = ignore_frame_new(ignore_frame_ref(inherited), dir_path);
+    g_string_printf(scratch, "%s/.gitignore", dir_path);
+    ignore_frame_add_file(frame, scratch->str);
+    g_string_printf(scratch, "%s/.ignore", dir_path);
+    ignore_frame_add_file(frame, scratch->str);
+    return frame;
+}
+
+// Read a directory's entries into the worker's lists, leaving out what the
+// ignore rules exclude
+static void scan_read_directory(ScanWorker *worker, int dir_fd, ScanDir *scan_dir, const IgnoreFrame *ignore) {
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        perror("fdopendir failed");
+        close(dir_fd);
+        return;
+    }
+    stats_count(STAT_DIRS, 1);
+    stats_count(STAT_READ_CALLS, 1);
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Skip hidden files/directories and ., ..
+        if (entry->d_name[0] == '.') continue;
+
+        struct stat file_stat;
+        int type = scan_entry_stat(dir_fd, entry, &file_stat);
+        if (ignore && (type == DT_DIR || type == DT_REG)) {
+            g_string_assign(worker->scratch, scan_dir->dir.path);
+            if (worker->scratch->str[worker->scratch->len - 1] != '/') {
+                g_string_append_c(worker->scratch, '/');
+            }
+            g_string_append(worker->scratch, entry->d_name);
+            if (ignore_frame_excludes(ignore, worker->scratch->str, entry->d_name, type == DT_DIR)) continue;
+        }
+
+        if (type == DT_DIR) {
+            g_ptr_array_add(worker->subdirs, g_string_chunk_insert(worker->arena, entry->d_name));
+            scan_dir->dir.subdir_count++;
+        } else if (type == DT_REG) {
+            IndexFile file = {g_string_chunk_insert(worker->arena, entry->d_name), file_stat.st_size,
+                              stat_mtime_ns(&file_stat), file_stat.st_ino, TOKENS_UNKNOWN, 0, 0};
+            g_array_append_val(worker->files, file);
+            scan_dir->dir.file_count++;
+        }
+    }
+    closedir(dir); // Also closes dir_fd
+
+    qsort(&g_array_index(worker->files, IndexFile, scan_dir->dir.first_file),
+          scan_dir->dir.file_count, sizeof(IndexFile), compare_index_files);
+    qsort(worker->subdirs->pdata + scan_dir->dir.first_subdir,
+          scan_dir->dir.subdir_count, sizeof(char *), compare_names);
+}
+
+// Copy a directory's listing from the previous index into the worker's lists
+static void scan_reuse_directory(ScanWorker *worker, const IndexDir *previous, ScanDir *scan_dir) {
+    const ScanIndex *index = worker->ctx->previous_index;
+    for (guint i = 0; i < previous->file_count; i++) {
+        IndexFile file = *INDEX_FILE(index, previous->first_file + i);
+        file.name = g_string_chunk_insert(worker->arena, file.name);
+        g_array_append_val(worker->files, file);
+    }
+    for (guint i = 0; i < previous->subdir_count; i++) {
+        const char *name = g_ptr_array_index(index->subdirs, previous->first_subdir + i);
+        g_ptr_array_add(worker->subdirs, g_string_chunk_insert(worker->arena, name));
+    }
+    scan_dir->dir.file_count = previous->file_count;
+    scan_dir->dir.subdir_count = previous->subdir_count;
+}
+
+// Read from fd into buffer after the length bytes already there, until it
+// holds want bytes or the file ends. Returns the new length.
+static size_t scan_read_content(int fd, GByteArray *buffer, size_t length, size_t want) {
+    if (buffer->len < want) g_byte_array_set_size(buffer, want);
+    while (length < want) {
+        stats_count(STAT_READ_CALLS, 1);
+        ssize_t read_size = read(fd, buffer->data + length, want - length);
+        if (read_size > 0) {
+            length += read_size;
+        } else if (read_size == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    return length;
+}
+
+// Sniff the file at path into file and, if count is set, count its tokens,
+// refreshing its size, mtime and inode from the open file so they describe
+// what was inspected. Only the sniffed start is read of files that look
+// binary or generated; their tokens are estimated from the size.
+static void scan_inspect_file(ScanWorker *worker, const char *path, IndexFile *file, gboolean count) {
+    gint64 started = stats_begin();
+    stats_count(STAT_OPEN_CALLS, 1);
+    stats_count(STAT_STAT_CALLS, 1);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
+        if (fd != -1) close(fd);
+        return;
+    }
+    file->size = file_stat.st_size;
+    file->mtime = stat_mtime_ns(&file_stat);
+    file->inode = file_stat.st_ino;
+    file->tokens = TOKENS_UNKNOWN;
+
+    size_t want = MIN(file->size + 1, SNIFF_BYTES); // +1 to see EOF
+    size_t length = scan_read_content(fd, worker->content, 0, want);
+    file->content = sniff_content((const char *)worker->content->data, length, length < want, &file->longest_line);
+
+    if (count) {
+        if (file->size > TOKEN_COUNT_MAX_FILE || (file->content & (CONTENT_BINARY | CONTENT_DENSE))) {
+            file->tokens = estimate_tokens_from_size(file->size);
+        } else {
+            if (length == want) {
+                want = MAX(want * 2, file->size + 1);
+                while ((length = scan_read_content(fd, worker->content, length, want)) == want) {
+                    want *= 2; // Grew meanwhile
+                }
+            }
+            file->tokens = MIN(estimate_tokens((const char *)worker->content->data, length), TOKENS_UNKNOWN - 1);
+        }
+    }
+    close(fd);
+    task_progress_add(worker->ctx->progress, 0, 0, length);
+    stats_count(STAT_FILES, 1);
+    stats_count(STAT_BYTES_READ, length);
+    stats_end_item("inspect", path, started);
+}
+
+// Fill in the token counts and sniffing results of a directory's files:
+// carried over from the previous listing for files that did not change, and
+// found for the others that the token and sniff filters allow. Editing a
+// file does not touch its directory's mtime, so in a directory taken from
+// the index the inspected files are stat'ed to catch edits.
+static void scan_inspect_files(ScanWorker *worker, ScanDir *scan_dir, const IndexDir *previous) {
+    ScanContext *ctx = worker->ctx;
+    IndexFile *files = &g_array_index(worker->files, IndexFile, scan_dir->dir.first_file);
+    const IndexFile *old_files = previous ? INDEX_FILE(ctx->previous_index, previous->first_file) : NULL;
+    guint old_count = previous ? previous->file_count : 0;
+    guint j = 0;
+
+    for (guint i = 0; i < scan_dir->dir.file_count; i++) {
+        IndexFile *file = &files[i];
+
+        // Both lists are sorted by name
+        if (scan_dir->dir.rescanned && file->tokens == TOKENS_UNKNOWN && !file->content) {
+            while (j < old_count && strcmp(old_files[j].name, file->name) < 0) j++;
+            if (j < old_count && strcmp(old_files[j].name, file->name) == 0 && old_files[j].size == file->size &&
+                old_files[j].mtime == file->mtime && old_files[j].inode == file->inode) {
+                file->tokens = old_files[j].tokens;
+                file->content = old_files[j].content;
+                file->longest_line = old_files[j].longest_line;
+            }
+        }
+
+        const char *dot = strrchr(file->name, '.');
+        const char *ext = dot ? dot + 1 : "";
+        KnownExtension known = lookup_known_extension(ext);
+        gboolean count = ctx->token_filter && extension_filter_matches(ctx->token_filter, known, ext);
+        gboolean sniff = ctx->sniff_filter && extension_filter_matches(ctx->sniff_filter, known, ext);
+        if (!count && !sniff) continue;
+        gboolean known_now = (!count || file->tokens != TOKENS_UNKNOWN) && (!sniff || file->content);
+        if (known_now && scan_dir->dir.rescanned) continue;
+
+        g_string_assign(worker->scratch, scan_dir->dir.path);
+        if (worker->scratch->str[worker->scratch->len - 1] != '/') {
+            g_string_append_c(worker->scratch, '/');
+        }
+        g_string_append(worker->scratch, file->name);
+        if (known_now) {
+            struct stat file_stat;
+            stats_count(STAT_STAT_CALLS, 1);
+            if (stat(worker->scratch->str, &file_stat) == 0 && (guint64)file_stat.st_size == file->size &&
+                stat_mtime_ns(&file_stat) == file->mtime && file_stat.st_ino == file->inode) {
+                continue;
+            }
+        }
+        scan_inspect_file(worker, worker->scratch->str, file, count);
+        worker->inspected = TRUE;
+    }
+}
+
+// List a single directory, or take its listing from the previous index if
+// its mtime shows no entry was added, removed or renamed since and its
+// ignore rules are the same. Token counts and sniffing results are filled
+// in as far as ScanOptions.count_tokens and ScanOptions.sniff ask.
+// Subdirectories that are not excluded are returned in subdirs for the
+// caller to queue.
+static void scan_one_directory(ScanWorker *worker, const ScanItem *item, GArray *subdirs) {
+    ScanContext *ctx = worker->ctx;
+    const char *dir_path = item->path;
+    gint64 started = stats_begin();
+
+    // A stat is all an unchanged directory costs; it is only opened when it
+    // has to be listed
+    struct stat dir_stat;
+    stats_count(STAT_STAT_CALLS, 1);
+    if (stat(dir_path, &dir_stat) == -1) {
+        perror("stat directory failed");
+        return;
+    }
+
+    // Skip directories we have already entered through another path (symlinks)
+    DirIdentity *key = arena_alloc(&worker->records, sizeof(DirIdentity));
+    key->device = dir_stat.st_dev;
+    key->inode = dir_stat.st_ino;
+    g_mutex_lock(&ctx->lock);
+    gboolean seen = !g_hash_table_add(ctx->visited, key);
+    g_mutex_unlock(&ctx->lock);
+    if (seen) return;
+
+    ScanDir scan_dir = {{dir_path, stat_mtime_ns(&dir_stat), dir_stat.st_dev, dir_stat.st_ino,
+                         worker->files->len, 0, worker->subdirs->len, 0, 0, TRUE}, worker};
+    const IndexDir *previous = ctx->previous ? g_hash_table_lookup(ctx->previous, dir_path) : NULL;
+    gboolean unchanged = previous && !item->force && previous->mtime == scan_dir.dir.mtime &&
+                         previous->device == scan_dir.dir.device && previous->inode == scan_dir.dir.inode;
+
+    // Creating an ignore file changes the directory's mtime, so an unchanged
+    // directory that had none still has none
+    IgnoreFrame *ignore = ignore_frame_ref(item->ignore);
+    gboolean rules_changed = FALSE;
+    if (ctx->use_ignore_files && (!unchanged || previous->ignore_stamp != 0)) {
+        scan_dir.dir.ignore_stamp = scan_ignore_stamp(worker->scratch, dir_path);
+        rules_changed = previous ? previous->ignore_stamp != scan_dir.dir.ignore_stamp
+                                 : scan_dir.dir.ignore_stamp != 0;
+        if (scan_dir.dir.ignore_stamp != 0) {
+            ignore_frame_unref(ignore);
+            ignore = scan_ignore_frame(worker->scratch, dir_path, item->ignore);
+        }
+    }
+
+    if (unchanged && !rules_changed) {
+        scan_reuse_directory(worker, previous, &scan_dir);
+        scan_dir.dir.rescanned = FALSE;
+    } else {
+        stats_count(STAT_OPEN_CALLS, 1);
+        int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd == -1) {
+            perror("open directory failed");
+            ignore_frame_unref(ignore);
+            return;
+        }
+        scan_read_directory(worker, dir_fd, &scan_dir, ignore);
+    }
+    if (ctx->token_filter || ctx->sniff_filter || (previous && scan_dir.dir.rescanned)) {
+        scan_inspect_files(worker, &scan_dir, previous);
+    }
+    stats_end_item("scan", dir_path, started);
+
+    for (guint i = 0; i < scan_dir.dir.subdir_count; i++) {
+        g_string_assign(worker->scratch, dir_path);
+        if (worker->scratch->str[worker->scratch->len - 1] != '/') {
+            g_string_append_c(worker->scratch, '/');
+        }
+        g_string_append(worker->scratch, g_ptr_array_index(worker->subdirs, scan_dir.dir.first_subdir + i));
+
+        ScanItem subdir = {g_string_chunk_insert_len(worker->arena, worker->scratch->str, worker->scratch->len),
+                           ignore_frame_ref(ignore), item->force || rules_changed};
+        g_array_append_val(subdirs, subdir);
+    }
+    ignore_frame_unref(ignore);
+
+    g_array_append_val(worker->dirs, scan_dir);
+    task_progress_add(ctx->progress, scan_dir.dir.file_count, 1, 0);
+}
+
+static gpointer scan_worker_thread(gpointer data) {
+    ScanWorker *worker = data;
+    ScanContext *ctx = worker->ctx;
+    GArray *subdirs = g_array_new(FALSE, FALSE, sizeof(ScanItem));
+
+    g_mutex_lock(&ctx->lock);
+    for (;;) {
+        // Wait for work; the walk is over once the queue is empty and nobody
+        // is still listing a directory that could produce more.
+        while (ctx->pending->len == 0 && ctx->busy_workers > 0) {
+            g_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->pending->len == 0 || g_cancellable_is_cancelled(ctx->cancellable)) break;
+
+        ScanItem item = g_array_index(ctx->pending, ScanItem, ctx->pending->len - 1);
+        g_array_set_size(ctx->pending, ctx->pending->len - 1);
+        ctx->busy_workers++;
+        g_mutex_unlock(&ctx->lock);
+
+        scan_one_directory(worker, &item, subdirs);
+        scan_item_clear(&item);
+
+        g_mutex_lock(&ctx->lock);
+        g_array_append_vals(ctx->pending, subdirs->data, subdirs->len);
+        g_array_set_size(subdirs, 0);
+        ctx->busy_workers--;
+        g_cond_broadcast(&ctx->cond);
+    }
+    g_cond_broadcast(&ctx->cond);
+    g_mutex_unlock(&ctx->lock);
+
+    g_array_free(subdirs, TRUE);
+    return NULL;
+}
+
+// Order paths so that every directory sorts directly before its contents
+static int compare_paths(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    int left = (*a == '/') ? 1 : (unsigned char)*a;
+    int right = (*b == '/') ? 1 : (unsigned char)*b;
+    return left - right;
+}
+
+static gint compare_scan_dirs(gconstpointer a, gconstpointer b) {
+    return compare_paths(((const ScanDir *)a)->dir.path, ((const ScanDir *)b)->dir.path);
+}
+
+// Number of walker threads: one per core, within sane bounds
+static int scan_thread_count(void) {
+    int threads = (int)g_get_num_processors();
+    return CLAMP(threads, 1, SCAN_MAX_THREADS);
+}
+
+// Walk dir_path and return a new index of every regular file under it that
+// options do not exclude.
+// The tree is walked by a pool of worker threads; directories and the names
+// inside them are sorted so the order does not depend on thread scheduling.
+// When previous is an index of the same root made with the same global
+// excludes, directories whose mtime has not changed are taken from it
+// instead of being listed again.
+// Touches no globals, so it is safe to run from a background task. The walk
+// stops early when cancellable is cancelled.
+// Returns NULL if the directory cannot be opened.
+ScanIndex *scan_directory(const char *dir_path, const ScanIndex *previous, const ScanOptions *options,
+                          GCancellable *cancellable, TaskProgress *progress) {
+    // Check the root up front so callers can report a bad path
+    int root_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        perror("opendir failed");
+        return NULL;
+    }
+    close(root_fd);
+    gint64 started = stats_begin();
+
+    ScanIndex *index = scan_index_new(dir_path);
+    GStringChunk *root_arena = g_string_chunk_new(256);
+    g_ptr_array_add(index->arenas, root_arena);
+    index->ignore_signature = (options->excludes ? options->excludes->signature : 0) * 2 + options->use_ignore_files;
+
+    ScanContext ctx;
+    g_mutex_init(&ctx.lock);
+    g_cond_init(&ctx.cond);
+    ctx.pending = g_array_new(FALSE, FALSE, sizeof(ScanItem));
+    ctx.visited = g_hash_table_new(dir_identity_hash, dir_identity_equal); // Keys live in the worker arenas
+    ctx.previous = NULL;
+    ctx.previous_index = NULL;
+    ctx.use_ignore_files = options->use_ignore_files;
+    ctx.token_filter = options->count_tokens;
+    ctx.sniff_filter = options->sniff;
+    ctx.busy_workers = 0;
+    ctx.cancellable = cancellable;
+    ctx.progress = progress;
+
+    ScanItem root_item = {g_string_chunk_insert(root_arena, dir_path), ignore_frame_ref(options->excludes), FALSE};
+    g_array_append_val(ctx.pending, root_item);
+
+    if (previous && strcmp(previous->root, dir_path) == 0 && previous->ignore_signature == index->ignore_signature) {
+        ctx.previous_index = previous;
+        ctx.previous = g_hash_table_new(g_str_hash, g_str_equal);
+        for (guint i = 0; i < previous->dirs->len; i++) {
+            const IndexDir *index_dir = INDEX_DIR(previous, i);
+            g_hash_table_insert(ctx.previous, (gpointer)index_dir->path, (gpointer)index_dir);
+        }
+    }
+
+    int thread_count = scan_thread_count();
+    ScanWorker workers[SCAN_MAX_THREADS];
+    GThread *threads[SCAN_MAX_THREADS];
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].ctx = &ctx;
+        workers[i].arena = g_string_chunk_new(64 * 1024);
+        workers[i].files = g_array_new(FALSE, FALSE, sizeof(IndexFile));
+        workers[i].subdirs = g_ptr_array_new();
+        workers[i].dirs = g_array_new(FALSE, FALSE, sizeof(ScanDir));
+        workers[i].scratch = g_string_new(NULL);
+        workers[i].content = g_byte_array_new();
+        arena_init(&workers[i].records);
+        workers[i].inspected = FALSE;
+        threads[i] = g_thread_new("scan-worker", scan_worker_thread, &workers[i]);
+    }
+
+    // Collect every worker's directories; the strings stay in the worker
+    // arenas, which the index takes over
+    GArray *dirs = g_array_new(FALSE, FALSE, sizeof(ScanDir));
+    for (int i = 0; i < thread_count; i++) {
+        g_thread_join(threads[i]);
+        g_array_append_vals(dirs, workers[i].dirs->data, workers[i].dirs->len);
+        g_array_free(workers[i].dirs, TRUE);
+        g_string_free(workers[i].scratch, TRUE);
+        g_byte_array_free(workers[i].content, TRUE);
+        g_ptr_array_add(index->arenas, workers[i].arena);
+    }
+
+    // Sort directories for a deterministic order and lay out their lists
+    // contiguously in the index
+    g_array_sort(dirs, compare_scan_dirs);
+    index->dirty = !ctx.previous || dirs->len != previous->dirs->len;
+    for (int i = 0; i < thread_count; i++) {
+        index->dirty |= workers[i].inspected;
+    }
+    for (guint i = 0; i < dirs->len; i++) {
+        const ScanDir *scan_dir = &g_array_index(dirs, ScanDir, i);
+        IndexDir index_dir = scan_dir->dir;
+        index_dir.first_file = index->files->len;
+        index_dir.first_subdir = index->subdirs->len;
+        g_array_append_vals(index->files, &g_array_index(scan_dir->worker->files, IndexFile, scan_dir->dir.first_file),
+                            index_dir.file_count);
+        for (guint j = 0; j < index_dir.subdir_count; j++) {
+            g_ptr_array_add(index->subdirs, g_ptr_array_index(scan_dir->worker->subdirs, scan_dir->dir.first_subdir + j));
+        }
+        g_array_append_val(index->dirs, index_dir);
+        index->dirty |= index_dir.rescanned;
+    }
+
+    g_array_free(dirs, TRUE);
+    for (int i = 0; i < thread_count; i++) {
+        g_array_free(workers[i].files, TRUE);
+        g_ptr_array_free(workers[i].subdirs, TRUE);
+    }
+    if (ctx.previous) g_hash_table_destroy(ctx.previous);
+    for (guint i = 0; i < ctx.pending->len; i++) {
+        scan_item_clear(&g_array_index(ctx.pending, ScanItem, i)); // Left over when cancelled
+    }
+    g_array_free(ctx.pending, TRUE);
+    g_hash_table_destroy(ctx.visited);
+    for (int i = 0; i < thread_count; i++) {
+        arena_clear(&workers[i].records);
+    }
+    g_cond_clear(&ctx.cond);
+    g_mutex_clear(&ctx.lock);
+
+    scan_index_intern_extensions(index);
+    stats_end_phase("scan", started);
+    return index;
+}
+
+// One directory of a workspace scan
+typedef struct {
+    const char *path;
+    ScanOptions options;
+    ScanIndex *previous;    // Index to start from (a reference), or NULL
+    ScanIndex *index;       // Result, NULL if the directory cannot be opened
+} ScanRoot;
+
+typedef struct {
+    ScanRoot *root;
+    gboolean use_index;
+    GCancellable *cancellable;
+    TaskProgress *progress;
+} ScanRootJob;
+
+// Scan one root. With use_index, a root without a previous index starts
+// from its saved one, and the result is saved when it changed.
+static gpointer scan_root_thread(gpointer data) {
+    ScanRootJob *job = data;
+    ScanRoot *root = job->root;
+    if (job->use_index && !root->previous) {
+        root->previous = scan_index_load(root->path);
+    }
+    root->index = scan_directory(root->path, root->previous, &root->options, job->cancellable, job->progress);
+    if (job->use_index && root->index && root->index->dirty && !g_cancellable_is_cancelled(job->cancellable)) {
+        scan_index_save(root->index);
+    }
+    return NULL;
+}
+
+// Scan the roots of a workspace at the same time, each on a thread of its
+// own with its own walker pool, so the whole workspace takes about as long
+// as its largest root. A single root is scanned on the calling thread.
+void scan_roots(ScanRoot *roots, guint count, gboolean use_index,
+                GCancellable *cancellable, TaskProgress *progress) {
+    ScanRootJob *jobs = g_new(ScanRootJob, count);
+    GThread **threads = g_new0(GThread *, count);
+    for (guint i = 0; i < count; i++) {
+        jobs[i] = (ScanRootJob){&roots[i], use_index, cancellable, progress};
+        if (count > 1) {
+            threads[i] = g_thread_new("scan-root", scan_root_thread, &jobs[i]);
+        } else {
+            scan_root_thread(&jobs[i]);
+        }
+    }
+    for (guint i = 0; i < count; i++) {
+        if (threads[i]) g_thread_join(threads[i]);
+    }
+    g_free(threads);
+    g_free(jobs);
+}
+
+// Drop the references a ScanRoot holds; take one on index first to keep it
+void scan_root_clear(ScanRoot *root) {
+    ignore_frame_unref(root->options.excludes);
+    scan_index_unref(root->previous);
+    scan_index_unref(root->index);
+}
+
+// --- Export Cache ---
+
+// Contents of recently exported files, so pressing Copy or Save again only
+// reads the files that changed since. Entries are keyed on the path and
+// trusted while the file's size, mtime and inode are unchanged; the least
+// recently used ones are dropped beyond max_bytes. Shared by the GUI's
+// export tasks, hence the lock.
+
+#define EXPORT_CACHE_MAX_BYTES (256 * 1024 * 1024)
+#define EXPORT_CACHE_MAX_FILE (16 * 1024 * 1024) // Larger files are always streamed
+
+typedef struct {
+    GList link;         // In ExportCache.lru; link.data is the entry
+    char *path;
+    guint64 size;
+    gint64 mtime;
+    guint64 inode;
+    GBytes *content;
+} ExportCacheEntry;
+
+typedef struct {
+    GMutex lock;
+    GHashTable *entries;    // Path -> ExportCacheEntry
+    GQueue lru;             // Most recently used first
+    gsize bytes;            // Content held
+    gsize max_bytes;
+} ExportCache;
+
+static void export_cache_entry_free(gpointer data) {
+    ExportCacheEntry *entry = data;
+    g_free(entry->path);
+    g_bytes_unref(entry->content);
+    g_free(entry);
+}
+
+ExportCache *export_cache_new(gsize max_bytes) {
+    ExportCache *cache = g_new0(ExportCache, 1);
+    g_mutex_init(&cache->lock);
+    cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, export_cache_entry_free);
+    g_queue_init(&cache->lru);
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+void export_cache_free(ExportCache *cache) {
+    if (!cache) return;
+    g_hash_table_destroy(cache->entries);
+    g_mutex_clear(&cache->lock);
+    g_free(cache);
+}
+
+// Must be called with the lock held
+static void export_cache_remove_locked(ExportCache *cache, ExportCacheEntry *entry) {
+    g_queue_unlink(&cache->lru, &entry->link);
+    cache->bytes -= g_bytes_get_size(entry->content);
+    g_hash_table_remove(cache->entries, entry->path); // Frees entry
+}
+
+// Return the cached content of path if file_stat shows the file is unchanged
+// (a new reference), or NULL
+GBytes *export_cache_lookup(ExportCache *cache, const char *path, const struct stat *file_stat) {
+    GBytes *content = NULL;
+    g_mutex_lock(&cache->lock);
+    ExportCacheEntry *entry = g_hash_table_lookup(cache->entries, path);
+    if (entry) {
+        if (entry->size == (guint64)file_stat->st_size && entry->mtime == stat_mtime_ns(file_stat) &&
+            entry->inode == file_stat->st_ino) {
+            content = g_bytes_ref(entry->content);
+            g_queue_unlink(&cache->lru, &entry->link);
+            g_queue_push_head_link(&cache->lru, &entry->link);
+        } else {
+            export_cache_remove_locked(cache, entry);
+        }
+    }
+    g_mutex_unlock(&cache->lock);
+    return content;
+}
+
+void export_cache_insert(ExportCache *cache, const char *path, const struct stat *file_stat, GBytes *content) {
+    ExportCacheEntry *entry = g_new0(ExportCacheEntry, 1);
+    entry->link.data = entry;
+    entry->path = g_strdup(path);
+    entry->size = file_stat->st_size;
+    entry->mtime = stat_mtime_ns(file_stat);
+    entry->inode = file_stat->st_ino;
+    entry->content = g_bytes_ref(content);
+
+    g_mutex_lock(&cache->lock);
+    ExportCacheEntry *old = g_hash_table_lookup(cache->entries, path);
+    if (old) export_cache_remove_locked(cache, old);
+    g_hash_table_insert(cache->entries, entry->path, entry);
+    g_queue_push_head_link(&cache->lru, &entry->link);
+    cache->bytes += g_bytes_get_size(content);
+    while (cache->bytes > cache->max_bytes && cache->lru.tail != &entry->link) {
+        export_cache_remove_locked(cache, g_queue_peek_tail_link(&cache->lru)->data);
+    }
+    g_mutex_unlock(&cache->lock);
+}
+
+// Read a whole file into memory. file_stat is updated from the open file,
+// so it describes exactly the content returned. Returns NULL on error.
+static GBytes *read_file_bytes(const char *path, struct stat *file_stat) {
+    stats_count(STAT_OPEN_CALLS, 1);
+    stats_count(STAT_STAT_CALLS, 1);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open file %s\n", path);
+        return NULL;
+    }
+    if (fstat(fd, file_stat) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t capacity = file_stat->st_size + 1; // +1 to see EOF without another grow
+    size_t length = 0;
+    char *data = g_malloc(capacity);
+    for (;;) {
+        if (length == capacity) {
+            capacity *= 2;
+            data = g_realloc(data, capacity);
+        }
+        stats_count(STAT_READ_CALLS, 1);
+        ssize_t read_size = read(fd, data + length, capacity - length);
+        if (read_size > 0) {
+            length += read_size;
+        } else if (read_size == 0) {
+            break;
+        } else if (errno != EINTR) {
+            g_free(data);
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
+    stats_count(STAT_BYTES_READ, length);
+    return g_bytes_new_take(data, length);
+}
+
+// The whole content of a file, from the cache when it holds an up-to-date
+// copy (and put in it otherwise). cache may be NULL. Returns NULL on error.
+static GBytes *export_file_bytes(const char *path, ExportCache *cache) {
+    struct stat file_stat;
+    if (!cache) return read_file_bytes(path, &file_stat);
+    stats_count(STAT_STAT_CALLS, 1);
+    GBytes *content = stat(path, &file_stat) == 0 ? export_cache_lookup(cache, path, &file_stat) : NULL;
+    if (!content) {
+        content = read_file_bytes(path, &file_stat);
+        if (content && file_stat.st_size <= EXPORT_CACHE_MAX_FILE) {
+            export_cache_insert(cache, path, &file_stat, content);
+        }
+    }
+    return content;
+}
+
+// Write a file's content into the sink, from the cache when it holds an
+// up-to-date copy. Without a cache this is stream_file_content().
+static gboolean export_file_content(const char *path, ExportSink *sink, ExportCache *cache,
+                                    char *chunk, size_t chunk_size) {
+    struct stat file_stat;
+    if (cache) stats_count(STAT_STAT_CALLS, 1);
+    if (!cache || stat(path, &file_stat) == -1 || file_stat.st_size > EXPORT_CACHE_MAX_FILE) {
+        return stream_file_content(path, sink, chunk, chunk_size);
+    }
+
+    GBytes *content = export_cache_lookup(cache, path, &file_stat);
+    if (!content) {
+        content = read_file_bytes(path, &file_stat);
+        if (!content) return FALSE;
+        export_cache_insert(cache, path, &file_stat, content);
+    }
+
+    gsize length;
+    const char *data = g_bytes_get_data(content, &length);
+    export_sink_write(sink, data, length);
+    g_bytes_unref(content);
+    return TRUE;
+}
+
+// --- Excerpts and Outlines ---
+
+// A huge file (a SQL dump, generated code) can dominate an export. An
+// excerpt policy keeps the head and the tail of a file that is over a size
+// or line limit, with a marker for what was left out between them; only the
+// two ends are read, so the I/O stops at the limit. In outline mode source
+// files are reduced to their declarations and signatures by a line-based
+// lexer first, and the limits then apply to the outline.
+
+typedef struct {
+    guint64 max_bytes;  // Larger files keep about this much of their head and tail, 0 for no limit
+    guint max_lines;    // Likewise for files with more lines, 0 for no limit
+    gboolean outline;   // Export only the declarations of source files
+} ExcerptPolicy;
+
+#define DEFAULT_EXCERPT_BYTES (64 * 1024)
+#define DEFAULT_EXCERPT_LINES 1000
+#define EXCERPT_MARKER_TOKENS 8 // The "[... N bytes elided ...]" line
+
+gboolean excerpt_policy_active(const ExcerptPolicy *policy) {
+    return policy->max_bytes > 0 || policy->max_lines > 0 || policy->outline;
+}
+
+// What an excerpt is taken from: an open file, or data in memory (fd -1)
+typedef struct {
+    int fd;
+    const char *data;
+    guint64 size;
+} ExcerptSource;
+
+static ssize_t excerpt_read(const ExcerptSource *source, char *buffer, size_t length, guint64 offset) {
+    if (offset >= source->size) return 0;
+    length = MIN(length, source->size - offset);
+    if (source->fd == -1) {
+        memcpy(buffer, source->data + offset, length);
+        return length;
+    }
+    ssize_t read_size;
+    do {
+        stats_count(STAT_READ_CALLS, 1);
+        read_size = pread(source->fd, buffer, length, offset);
+    } while (read_size == -1 && errno == EINTR);
+    if (read_size > 0) stats_count(STAT_BYTES_READ, read_size);
+    return read_size;
+}
+
+// Where the head of an excerpt ends: after half of max_lines lines or half
+// of max_bytes bytes (backed up to the end of a line), whichever comes first.
+// Returns source->size when the whole source fits.
+static guint64 excerpt_head_end(const ExcerptSource *source, const ExcerptPolicy *policy,
+                                char *chunk, size_t chunk_size) {
+    guint64 byte_limit = policy->max_bytes ? MIN(source->size, policy->max_bytes / 2) : source->size;
+    guint line_limit = policy->max_lines ? (policy->max_lines + 1) / 2 : G_MAXUINT;
+    guint64 pos = 0, line_end = 0;
+    guint lines = 0;
+    while (pos < byte_limit) {
+        ssize_t read_size = excerpt_read(source, chunk, MIN(chunk_size, byte_limit - pos), pos);
+        if (read_size <= 0) return source->size; // Let the copy report the error
+        for (const char *p = chunk; (p = memchr(p, '\n', chunk + read_size - p)) != NULL; p++) {
+            line_end = pos + (p - chunk) + 1;
+            if (++lines == line_limit && line_end < source->size) return line_end;
+        }
+        pos += read_size;
+    }
+    return (pos < source->size && line_end > 0) ? line_end : pos;
+}
+
+// Where the tail of an excerpt starts: before the last half of max_lines
+// lines or max_bytes bytes (moved up to the start of a line). Never before
+// head_end; returning head_end means the head and tail meet.
+static guint64 excerpt_tail_start(const ExcerptSource *source, const ExcerptPolicy *policy, guint64 head_end,
+                                  char *chunk, size_t chunk_size) {
+    guint64 size = source->size;
+    guint64 byte_limit = policy->max_bytes ? size - MIN(size - head_end, policy->max_bytes / 2) : head_end;
+    guint line_limit = policy->max_lines ? policy->max_lines / 2 : G_MAXUINT;
+    if (line_limit == 0) return size;
+
+    guint64 pos = size, line_start = size;
+    guint lines = 0;
+    while (pos > byte_limit) {
+        size_t length = MIN(chunk_size, pos - byte_limit);
+        if (excerpt_read(source, chunk, length, pos - length) != (ssize_t)length) return head_end;
+        for (size_t i = length; i-- > 0;) {
+            guint64 offset = pos - length + i;
+            if (chunk[i] != '\n' || offset == size - 1) continue; // The last line's newline
+            line_start = offset + 1;
+            if (++lines == line_limit) return line_start;
+        }
+        pos -= length;
+    }
+    if (pos <= head_end) return head_end;
+    return line_start < size ? line_start : pos;
+}
+
+static gboolean excerpt_copy(const ExcerptSource *source, guint64 from, guint64 to, ExportSink *sink,
+                             char *chunk, size_t chunk_size) {
+    while (from < to) {
+        ssize_t read_size = excerpt_read(source, chunk, MIN(chunk_size, to - from), from);
+        if (read_size <= 0) return FALSE;
+        if (!export_sink_write(sink, chunk, read_size)) return TRUE; // The sink reports its own errors
+        from += read_size;
+    }
+    return TRUE;
+}
+
+// Write the source into the sink, cut down to its head and tail if it is
+// over the policy's limits. Returns FALSE if the source could not be read.
+static gboolean export_excerpt(const ExcerptSource *source, const ExcerptPolicy *policy, ExportSink *sink,
+                               char *chunk, size_t chunk_size) {
+    guint64 head_end = excerpt_head_end(source, policy, chunk, chunk_size);
+    guint64 tail_start = head_end < source->size
+        ? excerpt_tail_start(source, policy, head_end, chunk, chunk_size) : head_end;
+    if (tail_start <= head_end) return excerpt_copy(source, 0, source->size, sink, chunk, chunk_size);
+
+    if (!excerpt_copy(source, 0, head_end, sink, chunk, chunk_size)) return FALSE;
+    char last = '\n';
+    if (head_end > 0 && excerpt_read(source, &last, 1, head_end - 1) != 1) return FALSE;
+    char marker[96];
+    int length = g_snprintf(marker, sizeof(marker), "%s[... %" G_GUINT64_FORMAT " bytes elided ...]\n",
+                            last == '\n' ? "" : "\n", tail_start - head_end);
+    export_sink_write(sink, marker, length);
+    return excerpt_copy(source, tail_start, source->size, sink, chunk, chunk_size);
+}
+
+typedef enum {
+    OUTLINE_NONE,       // No outline; the file is excerpted as it is
+    OUTLINE_BRACES,     // C-like block structure, with 'x' character literals
+    OUTLINE_BRACES_JS,  // Block structure with '...' and `...` strings
+    OUTLINE_PYTHON,     // Indentation and def/class
+} OutlineSyntax;
+
+static OutlineSyntax outline_syntax(KnownExtension kind) {
+    switch (kind) {
+        case EXT_C: case EXT_CPP: case EXT_H: case EXT_HPP: case EXT_CC:
+        case EXT_JAVA: case EXT_KT: case EXT_KTS: case EXT_GO: case EXT_RS:
+            return OUTLINE_BRACES;
+        case EXT_JS: case EXT_JSX: case EXT_TS: case EXT_TSX: case EXT_CSS:
+            return OUTLINE_BRACES_JS;
+        case EXT_PY: case EXT_PYW: case EXT_PYX:
+            return OUTLINE_PYTHON;
+        default:
+            return OUTLINE_NONE;
+    }
+}
+
+// Keywords that open a block whose members belong in an outline (a class
+// body) rather than one that is left out (a function body)
+static const char *outline_container_keywords[] = {
+    "class", "struct", "union", "enum", "interface", "namespace", "extern", "record", "object",
+    "impl", "trait", "mod", "module", "media", "supports", NULL
+};
+
+static gboolean outline_is_keyword(const char *word, size_t length) {
+    for (int k = 0; outline_container_keywords[k]; k++) {
+        if (strlen(outline_container_keywords[k]) == length &&
+            memcmp(outline_container_keywords[k], word, length) == 0) return TRUE;
+    }
+    return FALSE;
+}
+
+// Whether a block opened after statement (the code since the previous ';',
+// '{' or '}') is a container. With a parameter list the keyword must come
+// right before the name, as in "class Point(val x: Int)", so that
+// "struct node *find(...)" counts as a function.
+static gboolean outline_is_container(const char *statement) {
+    gboolean keyword = FALSE;
+    int words_after = 0;
+    const char *p = statement;
+    while (*p && *p != '(') {
+        if (g_ascii_isalpha(*p) || *p == '_') {
+            const char *word = p;
+            while (g_ascii_isalnum(*p) || *p == '_') p++;
+            if (outline_is_keyword(word, p - word)) {
+                keyword = TRUE;
+                words_after = 0;
+            } else {
+                words_after++;
+            }
+        } else {
+            p++;
+        }
+    }
+    return keyword && (*p != '(' || words_after <= 1);
+}
+
+static void outline_append_line(GString *out, const char *line, const char *end, const char *suffix) {
+    while (end > line && g_ascii_isspace(end[-1])) end--;
+    g_string_append_len(out, line, end - line);
+    g_string_append(out, suffix);
+    g_string_append_c(out, '\n');
+}
+
+// Outline of a brace language: every line outside function bodies (imports,
+// declarations, type members, the signatures themselves), with the bodies
+// replaced by "...". Comments and blank lines are dropped.
+static void outline_braces(const char *data, size_t length, gboolean quote_strings, GString *out) {
+    GString *statement = g_string_new(NULL);
+    gboolean in_comment = FALSE;
+    char string_quote = 0;   // A string continuing on the next line, e.g. a template literal
+    int depth = 0, hidden = -1; // Depth of the body being left out, -1 when none
+    const char *end = data + length;
+    for (const char *line = data; line < end;) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        gboolean visible = hidden < 0, code = FALSE;
+        for (const char *p = line; p < eol; p++) {
+            char c = *p;
+            if (in_comment) {
+                if (c == '*' && p + 1 < eol && p[1] == '/') {
+                    in_comment = FALSE;
+                    p++;
+                }
+                continue;
+            }
+            if (string_quote) {
+                if (c == '\\') p++;
+                else if (c == string_quote) string_quote = 0;
+                continue;
+            }
+            if (c == '/' && p + 1 < eol && p[1] == '/') break;
+            if (c == '/' && p + 1 < eol && p[1] == '*') {
+                in_comment = TRUE;
+                p++;
+                continue;
+            }
+            if (g_ascii_isspace(c)) {
+                if (hidden < 0 && statement->len > 0) g_string_append_c(statement, ' ');
+                continue;
+            }
+            code = TRUE;
+            if (c == '"' || c == '`' || (c == '\'' && quote_strings)) {
+                string_quote = c;
+            } else if (c == '\'') {
+                // A character literal, or a Rust lifetime that has no closing quote
+                if (p + 2 < eol && p[1] == '\\') {
+                    const char *close = memchr(p + 2, '\'', eol - p - 2);
+                    if (close) p = close;
+                } else if (p + 2 < eol && p[2] == '\'') {
+                    p += 2;
+                }
+            } else if (c == '{') {
+                depth++;
+                if (hidden < 0 && !outline_is_container(statement->str)) hidden = depth;
+                g_string_truncate(statement, 0);
+            } else if (c == '}') {
+                if (depth == hidden) hidden = -1;
+                if (depth > 0) depth--;
+                g_string_truncate(statement, 0);
+            } else if (c == ';') {
+                g_string_truncate(statement, 0);
+            } else if (hidden < 0) {
+                g_string_append_c(statement, c);
+            }
+        }
+        if (string_quote != '`') string_quote = 0; // Only template literals span lines
+        if (visible && code) outline_append_line(out, line, eol, hidden >= 0 ? " ... }" : "");
+        line = eol < end ? eol + 1 : end;
+    }
+    g_string_free(statement, TRUE);
+}
+
+static gboolean outline_starts_with(const char *text, const char *end, const char *prefix) {
+    size_t length = strlen(prefix);
+    return (size_t)(end - text) >= length && memcmp(text, prefix, length) == 0;
+}
+
+// "NAME = ..." or "NAME: type = ...", the module-level constants of Python
+static gboolean outline_is_assignment(const char *text, const char *end) {
+    if (text == end || !(g_ascii_isalpha(*text) || *text == '_')) return FALSE;
+    while (text < end && (g_ascii_isalnum(*text) || *text == '_')) text++;
+    while (text < end && *text == ' ') text++;
+    return text < end && (*text == ':' || (*text == '=' && (text + 1 == end || text[1] != '=')));
+}
+
+// Outline of Python: imports and module-level assignments, decorators, and
+// class and def lines (with their continuation lines). Docstrings, comments
+// and bodies are dropped.
+static void outline_python(const char *data, size_t length, GString *out) {
+    const char *docstring = NULL; // Closing quotes of the docstring being skipped
+    int open_brackets = 0;        // Of a declaration continuing on the next line
+    const char *end = data + length;
+    for (const char *line = data; line < end;) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        const char *text = line;
+        while (text < eol && (*text == ' ' || *text == '\t')) text++;
+
+        gboolean declaration = FALSE;
+        if (docstring) {
+            if (g_strstr_len(text, eol - text, docstring)) docstring = NULL;
+        } else if (open_brackets > 0) {
+            declaration = TRUE;
+        } else if (outline_starts_with(text, eol, "\"\"\"") || outline_starts_with(text, eol, "'''")) {
+            const char *quotes = *text == '"' ? "\"\"\"" : "'''";
+            if (!g_strstr_len(text + 3, eol - text - 3, quotes)) docstring = quotes;
+        } else if (text < eol && *text != '#') {
+            gboolean top_level = text == line;
+            declaration = outline_starts_with(text, eol, "def ") || outline_starts_with(text, eol, "async def ") ||
+                          outline_starts_with(text, eol, "class ") || *text == '@' ||
+                          (top_level && (outline_starts_with(text, eol, "import ") ||
+                                         outline_starts_with(text, eol, "from ") ||
+                                         outline_is_assignment(text, eol)));
+        }
+
+        if (declaration) {
+            for (const char *p = text; p < eol && *p != '#'; p++) {
+                if (*p == '(' || *p == '[' || *p == '{') open_brackets++;
+                else if ((*p == ')' || *p == ']' || *p == '}') && open_brackets > 0) open_brackets--;
+            }
+            outline_append_line(out, line, eol, "");
+        }
+        line = eol < end ? eol + 1 : end;
+    }
+}
+
+// Append the outline of data, a file of the given kind, to out. Returns
+// FALSE for kinds that have no outline syntax.
+gboolean outline_source(const char *data, size_t length, KnownExtension kind, GString *out) {
+    switch (outline_syntax(kind)) {
+        case OUTLINE_BRACES: outline_braces(data, length, FALSE, out); return TRUE;
+        case OUTLINE_BRACES_JS: outline_braces(data, length, TRUE, out); return TRUE;
+        case OUTLINE_PYTHON: outline_python(data, length, out); return TRUE;
+        default: return FALSE;
+    }
+}
+
+// Write a file into the sink as the policy asks: outlined, cut to an
+// excerpt, or whole (through the cache) when it is within the limits.
+// scratch holds the outline.
+static gboolean export_file_excerpt(const char *path, const char *filename, ExportSink *sink, ExportCache *cache,
+                                    const ExcerptPolicy *policy, GString *scratch, char *chunk, size_t chunk_size) {
+    const char *dot = strrchr(filename, '.');
+    KnownExtension kind = dot ? lookup_known_extension(dot + 1) : EXT_UNKNOWN;
+    if (policy->outline && outline_syntax(kind) != OUTLINE_NONE) {
+        GBytes *content = export_file_bytes(path, cache);
+        if (!content) return FALSE;
+        gsize length;
+        const char *data = g_bytes_get_data(content, &length);
+        g_string_truncate(scratch, 0);
+        outline_source(data, length, kind, scratch);
+        g_bytes_unref(content);
+        ExcerptSource source = {-1, scratch->str, scratch->len};
+        return export_excerpt(&source, policy, sink, chunk, chunk_size);
+    }
+
+    stats_count(STAT_OPEN_CALLS, 1);
+    stats_count(STAT_STAT_CALLS, 1);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open file %s\n", path);
+        return FALSE;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        return FALSE;
+    }
+    // Files within the byte limit go the usual way unless lines are limited too
+    if (!S_ISREG(file_stat.st_mode) || policy->max_bytes + policy->max_lines == 0 ||
+        (policy->max_lines == 0 && (guint64)file_stat.st_size <= policy->max_bytes)) {
+        close(fd);
+        return export_file_content(path, sink, cache, chunk, chunk_size);
+    }
+    ExcerptSource source = {fd, NULL, file_stat.st_size};
+    gboolean ok = export_excerpt(&source, policy, sink, chunk, chunk_size);
+    close(fd);
+    return ok;
+}
+
+// --- Split Output ---
+
+// Writes an export as a series of part files, starting a new part before a
+// file that would take the current one past max_bytes or max_tokens (a file
+// larger than that gets a part of its own). A JSON manifest next to the
+// parts lists them and where each exported file starts, so one file can be
+// found without reading the rest. Offsets count uncompressed bytes within a
+// part; each compressed part is a stream of its own.
+
+typedef struct {
+    const char *name;   // File name of the part, without the directory
+    guint64 bytes;      // Uncompressed
+    guint64 tokens;
+    guint files;
+} SplitPart;
+
+typedef struct {
+    const char *path;   // Relative to the project
+    guint part;
+    guint64 offset;     // Within the part
+    guint64 length;
+    guint32 tokens;
+} SplitFile;
+
+typedef struct {
+    char *output_path;      // The only part when not splitting
+    char *part_prefix;      // Part n is written to part_prefix.NNN part_suffix
+    char *part_suffix;
+    char *manifest_path;
+    gboolean splitting;
+    ExportFormat format;
+    ExportCompression compression;
+    guint64 max_bytes;      // 0 for no limit
+    guint64 max_tokens;     // 0 for no limit
+    FILE *file;             // Current part, or NULL before the first file
+    ExportSink part;
+    guint64 part_start;     // bytes_written of the split sink when the part began
+    GArray *parts;          // SplitPart
+    GArray *files;          // SplitFile
+    GStringChunk *names;    // Strings of parts and files
+} SplitOutput;
+
+// Close the current part and complete its manifest entries
+static gboolean split_close_part(ExportSink *sink) {
+    SplitOutput *split = sink->state;
+    if (!split->file) return TRUE;
+
+    gboolean ok = export_sink_finish(&split->part);
+    if (fclose(split->file) != 0) ok = FALSE;
+    split->file = NULL;
+
+    SplitPart *part = &g_array_index(split->parts, SplitPart, split->parts->len - 1);
+    part->bytes = sink->bytes_written - split->part_start;
+    if (part->files > 0) {
+        SplitFile *last = &g_array_index(split->files, SplitFile, split->files->len - 1);
+        last->length = part->bytes - last->offset;
+    }
+    return ok;
+}
+
+static gboolean split_open_part(ExportSink *sink) {
+    SplitOutput *split = sink->state;
+    if (!split_close_part(sink)) return FALSE;
+
+    char *path = split->splitting
+        ? g_strdup_printf("%s.%03u%s", split->part_prefix, split->parts->len + 1, split->part_suffix)
+        : g_strdup(split->output_path);
+    split->file = fopen(path, "w");
+    if (!split->file) {
+        fprintf(stderr, "Cannot open %s for writing: %s\n", path, strerror(errno));
+        g_free(path);
+        return FALSE;
+    }
+
+    const char *slash = strrchr(path, '/');
+    SplitPart part = {g_string_chunk_insert(split->names, slash ? slash + 1 : path), 0, 0, 0};
+    g_array_append_val(split->parts, part);
+    g_free(path);
+
+    export_sink_init_compressed(&split->part, split->file, split->compression);
+    // Uncompressed parts can still take kernel-side copies
+    sink->file = split->file;
+    sink->fd = split->part.fd;
+    split->part_start = sink->bytes_written;
+    return TRUE;
+}
+
+static gboolean split_sink_write(ExportSink *sink, const char *data, size_t len) {
+    SplitOutput *split = sink->state;
+    if (!split->file && !split_open_part(sink)) return FALSE;
+    return export_sink_write(&split->part, data, len);
+}
+
+static gboolean split_sink_begin_file(ExportSink *sink, const char *path, const char *relative_path, guint32 tokens) {
+    SplitOutput *split = sink->state;
+    SplitPart *part = split->file ? &g_array_index(split->parts, SplitPart, split->parts->len - 1) : NULL;
+
+    gboolean full = FALSE;
+    if (part && part->files > 0 && split->max_tokens > 0) {
+        full = part->tokens + tokens > split->max_tokens;
+    }
+    if (part && part->files > 0 && split->max_bytes > 0 && !full) {
+        struct stat file_stat;
+        guint64 size = stat(path, &file_stat) == 0 ? (guint64)file_stat.st_size : 0;
+        size += 2 * strlen(relative_path) + 32; // Header and footer, roughly
+        full = sink->bytes_written - split->part_start + size > split->max_bytes;
+    }
+    if (!part || full) {
+        if (!split_open_part(sink)) return FALSE;
+        part = &g_array_index(split->parts, SplitPart, split->parts->len - 1);
+    }
+
+    SplitFile file = {g_string_chunk_insert(split->names, relative_path), split->parts->len - 1,
+                      sink->bytes_written - split->part_start, 0, tokens};
+    if (part->files > 0) {
+        SplitFile *previous = &g_array_index(split->files, SplitFile, split->files->len - 1);
+        previous->length = file.offset - previous->offset;
+    }
+    g_array_append_val(split->files, file);
+    part->files++;
+    part->tokens += tokens;
+    return TRUE;
+}
+
+static void split_write_manifest(SplitOutput *split, ExportSink *sink) {
+    GString *json = g_string_new("{\n  \"format\": ");
+    GString *scratch = g_string_new(NULL);
+    ExportSink out;
+    export_sink_init_buffer(&out, json);
+
+    export_sink_put_json(&out, scratch, export_format_names[split->format]);
+    export_sink_puts(&out, ",\n  \"compression\": ");
+    export_sink_put_json(&out, scratch, compression_names[split->compression]);
+    export_sink_puts(&out, ",\n  \"parts\": [");
+    for (guint i = 0; i < split->parts->len; i++) {
+        const SplitPart *part = &g_array_index(split->parts, SplitPart, i);
+        export_sink_puts(&out, i > 0 ? ",\n    {\"path\": " : "\n    {\"path\": ");
+        export_sink_put_json(&out, scratch, part->name);
+        g_string_append_printf(json, ", \"bytes\": %" G_GUINT64_FORMAT ", \"tokens\": %" G_GUINT64_FORMAT
+                               ", \"files\": %u}", part->bytes, part->tokens, part->files);
+    }
+    export_sink_puts(&out, "\n  ],\n  \"files\": [");
+    for (guint i = 0; i < split->files->len; i++) {
+        const SplitFile *file = &g_array_index(split->files, SplitFile, i);
+        export_sink_puts(&out, i > 0 ? ",\n    {\"path\": " : "\n    {\"path\": ");
+        export_sink_put_json(&out, scratch, file->path);
+        g_string_append_printf(json, ", \"part\": %u, \"offset\": %" G_GUINT64_FORMAT ", \"length\": %"
+                               G_GUINT64_FORMAT ", \"tokens\": %u}",
+                               file->part, file->offset, file->length, file->tokens);
+    }
+    export_sink_puts(&out, "\n  ]\n}\n");
+
+    GError *error = NULL;
+    if (!g_file_set_contents(split->manifest_path, json->str, json->len, &error)) {
+        fprintf(stderr, "Failed to write %s: %s\n", split->manifest_path, error->message);
+        g_error_free(error);
+        sink->failed = TRUE;
+    }
+    g_string_free(scratch, TRUE);
+    g_string_free(json, TRUE);
+}
+
+// Close the last part, write the manifest and free the state
+static gboolean split_sink_finish(ExportSink *sink) {
+    SplitOutput *split = sink->state;
+    if (!split) return TRUE;
+
+    // An export without files still produces its (empty) output
+    gboolean ok = (split->file || sink->failed || split_open_part(sink)) && split_close_part(sink);
+    if (ok && !sink->failed) split_write_manifest(split, sink);
+
+    g_free(split->output_path);
+    g_free(split->part_prefix);
+    g_free(split->part_suffix);
+    g_free(split->manifest_path);
+    g_array_free(split->parts, TRUE);
+    g_array_free(split->files, TRUE);
+    g_string_chunk_free(split->names);
+    g_free(split);
+    sink->state = NULL;
+    sink->file = NULL;
+    sink->fd = -1;
+    return ok;
+}
+
+// Initialize a sink that writes to output_path, or to numbered parts next
+// to it when max_bytes or max_tokens is set, plus a manifest. E.g. with
+// output_path "out/context.md.zst" the parts are "out/context.001.md.zst",
+// ... and the manifest "out/context.manifest.json".
+void export_sink_init_split(ExportSink *sink, const char *output_path, ExportFormat format,
+                            ExportCompression compression, guint64 max_bytes, guint64 max_tokens) {
+    SplitOutput *split = g_new0(SplitOutput, 1);
+    split->output_path = g_strdup(output_path);
+    split->splitting = max_bytes > 0 || max_tokens > 0;
+    split->format = format;
+    split->compression = compression;
+    split->max_bytes = max_bytes;
+    split->max_tokens = max_tokens;
+    split->parts = g_array_new(FALSE, FALSE, sizeof(SplitPart));
+    split->files = g_array_new(FALSE, FALSE, sizeof(SplitFile));
+    split->names = g_string_chunk_new(4096);
+
+    // Number parts before the extension and compression suffix of the name
+    const char *name = strrchr(output_path, '/');
+    name = name ? name + 1 : output_path;
+    size_t prefix_len = strlen(output_path);
+    for (int i = COMPRESS_GZIP; i <= COMPRESS_ZSTD; i++) {
+        if (g_str_has_suffix(output_path, compression_suffixes[i])) {
+            prefix_len -= strlen(compression_suffixes[i]);
+        }
+    }
+    for (size_t i = prefix_len; output_path + i > name + 1; i--) {
+        if (output_path[i - 1] == '.') {
+            prefix_len = i - 1;
+            break;
+        }
+    }
+    split->part_prefix = g_strndup(output_path, prefix_len);
+    split->part_suffix = g_strdup(output_path + prefix_len);
+    split->manifest_path = g_strconcat(split->part_prefix, ".manifest.json", NULL);
+
+    memset(sink, 0, sizeof(*sink));
+    sink->write = split_sink_write;
+    sink->begin_file = split_sink_begin_file;
+    sink->finish = split_sink_finish;
+    sink->fd = -1;
+    sink->state = split;
+}
+
+// --- Deduplication ---
+
+// Vendored copies, generated stubs and per-module build files repeat the
+// same content. The selected files that share their size with another one
+// are hashed as the export reads them, and the writer, which sees the files
+// in order, writes each one whose content it has written before as a
+// reference to that file. Sizes come from the scan index, so a file whose
+// size is unique is not even hashed.
+
+#define DEDUPE_REFERENCE_TOKENS 16 // The "(same as ...)" line that replaces a copy
+
+// XXH64, streamed: input goes through in 32-byte stripes, a partial stripe
+// waiting in buffer for the next update
+#define XXH_PRIME64_1 G_GUINT64_CONSTANT(0x9E3779B185EBCA87)
+#define XXH_PRIME64_2 G_GUINT64_CONSTANT(0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME64_3 G_GUINT64_CONSTANT(0x165667B19E3779F9)
+#define XXH_PRIME64_4 G_GUINT64_CONSTANT(0x85EBCA77C2B2AE63)
+#define XXH_PRIME64_5 G_GUINT64_CONSTANT(0x27D4EB2F165667C5)
+
+typedef struct {
+    guint64 lanes[4];
+    guint64 total;
+    guchar buffer[32];
+    guint buffered;
+} ContentHash;
+
+static inline guint64 hash_rotl(guint64 value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline guint64 hash_read64(const guchar *p) {
+    guint64 value;
+    memcpy(&value, p, sizeof(value));
+    return GUINT64_FROM_LE(value);
+}
+
+static inline guint64 hash_round(guint64 lane, guint64 input) {
+    lane += input * XXH_PRIME64_2;
+    return hash_rotl(lane, 31) * XXH_PRIME64_1;
+}
+
+static inline guint64 hash_merge_lane(guint64 hash, guint64 lane) {
+    hash ^= hash_round(0, lane);
+    return hash * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void content_hash_init(ContentHash *hash) {
+    hash->lanes[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    hash->lanes[1] = XXH_PRIME64_2;
+    hash->lanes[2] = 0;
+    hash->lanes[3] = -XXH_PRIME64_1;
+    hash->total = 0;
+    hash->buffered = 0;
+}
+
+static void content_hash_stripes(ContentHash *hash, const guchar *data, size_t stripes) {
+    guint64 v0 = hash->lanes[0], v1 = hash->lanes[1], v2 = hash->lanes[2], v3 = hash->lanes[3];
+    for (size_t s = 0; s < stripes; s++, data += 32) {
+        v0 = hash_round(v0, hash_read64(data));
+        v1 = hash_round(v1, hash_read64(data + 8));
+        v2 = hash_round(v2, hash_read64(data + 16));
+        v3 = hash_round(v3, hash_read64(data + 24));
+    }
+    hash->lanes[0] = v0, hash->lanes[1] = v1, hash->lanes[2] = v2, hash->lanes[3] = v3;
+}
+
+static void content_hash_update(ContentHash *hash, const void *input, size_t length) {
+    const guchar *data = input;
+    hash->total += length;
+    if (hash->buffered > 0) {
+        size_t fill = MIN(length, 32 - hash->buffered);
+        memcpy(hash->buffer + hash->buffered, data, fill);
+        hash->buffered += fill;
+        data += fill;
+        length -= fill;
+        if (hash->buffered < 32) return;
+        content_hash_stripes(hash, hash->buffer, 1);
+        hash->buffered = 0;
+    }
+    content_hash_stripes(hash, data, length / 32);
+    hash->buffered = length % 32;
+    memcpy(hash->buffer, data + length - hash->buffered, hash->buffered);
+}
+
+static guint64 content_hash_finish(const ContentHash *hash) {
+    guint64 h;
+    if (hash->total >= 32) {
+        h = hash_rotl(hash->lanes[0], 1) + hash_rotl(hash->lanes[1], 7) +
+            hash_rotl(hash->lanes[2], 12) + hash_rotl(hash->lanes[3], 18);
+        for (int i = 0; i < 4; i++) h = hash_merge_lane(h, hash->lanes[i]);
+    } else {
+        h = XXH_PRIME64_5;
+    }
+    h += hash->total;
+
+    const guchar *p = hash->buffer, *end = hash->buffer + hash->buffered;
+    for (; p + 8 <= end; p += 8) {
+        h ^= hash_round(0, hash_read64(p));
+        h = hash_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        guint32 word;
+        memcpy(&word, p, sizeof(word));
+        h ^= (guint64)GUINT32_FROM_LE(word) * XXH_PRIME64_1;
+        h = hash_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME64_5;
+        h = hash_rotl(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// A sink that hashes what passes through it on its way to target, or that
+// only hashes when target is NULL
+typedef struct {
+    ContentHash *hash;
+    ExportSink *target;
+} HashSinkState;
+
+static gboolean hash_sink_write(ExportSink *sink, const char *data, size_t len) {
+    HashSinkState *state = sink->state;
+    content_hash_update(state->hash, data, len);
+    return !state->target || export_sink_write(state->target, data, len);
+}
+
+void export_sink_init_hash(ExportSink *sink, HashSinkState *state, ContentHash *hash, ExportSink *target) {
+    memset(sink, 0, sizeof(*sink));
+    state->hash = hash;
+    state->target = target;
+    sink->write = hash_sink_write;
+    sink->fd = -1; // Bytes have to pass through the hash
+    sink->state = state;
+}
+
+// What a file's content is compared by
+typedef struct {
+    guint64 hash;
+    guint64 length;
+} ContentDigest;
+
+static guint content_digest_hash(gconstpointer key) {
+    return (guint)((const ContentDigest *)key)->hash;
+}
+
+static gboolean content_digest_equal(gconstpointer a, gconstpointer b) {
+    const ContentDigest *x = a, *y = b;
+    return x->hash == y->hash && x->length == y->length;
+}
+
+// --- Markdown Export ---
+
+// A snapshot of what to export, taken when the export starts so it can run
+// in the background while the GUI keeps changing the selection or rescans.
+typedef struct {
+    FileTable *table;   // Reference to the table the indices point into
+    GArray *indices;    // guint indices of the selected files, in table order
+    ExportCache *cache; // Content cache to read through, or NULL
+    ExcerptPolicy excerpt; // How much of each file to export, all zero for whole files
+    gboolean dedupe;    // Write files that repeat an earlier one as references to it
+} ExportSelection;
+
+#define EXPORT_SELECTION_ENTRY(selection, i) \
+    FILE_TABLE_ENTRY((selection)->table, g_array_index((selection)->indices, guint, (i)))
+
+ExportSelection *export_selection_new(FileTable *table) {
+    ExportSelection *selection = g_new(ExportSelection, 1);
+    selection->table = table ? file_table_ref(table) : file_table_new();
+    selection->indices = g_array_new(FALSE, FALSE, sizeof(guint));
+    selection->cache = NULL;
+    memset(&selection->excerpt, 0, sizeof(selection->excerpt));
+    selection->dedupe = FALSE;
+    for (guint i = 0; i < file_table_count(selection->table); i++) {
+        if (FILE_TABLE_ENTRY(selection->table, i)->selected) {
+            g_array_append_val(selection->indices, i);
+        }
+    }
+    return selection;
+}
+
+void export_selection_free(ExportSelection *selection) {
+    if (!selection) return;
+    file_table_unref(selection->table);
+    g_array_free(selection->indices, TRUE);
+    g_free(selection);
+}
+
+// Reusable buffers for rendering files; one set per thread at a time
+typedef struct {
+    char *chunk;
+    GString *scratch;
+    GString *outline;
+    GString *original;  // Path of the file a copy refers to
+    JsonStringState json_state;
+    ExportSink json_sink; // Escapes file content into a JSON string
+} ExportRenderBuffers;
+
+// Render buffers outlive the export that used them: released sets wait in a
+// small pool for the next export, so copying or saving again does not
+// allocate a new read chunk per reader thread
+#define EXPORT_BUFFER_POOL_SIZE (SCAN_MAX_THREADS + 1) // Readers plus the writer
+static GMutex export_buffer_pool_lock;
+static GPtrArray *export_buffer_pool = NULL; // ExportRenderBuffers
+
+static ExportRenderBuffers *export_render_buffers_acquire(void) {
+    ExportRenderBuffers *buffers = NULL;
+    g_mutex_lock(&export_buffer_pool_lock);
+    if (export_buffer_pool && export_buffer_pool->len > 0) {
+        buffers = g_ptr_array_remove_index_fast(export_buffer_pool, export_buffer_pool->len - 1);
+    }
+    g_mutex_unlock(&export_buffer_pool_lock);
+    if (buffers) return buffers;
+
+    buffers = g_new(ExportRenderBuffers, 1);
+    buffers->chunk = g_malloc(EXPORT_CHUNK_SIZE);
+    buffers->scratch = g_string_new(NULL);
+    buffers->outline = g_string_new(NULL);
+    buffers->original = g_string_new(NULL);
+    export_sink_init_json_string(&buffers->json_sink, &buffers->json_state, NULL);
+    return buffers;
+}
+
+static void export_render_buffers_release(ExportRenderBuffers *buffers) {
+    g_mutex_lock(&export_buffer_pool_lock);
+    if (!export_buffer_pool) export_buffer_pool = g_ptr_array_new();
+    gboolean pooled = export_buffer_pool->len < EXPORT_BUFFER_POOL_SIZE;
+    if (pooled) g_ptr_array_add(export_buffer_pool, buffers);
+    g_mutex_unlock(&export_buffer_pool_lock);
+    if (pooled) return;
+
+    g_free(buffers->chunk);
+    g_string_free(buffers->scratch, TRUE);
+    g_string_free(buffers->outline, TRUE);
+    g_string_free(buffers->original, TRUE);
+    json_string_state_clear(&buffers->json_state);
+    g_free(buffers);
+}
+
+// What an export learns about repeated content as it goes: which files are
+// worth hashing, and, for the writer, the first file written with each content
+typedef struct {
+    guint8 *candidates;     // Per selected file: shares its size with another one; NULL if none does
+    GHashTable *firsts;     // ContentDigest -> position of the first file written with it
+} ExportDedupe;
+
+static void export_dedupe_init(ExportDedupe *dedupe, const ExportSelection *selection) {
+    dedupe->candidates = NULL;
+    dedupe->firsts = NULL;
+    if (!selection->dedupe) return;
+
+    // Empty files are left out: their reference would be no shorter
+    guint count = selection->indices->len;
+    guint64 *sizes = g_new(guint64, count);
+    GHashTable *size_counts = g_hash_table_new(g_int64_hash, g_int64_equal);
+    for (guint i = 0; i < count; i++) {
+        const IndexFile *file = file_table_entry_file(selection->table, EXPORT_SELECTION_ENTRY(selection, i));
+        sizes[i] = file ? file->size : 0;
+        if (sizes[i] == 0) continue;
+        guint seen = GPOINTER_TO_UINT(g_hash_table_lookup(size_counts, &sizes[i]));
+        g_hash_table_insert(size_counts, &sizes[i], GUINT_TO_POINTER(seen + 1));
+    }
+    for (guint i = 0; i < count; i++) {
+        if (sizes[i] == 0 || GPOINTER_TO_UINT(g_hash_table_lookup(size_counts, &sizes[i])) < 2) continue;
+        if (!dedupe->candidates) dedupe->candidates = g_new0(guint8, count);
+        dedupe->candidates[i] = TRUE;
+    }
+    g_hash_table_destroy(size_counts);
+    g_free(sizes);
+    if (dedupe->candidates) {
+        dedupe->firsts = g_hash_table_new_full(content_digest_hash, content_digest_equal, g_free, NULL);
+    }
+}
+
+static void export_dedupe_clear(ExportDedupe *dedupe) {
+    g_free(dedupe->candidates);
+    if (dedupe->firsts) g_hash_table_destroy(dedupe->firsts);
+}
+
+// Whether the i-th selected file is to be hashed as it is read
+static gboolean export_dedupe_candidate(const ExportDedupe *dedupe, guint i) {
+    return dedupe->candidates && dedupe->candidates[i];
+}
+
+// The writer's check of the i-th selected file, whose content hashed to
+// digest: the earlier file it repeats, or G_MAXUINT when its content is new
+// (the file is then written whole and later copies refer to it)
+static guint export_dedupe_check(ExportDedupe *dedupe, guint i, const ContentDigest *digest) {
+    gpointer first;
+    if (g_hash_table_lookup_extended(dedupe->firsts, digest, NULL, &first)) return GPOINTER_TO_UINT(first);
+    ContentDigest *key = g_new(ContentDigest, 1);
+    *key = *digest;
+    g_hash_table_insert(dedupe->firsts, key, GUINT_TO_POINTER(i));
+    return G_MAXUINT;
+}
+
+// Estimated tokens a file's record adds to the export: the whole file, or
+// the reference to the earlier file with the same content (same_as)
+static guint32 export_record_tokens(const FileEntry *entry, guint same_as) {
+    return same_as != G_MAXUINT ? DEDUPE_REFERENCE_TOKENS : entry->tokens;
+}
+
+// Path of an exported file as shown in the export: relative to its root,
+// and starting with the root's name in a workspace of several roots
+static const char *export_relative_path(const ExportSelection *selection, const FileEntry *entry, const char *path) {
+    return path + file_table_relative_offset(selection->table, entry);
+}
+
+// The name of the root a workspace export starts a section for with the
+// i-th selected file, or NULL when that file continues the section of the
+// one before it or the export has a single root
+static const char *export_section_name(const ExportSelection *selection, guint i) {
+    const FileTable *table = selection->table;
+    if (table->roots->len < 2) return NULL;
+    guint root = EXPORT_SELECTION_ENTRY(selection, i)->root;
+    if (i > 0 && EXPORT_SELECTION_ENTRY(selection, i - 1)->root == root) return NULL;
+    return FILE_TABLE_ROOT(table, root)->name;
+}
+
+// Write the content of an exported file into the sink, whole or as the
+// selection's excerpt policy asks. With hash set, the content also goes
+// into it (and only there when sink is NULL).
+static gboolean export_file_body(const ExportSelection *selection, const FileEntry *entry, const char *path,
+                                 ExportSink *sink, ContentHash *hash, ExportRenderBuffers *buffers) {
+    ExportSink hash_sink;
+    HashSinkState hash_state;
+    if (hash) {
+        export_sink_init_hash(&hash_sink, &hash_state, hash, sink);
+        sink = &hash_sink;
+    }
+    if (!excerpt_policy_active(&selection->excerpt)) {
+        return export_file_content(path, sink, selection->cache, buffers->chunk, EXPORT_CHUNK_SIZE);
+    }
+    return export_file_excerpt(path, entry->filename, sink, selection->cache, &selection->excerpt,
+                               buffers->outline, buffers->chunk, EXPORT_CHUNK_SIZE);
+}
+
+// Write the record of the i-th selected file (header, content and footer),
+// whose full path is path, into the sink. A file that repeats the earlier
+// one at same_as (G_MAXUINT for none) is written as the path of that file.
+// With hash set, the file's content is also hashed into it. Returns FALSE
+// if the content could not be read.
+static gboolean export_render_file(ExportSink *sink, const ExportSelection *selection, guint i, const char *path,
+                                   ExportFormat format, guint same_as, ContentHash *hash,
+                                   ExportRenderBuffers *buffers) {
+    gint64 started = stats_begin();
+    const FileEntry *entry = EXPORT_SELECTION_ENTRY(selection, i);
+    const char *filename = entry->filename;
+    const char *relative_path = export_relative_path(selection, entry, path);
+    gboolean read_ok = TRUE;
+
+    const char *original = NULL;
+    if (same_as != G_MAXUINT) {
+        const FileEntry *original_entry = EXPORT_SELECTION_ENTRY(selection, same_as);
+        file_table_entry_path(selection->table, original_entry, buffers->original);
+        original = export_relative_path(selection, original_entry, buffers->original->str);
+    }
+
+    if (format == EXPORT_JSONL) {
+        GString *scratch = buffers->scratch;
+        export_sink_puts(sink, "{\"path\":");
+        export_sink_put_json(sink, scratch, relative_path);
+        export_sink_puts(sink, ",\"language\":");
+        export_sink_put_json(sink, scratch, get_language_extension(filename));
+        g_string_printf(scratch, ",\"tokens\":%u,", export_record_tokens(entry, same_as));
+        export_sink_write(sink, scratch->str, scratch->len);
+        if (original) {
+            export_sink_puts(sink, "\"same_as\":");
+            export_sink_put_json(sink, scratch, original);
+            export_sink_puts(sink, "}\n");
+        } else {
+            export_sink_puts(sink, "\"content\":\"");
+            buffers->json_state.target = sink;
+            read_ok = export_file_body(selection, entry, path, &buffers->json_sink, hash, buffers);
+            export_sink_finish(&buffers->json_sink);
+            export_sink_puts(sink, read_ok ? "\"}\n" : "\",\"error\":\"Error reading file content\"}\n");
+        }
+    } else {
+        // A workspace export has a section per root
+        const char *section = export_section_name(selection, i);
+        if (section) {
+            export_sink_puts(sink, "# ");
+            export_sink_puts(sink, section);
+            export_sink_puts(sink, "\n\n");
+        }
+
+        // Write file header with relative path
+        export_sink_puts(sink, "- ");
+        export_sink_puts(sink, relative_path);
+        if (original) {
+            export_sink_puts(sink, "\n(same as ");
+            export_sink_puts(sink, original);
+            export_sink_puts(sink, ")\n\n");
+        } else {
+            // Open the code block, read and write file content, end code block
+            export_sink_puts(sink, "\n```");
+            export_sink_puts(sink, get_language_extension(filename));
+            export_sink_puts(sink, "\n");
+            read_ok = export_file_body(selection, entry, path, sink, hash, buffers);
+            if (!read_ok) {
+                export_sink_puts(sink, "Error reading file content\n");
+            }
+            export_sink_puts(sink, "\n```\n\n");
+        }
+    }
+    stats_end_item("export", path, started);
+    return read_ok;
+}
+
+// --- Export Pipeline ---
+
+// Files are independent of each other, so a pool of reader threads loads
+// and renders them in parallel while the calling thread writes the results
+// out in selection order. Readers work at most EXPORT_PIPELINE_DEPTH files
+// per thread ahead of the writer; each rendered file waits in a slot of a
+// ring until it is written, so memory stays bounded however large the
+// selection is. Files of MMAP_THRESHOLD bytes or more are not rendered
+// ahead: the reader only starts readahead on them and the writer streams
+// them as usual (kernel-side copy or mmap), so they never sit in memory.
+// Readers hash the files that may repeat another one as they render them
+// (see ExportDedupe); the writer, going in order, then writes a repeat as a
+// reference instead of its rendered record.
+
+#define EXPORT_PIPELINE_DEPTH 4 // Files in flight per reader thread
+
+typedef struct {
+    GString *path;
+    GString *rendered;  // The file's record, unless deferred
+    gboolean deferred;  // Left for the writer to stream itself
+    gboolean hashed;    // digest holds the hash of the file's content
+    ContentDigest digest;
+    gboolean done;      // Ready to be written
+} ExportFragment;
+
+typedef struct {
+    const ExportSelection *selection;
+    const ExportDedupe *dedupe;
+    ExportFormat format;
+    GMutex lock;
+    GCond cond;
+    ExportFragment *slots;  // Ring; file i uses slot i % slot_count
+    guint slot_count;
+    guint next;             // Next file to hand to a reader
+    guint written;          // Files the writer is done with
+    gboolean stop;
+} ExportPipeline;
+
+// Read the i-th selected file into fragment: rendered, or deferred to the
+// writer when it is large, and hashed when it may repeat another file
+static void export_fragment_render(const ExportSelection *selection, const ExportDedupe *dedupe,
+                                   ExportFormat format, ExportFragment *fragment, guint i,
+                                   ExportRenderBuffers *buffers) {
+    const FileEntry *entry = EXPORT_SELECTION_ENTRY(selection, i);
+    file_table_entry_path(selection->table, entry, fragment->path);
+    g_string_truncate(fragment->rendered, 0);
+
+    ContentHash hash;
+    content_hash_init(&hash);
+    gboolean candidate = export_dedupe_candidate(dedupe, i);
+    struct stat file_stat;
+    fragment->deferred = stat(fragment->path->str, &file_stat) == 0 && file_stat.st_size >= MMAP_THRESHOLD;
+    if (fragment->deferred && candidate) {
+        // Hashing reads it into the page cache, where the writer streams it from
+        fragment->hashed = export_file_body(selection, entry, fragment->path->str, NULL, &hash, buffers);
+    } else if (fragment->deferred) {
+        // Have the kernel start reading it so it is cached by the time its turn comes
+        fragment->hashed = FALSE;
+        int fd = open(fragment->path->str, O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    } else {
+        ExportSink sink;
+        export_sink_init_buffer(&sink, fragment->rendered);
+        fragment->hashed = export_render_file(&sink, selection, i, fragment->path->str, format, G_MAXUINT,
+                                              candidate ? &hash : NULL, buffers) && candidate;
+    }
+    if (fragment->hashed) {
+        fragment->digest.hash = content_hash_finish(&hash);
+        fragment->digest.length = hash.total;
+    }
+}
+
+// Write the i-th selected file, as export_fragment_render() left it, into
+// the sink: its record, or a reference when its content was written before.
+// Returns FALSE if the sink failed.
+static gboolean export_fragment_write(ExportSink *sink, const ExportSelection *selection, ExportDedupe *dedupe,
+                                      ExportFormat format, ExportFragment *fragment, guint i,
+                                      ExportRenderBuffers *buffers) {
+    const FileEntry *entry = EXPORT_SELECTION_ENTRY(selection, i);
+    const char *path = fragment->path->str;
+    guint same_as = fragment->hashed ? export_dedupe_check(dedupe, i, &fragment->digest) : G_MAXUINT;
+    if (!export_sink_begin_file(sink, path, export_relative_path(selection, entry, path),
+                                export_record_tokens(entry, same_as))) {
+        return FALSE;
+    }
+    if (same_as != G_MAXUINT || fragment->deferred) {
+        export_render_file(sink, selection, i, path, format, same_as, NULL, buffers);
+    } else {
+        export_sink_write(sink, fragment->rendered->str, fragment->rendered->len);
+    }
+    stats_count(STAT_FILES, 1);
+    return !sink->failed;
+}
+
+static gpointer export_reader_thread(gpointer data) {
+    ExportPipeline *pipeline = data;
+    guint count = pipeline->selection->indices->len;
+    ExportRenderBuffers *buffers = export_render_buffers_acquire();
+
+    for (;;) {
+        g_mutex_lock(&pipeline->lock);
+        // Wait until the slot of the next file has been written out
+        while (!pipeline->stop && pipeline->next < count &&
+               pipeline->next >= pipeline->written + pipeline->slot_count) {
+            g_cond_wait(&pipeline->cond, &pipeline->lock);
+        }
+        if (pipeline->stop || pipeline->next >= count) {
+            g_mutex_unlock(&pipeline->lock);
+            break;
+        }
+        guint i = pipeline->next++;
+        g_mutex_unlock(&pipeline->lock);
+
+        ExportFragment *fragment = &pipeline->slots[i % pipeline->slot_count];
+        export_fragment_render(pipeline->selection, pipeline->dedupe, pipeline->format, fragment, i, buffers);
+
+        g_mutex_lock(&pipeline->lock);
+        fragment->done = TRUE;
+        g_cond_broadcast(&pipeline->cond);
+        g_mutex_unlock(&pipeline->lock);
+    }
+
+    export_render_buffers_release(buffers);
+    return NULL;
+}
+
+// Export with thread_count readers; see export_files()
+static int export_files_parallel(ExportSink *sink, const ExportSelection *selection, ExportDedupe *dedupe,
+                                 ExportFormat format, int thread_count, GCancellable *cancellable,
+                                 TaskProgress *progress) {
+    ExportPipeline pipeline = {0};
+    pipeline.selection = selection;
+    pipeline.dedupe = dedupe;
+    pipeline.format = format;
+    g_mutex_init(&pipeline.lock);
+    g_cond_init(&pipeline.cond);
+    pipeline.slot_count = thread_count * EXPORT_PIPELINE_DEPTH;
+    pipeline.slots = g_new0(ExportFragment, pipeline.slot_count);
+    for (guint s = 0; s < pipeline.slot_count; s++) {
+        pipeline.slots[s].path = g_string_new(NULL);
+        pipeline.slots[s].rendered = g_string_new(NULL);
+    }
+
+    GThread **threads = g_new(GThread *, thread_count);
+    for (int t = 0; t < thread_count; t++) {
+        threads[t] = g_thread_new("export-reader", export_reader_thread, &pipeline);
+    }
+
+    ExportRenderBuffers *buffers = export_render_buffers_acquire(); // For deferred files and references
+    int exported = 0;
+
+    for (guint i = 0; i < selection->indices->len && !sink->failed; i++) {
+        if (g_cancellable_is_cancelled(cancellable)) break;
+
+        ExportFragment *fragment = &pipeline.slots[i % pipeline.slot_count];
+        g_mutex_lock(&pipeline.lock);
+        while (!fragment->done) {
+            g_cond_wait(&pipeline.cond, &pipeline.lock);
+        }
+        g_mutex_unlock(&pipeline.lock);
+
+        size_t bytes_before = sink->bytes_written;
+        if (!export_fragment_write(sink, selection, dedupe, format, fragment, i, buffers)) break;
+        exported++;
+        task_progress_add(progress, 1, 0, sink->bytes_written - bytes_before);
+
+        g_mutex_lock(&pipeline.lock);
+        fragment->done = FALSE;
+        pipeline.written++;
+        g_cond_broadcast(&pipeline.cond);
+        g_mutex_unlock(&pipeline.lock);
+    }
+
+    // Readers finish the file they are on and exit
+    g_mutex_lock(&pipeline.lock);
+    pipeline.stop = TRUE;
+    g_cond_broadcast(&pipeline.cond);
+    g_mutex_unlock(&pipeline.lock);
+    for (int t = 0; t < thread_count; t++) {
+        g_thread_join(threads[t]);
+    }
+    g_free(threads);
+
+    for (guint s = 0; s < pipeline.slot_count; s++) {
+        g_string_free(pipeline.slots[s].path, TRUE);
+        g_string_free(pipeline.slots[s].rendered, TRUE);
+    }
+    g_free(pipeline.slots);
+    export_render_buffers_release(buffers);
+    g_mutex_clear(&pipeline.lock);
+    g_cond_clear(&pipeline.cond);
+    return sink->failed ? -1 : exported;
+}
+
+// Export one file after another on the calling thread; see export_files().
+// Files that may repeat another one go through a fragment, so they can be
+// hashed before their record is written; the rest stream straight into the sink.
+static int export_files_serial(ExportSink *sink, const ExportSelection *selection, ExportDedupe *dedupe,
+                               ExportFormat format, GCancellable *cancellable, TaskProgress *progress) {
+    ExportFragment fragment = {0};
+    fragment.path = g_string_new(NULL);
+    fragment.rendered = g_string_new(NULL);
+    ExportRenderBuffers *buffers = export_render_buffers_acquire();
+    int exported = 0;
+
+    for (guint i = 0; i < selection->indices->len && !sink->failed; i++) {
+        if (g_cancellable_is_cancelled(cancellable)) break;
+
+        size_t bytes_before = sink->bytes_written;
+        if (export_dedupe_candidate(dedupe, i)) {
+            export_fragment_render(selection, dedupe, format, &fragment, i, buffers);
+            if (!export_fragment_write(sink, selection, dedupe, format, &fragment, i, buffers)) break;
+        } else {
+            const FileEntry *entry = EXPORT_SELECTION_ENTRY(selection, i);
+            file_table_entry_path(selection->table, entry, fragment.path);
+            const char *path = fragment.path->str;
+            if (!export_sink_begin_file(sink, path, export_relative_path(selection, entry, path), entry->tokens)) {
+                break;
+            }
+            export_render_file(sink, selection, i, path, format, G_MAXUINT, NULL, buffers);
+            stats_count(STAT_FILES, 1);
+        }
+        exported++;
+        task_progress_add(progress, 1, 0, sink->bytes_written - bytes_before);
+    }
+
+    g_string_free(fragment.path, TRUE);
+    g_string_free(fragment.rendered, TRUE);
+    export_render_buffers_release(buffers);
+    return sink->failed ? -1 : exported;
+}
+
+// Stream the selected files into the sink in the given format.
+// Every file is read from disk once (a large file that may repeat another
+// is hashed ahead of its turn, then streamed again from the page cache);
+// with a cache, unchanged files are not read at all. On more than one core
+// the files are read and rendered by the export pipeline, and the output is
+// the same as from a single thread.
+// Stops early when cancellable is cancelled (callers check it to tell a
+// cancelled export from a finished one).
+// The caller finishes the sink.
+// Returns the number of files exported, or -1 if the sink failed.
+int export_files(ExportSink *sink, const ExportSelection *selection, ExportFormat format,
+                 GCancellable *cancellable, TaskProgress *progress) {
+    gint64 started = stats_begin();
+    size_t bytes_before = sink->bytes_written;
+    ExportDedupe dedupe;
+    export_dedupe_init(&dedupe, selection);
+    int thread_count = MIN(scan_thread_count(), (int)selection->indices->len);
+    int exported = thread_count > 1
+                 ? export_files_parallel(sink, selection, &dedupe, format, thread_count, cancellable, progress)
+                 : export_files_serial(sink, selection, &dedupe, format, cancellable, progress);
+    export_dedupe_clear(&dedupe);
+    stats_count(STAT_BYTES_WRITTEN, sink->bytes_written - bytes_before);
+    stats_end_phase("export", started);
+    return exported;
+}
+
+// Function to generate markdown content into memory.
+// The returned string must be released with g_free().
+char* generate_markdown_content(const ExportSelection *selection,
+                                GCancellable *cancellable, TaskProgress *progress) {
+    GString *buffer = g_string_sized_new(64 * 1024);
+    ExportSink sink;
+    export_sink_init_buffer(&sink, buffer);
+
+    if (export_files(&sink, selection, EXPORT_MARKDOWN, cancellable, progress) < 0) {
+        fprintf(stderr, "Failed to generate markdown content\n");
+        g_string_free(buffer, TRUE);
+        return NULL;
+    }
+
+    return g_string_free(buffer, FALSE);
+}
+
+// --- File List Model ---
+
+// A GtkTreeModel that shows the file table in the tree view without copying
+// it: rows are produced on demand, so only the visible rows cost anything,
+// and selection changes are plain writes to the table.
+enum {
+    FILE_COLUMN_SELECTED,
+    FILE_COLUMN_PATH,
+    FILE_N_COLUMNS
+};
+
+#define FILE_LIST_TYPE_MODEL (file_list_model_get_type())
+G_DECLARE_FINAL_TYPE(FileListModel, file_list_model, FILE_LIST, MODEL, GObject)
+
+struct _FileListModel {
+    GObject parent_instance;
+    gint stamp;           // Identifies iters created by this model
+    FileTable *table;
+    GArray *rows;         // guint table index of each row, in display order
+};
+
+static void file_list_model_tree_model_init(GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(FileListModel, file_list_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, file_list_model_tree_model_init))
+
+static void file_list_model_finalize(GObject *object) {
+    FileListModel *model = FILE_LIST_MODEL(object);
+    file_table_unref(model->table);
+    g_array_free(model->rows, TRUE);
+    G_OBJECT_CLASS(file_list_model_parent_class)->finalize(object);
+}
+
+static void file_list_model_class_init(FileListModelClass *klass) {
+    G_OBJECT_CLASS(klass)->finalize = file_list_model_finalize;
+}
+
+static void file_list_model_init(FileListModel *model) {
+    model->stamp = g_random_int();
+    model->rows = g_array_new(FALSE, FALSE, sizeof(guint));
+}
+
+// Create a model showing every file of table
+FileListModel *file_list_model_new(FileTable *table) {
+    FileListModel *model = g_object_new(FILE_LIST_TYPE_MODEL, NULL);
+    model->table = file_table_ref(table);
+
+    guint count = file_table_count(table);
+    g_array_set_size(model->rows, count);
+    for (guint i = 0; i < count; i++) {
+        g_array_index(model->rows, guint, i) = i;
+    }
+    return model;
+}
+
+// The table entry shown in a row
+FileEntry *file_list_model_entry(FileListModel *model, guint row) {
+    return FILE_TABLE_ENTRY(model->table, g_array_index(model->rows, guint, row));
+}
+
+// Select or deselect every row without emitting per-row signals; the
+// caller redraws the view afterwards
+void file_list_model_set_all(FileListModel *model, gboolean selected) {
+    for (guint row = 0; row < model->rows->len; row++) {
+        file_table_set_selected(model->table, file_list_model_entry(model, row), selected);
+    }
+}
+
+static gboolean file_list_model_set_iter(FileListModel *model, GtkTreeIter *iter, gint row) {
+    if (row < 0 || (guint)row >= model->rows->len) {
+        iter->stamp = 0;
+        return FALSE;
+    }
+    iter->stamp = model->stamp;
+    iter->user_data = GINT_TO_POINTER(row);
+    return TRUE;
+}
+
+static GtkTreeModelFlags file_list_model_get_flags(GtkTreeModel *tree_model) {
+    return GTK_TREE_MODEL_LIST_ONLY | GTK_TREE_MODEL_ITERS_PERSIST;
+}
+
+static gint file_list_model_get_n_columns(GtkTreeModel *tree_model) {
+    return FILE_N_COLUMNS;
+}
+
+static GType file_list_model_get_column_type(GtkTreeModel *tree_model, gint column) {
+    return column == FILE_COLUMN_SELECTED ? G_TYPE_BOOLEAN : G_TYPE_STRING;
+}
+
+static gboolean file_list_model_get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreePath *path) {
+    if (gtk_tree_path_get_depth(path) != 1) return FALSE;
+    return file_list_model_set_iter(FILE_LIST_MODEL(tree_model), iter, gtk_tree_path_get_indices(path)[0]);
+}
+
+static GtkTreePath *file_list_model_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return gtk_tree_path_new_from_indices(GPOINTER_TO_INT(iter->user_data), -1);
+}
+
+static void file_list_model_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, GValue *value) {
+    FileListModel *model = FILE_LIST_MODEL(tree_model);
+    FileEntry *entry = file_list_model_entry(model, GPOINTER_TO_INT(iter->user_data));
+
+    if (column == FILE_COLUMN_SELECTED) {
+        g_value_init(value, G_TYPE_BOOLEAN);
+        g_value_set_boolean(value, entry->selected);
+        return;
+    }
+
+    // Show the path relative to the project root, as exports do
+    GString *path = g_string_new(NULL);
+    file_table_entry_path(model->table, entry, path);
+    g_string_erase(path, 0, MIN(file_table_relative_offset(model->table, entry), path->len));
+    if (entry->skip != SKIP_NONE) {
+        g_string_append_printf(path, " (%s)", skip_reason_names[entry->skip]);
+    }
+    g_value_init(value, G_TYPE_STRING);
+    g_value_take_string(value, g_string_free(path, FALSE));
+}
+
+static gboolean file_list_model_iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return file_list_model_set_iter(FILE_LIST_MODEL(tree_model), iter, GPOINTER_TO_INT(iter->user_data) + 1);
+}
+
+static gboolean file_list_model_iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent) {
+    if (parent) return FALSE;
+    return file_list_model_set_iter(FILE_LIST_MODEL(tree_model), iter, 0);
+}
+
+static gboolean file_list_model_iter_has_child(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return FALSE;
+}
+
+static gint file_list_model_iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    return iter ? 0 : (gint)FILE_LIST_MODEL(tree_model)->rows->len;
+}
+
+static gboolean file_list_model_iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter,
+                                               GtkTreeIter *parent, gint n) {
+    if (parent) return FALSE;
+    return file_list_model_set_iter(FILE_LIST_MODEL(tree_model), iter, n);
+}
+
+static gboolean file_list_model_iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *child) {
+    return FALSE;
+}
+
+static void file_list_model_tree_model_init(GtkTreeModelIface *iface) {
+    iface->get_flags = file_list_model_get_flags;
+    iface->get_n_columns = file_list_model_get_n_columns;
+    iface->get_column_type = file_list_model_get_column_type;
+    iface->get_iter = file_list_model_get_iter;
+    iface->get_path = file_list_model_get_path;
+    iface->get_value = file_list_model_get_value;
+    iface->iter_next = file_list_model_iter_next;
+    iface->iter_children = file_list_model_iter_children;
+    iface->iter_has_child = file_list_model_iter_has_child;
+    iface->iter_n_children = file_list_model_iter_n_children;
+    iface->iter_nth_child = file_list_model_iter_nth_child;
+    iface->iter_parent = file_list_model_iter_parent;
+}
+
+// --- Background Tasks ---
+
+// Scans and exports run in a GTask worker thread so the main loop keeps
+// redrawing. Only one task runs at a time: starting a new one cancels the
+// previous one, whose result is then discarded.
+typedef struct {
+    TaskProgress progress;
+    const char *verb;           // Shown in the status label, e.g. "Scanning"
+    char *dir_path;             // Scan: directory or workspace to walk
+    GtkWidget *files_view;      // Scan: tree view that shows the result
+    FileTable *previous_table;  // Scan: its roots start from their indexes here instead of the saved ones, or NULL
+    int watch_fd;               // Scan: inotify instance to add watches to, or -1
+    gboolean watch_all;         // Scan: watch every directory, not just the rescanned ones
+    ExportSelection *selection; // Export: files to write
+    const char *output_path;    // Save: destination file
+} BackgroundTask;
+
+static ExportCache *export_cache = NULL; // Shared by every export of the session
+static BackgroundTask *running_task = NULL;
+static GCancellable *running_cancellable = NULL;
+static guint progress_source_id = 0;
+
+static BackgroundTask *background_task_new(const char *verb) {
+    BackgroundTask *task = g_new0(BackgroundTask, 1);
+    g_mutex_init(&task->progress.lock);
+    task->watch_fd = -1;
+    task->verb = verb;
+    return task;
+}
+
+static void background_task_free(gpointer data) {
+    BackgroundTask *task = data;
+    g_mutex_clear(&task->progress.lock);
+    g_free(task->dir_path);
+    if (task->previous_table) file_table_unref(task->previous_table);
+    if (task->watch_fd != -1) close(task->watch_fd);
+    export_selection_free(task->selection);
+    g_free(task);
+}
+
+// Refresh the status label from the running task's counters
+static gboolean on_task_progress_tick(gpointer data) {
+    if (!running_task) {
+        progress_source_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    g_mutex_lock(&running_task->progress.lock);
+    int files_done = running_task->progress.files;
+    int dirs_done = running_task->progress.dirs;
+    guint64 bytes_done = running_task->progress.bytes;
+    g_mutex_unlock(&running_task->progress.lock);
+
+    char status_msg[200];
+    if (running_task->selection) {
+        char *size = g_format_size(bytes_done);
+        snprintf(status_msg, sizeof(status_msg), "%s... %d of %u files, %s",
+                 running_task->verb, files_done, running_task->selection->indices->len, size);
+        g_free(size);
+    } else {
+        snprintf(status_msg, sizeof(status_msg), "%s... %d files in %d directories",
+                 running_task->verb, files_done, dirs_done);
+    }
+    gtk_label_set_text(GTK_LABEL(status_label), status_msg);
+    return G_SOURCE_CONTINUE;
+}
+
+// Run func in a worker thread; done is called on the main thread when it
+// finishes, fails or is cancelled. Takes ownership of task.
+static void background_task_start(BackgroundTask *task, GTaskThreadFunc func, GAsyncReadyCallback done) {
+    if (running_cancellable) {
+        g_cancellable_cancel(running_cancellable); // Supersede the running task
+        g_object_unref(running_cancellable);
+    }
+    running_cancellable = g_cancellable_new();
+    running_task = task;
+    if (stats.enabled) stats_enable(FALSE); // Stats describe the latest task
+
+    GTask *gtask = g_task_new(NULL, running_cancellable, done, NULL);
+    g_task_set_task_data(gtask, task, background_task_free);
+    g_task_run_in_thread(gtask, func);
+    g_object_unref(gtask);
+
+    gtk_widget_set_sensitive(cancel_button, TRUE);
+    if (!progress_source_id) {
+        progress_source_id = g_timeout_add(100, on_task_progress_tick, NULL);
+    }
+}
+
+// Called first thing in a completion callback. Returns TRUE if the task is
+// still the current one and its result should be used.
+static gboolean background_task_finish(GAsyncResult *result) {
+    BackgroundTask *task = g_task_get_task_data(G_TASK(result));
+    if (task != running_task) return FALSE;
+
+    running_task = NULL;
+    g_clear_object(&running_cancellable);
+    gtk_widget_set_sensitive(cancel_button, FALSE);
+    if (progress_source_id) {
+        g_source_remove(progress_source_id);
+        progress_source_id = 0;
+    }
+    return TRUE;
+}
+
+static void show_message(GtkMessageType type, const char *message) {
+    GtkWidget *dialog = gtk_message_dialog_new(NULL,
+                                              GTK_DIALOG_MODAL,
+                                              type,
+                                              GTK_BUTTONS_OK,
+                                              "%s", message);
+    gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+}
+
+// Show what the stats collected for the latest task as the status tooltip
+static void update_stats_tooltip(void) {
+    if (!gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(stats_check))) return;
+    GString *summary = g_string_new(NULL);
+    stats_summary(summary);
+    g_strchomp(summary->str);
+    gtk_widget_set_tooltip_text(status_label, summary->str);
+    g_string_free(summary, TRUE);
+}
+
+// Callback for the stats check button: collecting stats costs a clock read
+// per file, so it is off unless asked for
+void on_stats_toggled(GtkToggleButton *button, gpointer data) {
+    if (gtk_toggle_button_get_active(button)) {
+        stats_enable(FALSE);
+        gtk_widget_set_tooltip_text(status_label, "Stats will show here after the next scan or export");
+    } else {
+        stats_disable();
+        gtk_widget_set_tooltip_text(status_label, NULL);
+    }
+}
+
+// Report a failed task; cancellations only update the status label
+static void report_task_error(GError *error, const char *cancelled_msg) {
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        gtk_label_set_text(GTK_LABEL(status_label), cancelled_msg);
+    } else {
+        gtk_label_set_text(GTK_LABEL(status_label), error->message);
+        show_message(GTK_MESSAGE_ERROR, error->message);
+    }
+}
+
+// Callback for cancel button
+void on_cancel_clicked(GtkWidget *widget, gpointer data) {
+    if (running_cancellable) {
+        g_cancellable_cancel(running_cancellable);
+    }
+}
+
+static void save_task_thread(GTask *gtask, gpointer source, gpointer task_data, GCancellable *cancellable) {
+    BackgroundTask *task = task_data;
+
+    FILE *md_file = fopen(task->output_path, "w");
+    if (!md_file) {
+        g_task_return_new_error(gtask, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open output file for writing");
+        return;
+    }
+
+    // Stream straight into the output file instead of building the document in memory
+    ExportSink sink;
+    export_sink_init_file(&sink, md_file);
+    int exported = export_files(&sink, task->selection, EXPORT_MARKDOWN, cancellable, &task->progress);
+    if (fclose(md_file) != 0) exported = -1;
+
+    if (exported < 0) {
+        g_task_return_new_error(gtask, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to generate markdown content");
+        return;
+    }
+    g_task_return_boolean(gtask, TRUE);
+}
+
+static void on_save_finished(GObject *source, GAsyncResult *result, gpointer data) {
+    BackgroundTask *task = g_task_get_task_data(G_TASK(result));
+    GError *error = NULL;
+    gboolean saved = g_task_propagate_boolean(G_TASK(result), &error);
+
+    if (background_task_finish(result)) {
+        if (!saved) {
+            report_task_error(error, "Export cancelled.");
+        } else {
+            char message[MAX_PATH_LENGTH + 100];
+            snprintf(message, sizeof(message), "Saved %u files to %s",
+                     task->selection->indices->len, task->output_path);
+            gtk_label_set_text(GTK_LABEL(status_label), "Ready");
+            update_stats_tooltip();
+            show_message(GTK_MESSAGE_INFO, message);
+        }
+    }
+    g_clear_error(&error);
+}
+
+// The excerpt policy of the "Content" choice: whole files, the head and tail
+// of large files, or outlines (also cut down when they are large)
+static ExcerptPolicy gui_excerpt_policy(void) {
+    ExcerptPolicy policy = {0, 0, FALSE};
+    int mode = gtk_combo_box_get_active(GTK_COMBO_BOX(content_combo));
+    if (mode > 0) {
+        policy.max_bytes = DEFAULT_EXCERPT_BYTES;
+        policy.max_lines = DEFAULT_EXCERPT_LINES;
+        policy.outline = mode == 2;
+    }
+    return policy;
+}
+
+// Function to save selected files to markdown
+void save_to_markdown() {
+    ExportSelection *selection = export_selection_new(file_table);
+    if (selection->indices->len == 0) {
+        export_selection_free(selection);
+        show_message(GTK_MESSAGE_WARNING, "No files were selected");
+        return;
+    }
+
+    BackgroundTask *task = background_task_new("Exporting");
+    selection->cache = export_cache;
+    selection->excerpt = gui_excerpt_policy();
+    selection->dedupe = TRUE;
+    task->selection = selection;
+    task->output_path = OUTPUT_FILE;
+    background_task_start(task, save_task_thread, on_save_finished);
+}
+
+// Copying renders the export in a background task, with progress and
+// Cancel like saving, into an unlinked temporary file (a kernel-side copy
+// per file). The file is mapped for as long as we own the clipboard, so the
+// text sits in the page cache rather than on our heap, and every paste is
+// served from the map. The clipboard is only taken once the text is ready:
+// a paste before then gets what was copied before, and a failed or
+// cancelled copy leaves the clipboard alone.
+typedef struct {
+    char *data;         // Mapped export, NULL if empty
+    size_t length;
+} ClipboardExport;
+
+static void clipboard_export_free(gpointer data) {
+    ClipboardExport *export = data;
+    if (export->data) munmap(export->data, export->length);
+    g_free(export);
+}
+
+static ClipboardExport *clipboard_export_render(const ExportSelection *selection, GCancellable *cancellable,
+                                                TaskProgress *progress, GError **error) {
+    char *path = g_build_filename(g_get_tmp_dir(), "codebase-exporter-XXXXXX", NULL);
+    int fd = g_mkstemp(path);
+    if (fd == -1) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Cannot create a temporary file for the clipboard: %s", strerror(errno));
+        g_free(path);
+        return NULL;
+    }
+    unlink(path); // Gone once the descriptor and the mapping are
+    g_free(path);
+
+    FILE *file = fdopen(fd, "w+");
+    if (!file) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Cannot open a temporary file for the clipboard: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    gint64 started = stats_begin();
+    ExportSink sink;
+    export_sink_init_file(&sink, file);
+    gboolean ok = export_files(&sink, selection, EXPORT_MARKDOWN, cancellable, progress) >= 0 &&
+                  export_sink_finish(&sink) && fflush(file) == 0;
+    ClipboardExport *export = g_new0(ClipboardExport, 1);
+    if (ok && sink.bytes_written > 0) {
+        void *map = mmap(NULL, sink.bytes_written, PROT_READ, MAP_SHARED, fd, 0);
+        ok = map != MAP_FAILED;
+        if (ok) {
+            export->data = map;
+            export->length = sink.bytes_written;
+        }
+    }
+    fclose(file); // The mapping stays valid
+    stats_end_phase("clipboard", started);
+    if (!ok) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to generate markdown content");
+        g_clear_pointer(&export, clipboard_export_free);
+    }
+    return export;
+}
+
+static void copy_task_thread(GTask *gtask, gpointer source, gpointer task_data, GCancellable *cancellable) {
+    BackgroundTask *task = task_data;
+    GError *error = NULL;
+    ClipboardExport *export = clipboard_export_render(task->selection, cancellable, &task->progress, &error);
+    if (export) {
+        g_task_return_pointer(gtask, export, clipboard_export_free);
+    } else {
+        g_task_return_error(gtask, error);
+    }
+}
+
+static void on_clipboard_get(GtkClipboard *board, GtkSelectionData *selection_data, guint info, gpointer owner) {
+    ClipboardExport *export = owner;
+    gtk_selection_data_set_text(selection_data, export->data ? export->data : "", export->length);
+}
+
+// Called when another owner takes the clipboard, or a new copy replaces ours
+static void on_clipboard_clear(GtkClipboard *board, gpointer owner) {
+    clipboard_export_free(owner);
+}
+
+// Offer a rendered export on the clipboard. Takes ownership of export.
+static gboolean clipboard_take(ClipboardExport *export) {
+    GtkTargetList *target_list = gtk_target_list_new(NULL, 0);
+    gtk_target_list_add_text_targets(target_list, 0);
+    gint target_count = 0;
+    GtkTargetEntry *targets = gtk_target_table_new_from_list(target_list, &target_count);
+    gboolean taken = gtk_clipboard_set_with_data(clipboard, targets, target_count,
+                                                 on_clipboard_get, on_clipboard_clear, export);
+    if (taken) {
+        gtk_clipboard_set_can_store(clipboard, NULL, 0); // Let a clipboard manager keep it after we exit
+    } else {
+        clipboard_export_free(export);
+    }
+    gtk_target_table_free(targets, target_count);
+    gtk_target_list_unref(target_list);
+    return taken;
+}
+
+static void on_copy_finished(GObject *source, GAsyncResult *result, gpointer data) {
+    BackgroundTask *task = g_task_get_task_data(G_TASK(result));
+    GError *error = NULL;
+    ClipboardExport *export = g_task_propagate_pointer(G_TASK(result), &error);
+
+    if (!background_task_finish(result)) {
+        if (export) clipboard_export_free(export); // Superseded by a newer task
+    } else if (!export) {
+        report_task_error(error, "Copy cancelled.");
+    } else if (!clipboard_take(export)) {
+        gtk_label_set_text(GTK_LABEL(status_label), "Ready");
+        show_message(GTK_MESSAGE_ERROR, "Could not take the clipboard");
+    } else {
+        char status_text[100];
+        snprintf(status_text, sizeof(status_text), "Copied %u files to clipboard", task->selection->indices->len);
+        gtk_label_set_text(GTK_LABEL(status_label), status_text);
+        update_stats_tooltip();
+    }
+    g_clear_error(&error);
+}
+
+// Function to copy to clipboard: renders the export in the background and
+// takes the clipboard when it is done
+void copy_to_clipboard() {
+    ExportSelection *selection = export_selection_new(file_table);
+    if (selection->indices->len == 0) {
+        export_selection_free(selection);
+        show_message(GTK_MESSAGE_WARNING, "No files were selected");
+        return;
+    }
+
+    BackgroundTask *task = background_task_new("Copying");
+    selection->cache = export_cache;
+    selection->excerpt = gui_excerpt_policy();
+    selection->dedupe = TRUE;
+    task->selection = selection;
+    background_task_start(task, copy_task_thread, on_copy_finished);
+}
+
+// Show the estimated size of the selection next to the status label. Kept
+// as a running total, so this costs the same for any number of files.
+static void update_token_label(void) {
+    guint64 tokens = file_table ? file_table->selected_tokens : 0;
+    guint64 budget = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(budget_spin));
+    char text[100];
+    if (budget > 0) {
+        snprintf(text, sizeof(text), "~%" G_GUINT64_FORMAT " / %" G_GUINT64_FORMAT " tokens%s",
+                 tokens, budget, tokens > budget ? " (over budget)" : "");
+    } else {
+        snprintf(text, sizeof(text), "~%" G_GUINT64_FORMAT " tokens", tokens);
+    }
+    gtk_label_set_text(GTK_LABEL(token_label), text);
+}
+
+// Callback for the fit button (data is the files view): drop files from the
+// selection until it fits in the budget
+void on_fit_budget_clicked(GtkWidget *widget, gpointer data) {
+    guint64 budget = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(budget_spin));
+    if (!file_table || budget == 0) return;
+
+    guint dropped = file_table_fit_budget(file_table, budget);
+    gtk_widget_queue_draw(GTK_WIDGET(data));
+    update_token_label();
+
+    char status_msg[100];
+    snprintf(status_msg, sizeof(status_msg), "Deselected %u files to fit the budget.", dropped);
+    gtk_label_set_text(GTK_LABEL(status_label), status_msg);
+}
+
+void on_budget_changed(GtkSpinButton *spin, gpointer data) {
+    update_token_label();
+}
+
+// Callback for save button
+void on_save_clicked(GtkWidget *widget, gpointer data) {
+    save_to_markdown();
+}
+
+// Callback for copy to clipboard button
+void on_copy_clicked(GtkWidget *widget, gpointer data) {
+    copy_to_clipboard();
+}
+
+// Callback for select all button (data is the files view)
+void on_select_all_clicked(GtkWidget *widget, gpointer data) {
+    GtkTreeModel *model = gtk_tree_view_get_model(GTK_TREE_VIEW(data));
+    if (!model) return;
+    file_list_model_set_all(FILE_LIST_MODEL(model), TRUE);
+    gtk_widget_queue_draw(GTK_WIDGET(data));
+    update_token_label();
+}
+
+// Callback for clear all button (data is the files view)
+void on_clear_all_clicked(GtkWidget *widget, gpointer data) {
+    GtkTreeModel *model = gtk_tree_view_get_model(GTK_TREE_VIEW(data));
+    if (!model) return;
+    file_list_model_set_all(FILE_LIST_MODEL(model), FALSE);
+    gtk_widget_queue_draw(GTK_WIDGET(data));
+    update_token_label();
+}
+
+// Callback when a file's checkbox cell is toggled (data is the files view)
+void on_file_toggled(GtkCellRendererToggle *cell, gchar *path_string, gpointer data) {
+    GtkTreeModel *model = gtk_tree_view_get_model(GTK_TREE_VIEW(data));
+    GtkTreePath *path = gtk_tree_path_new_from_string(path_string);
+    GtkTreeIter iter;
+
+    if (model && gtk_tree_model_get_iter(model, &iter, path)) {
+        FileEntry *entry = file_list_model_entry(FILE_LIST_MODEL(model), GPOINTER_TO_INT(iter.user_data));
+        file_table_set_selected(FILE_LIST_MODEL(model)->table, entry, !entry->selected);
+        gtk_tree_model_row_changed(model, path, &iter);
+    }
+    gtk_tree_path_free(path);
+    update_token_label();
+}
+
+// Show the results of a finished scan
+static void populate_file_list(FileTable *table, GtkWidget *files_view) {
+    if (file_table_same_roots(file_table, table)) {
+        file_table_copy_selection(table, file_table);
+    }
+    file_table_unref(file_table);
+    file_table = file_table_ref(table);
+
+    // Swapping in a new model is O(1); the view only asks for visible rows
+    gint64 started = stats_begin();
+    FileListModel *model = file_list_model_new(file_table);
+    gtk_tree_view_set_model(GTK_TREE_VIEW(files_view), GTK_TREE_MODEL(model));
+    g_object_unref(model);
+    stats_end_phase("fill list", started);
+    update_token_label();
+
+    guint file_count = file_table_count(file_table);
+    if (file_count == 0) {
+         gtk_label_set_text(GTK_LABEL(status_label), "No allowed files found in the selected directory.");
+    } else {
+        char status_msg[160];
+        if (file_table->skipped > 0) {
+            snprintf(status_msg, sizeof(status_msg),
+                     "Loaded %u files; %u binary, generated or large files are unchecked. Ready.",
+                     file_count, file_table->skipped);
+        } else {
+            snprintf(status_msg, sizeof(status_msg), "Loaded %u files. Ready.", file_count);
+        }
+        gtk_label_set_text(GTK_LABEL(status_label), status_msg);
+    }
+}
+
+// Build the tree view that lists the scanned files with a checkbox column
+static GtkWidget *create_files_view(void) {
+    GtkWidget *files_view = gtk_tree_view_new();
+    gtk_tree_view_set_headers_visible(GTK_TREE_VIEW(files_view), FALSE);
+    gtk_tree_view_set_search_column(GTK_TREE_VIEW(files_view), FILE_COLUMN_PATH);
+
+    GtkCellRenderer *toggle_renderer = gtk_cell_renderer_toggle_new();
+    g_signal_connect(toggle_renderer, "toggled", G_CALLBACK(on_file_toggled), files_view);
+    GtkTreeViewColumn *toggle_column = gtk_tree_view_column_new_with_attributes(
+        "", toggle_renderer, "active", FILE_COLUMN_SELECTED, NULL);
+    gtk_tree_view_column_set_sizing(toggle_column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_fixed_width(toggle_column, 32);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(files_view), toggle_column);
+
+    GtkTreeViewColumn *path_column = gtk_tree_view_column_new_with_attributes(
+        "File", gtk_cell_renderer_text_new(), "text", FILE_COLUMN_PATH, NULL);
+    gtk_tree_view_column_set_sizing(path_column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_column_set_expand(path_column, TRUE);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(files_view), path_column);
+
+    // All rows have the same height, so GTK never has to measure off-screen rows
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(files_view), TRUE);
+    return files_view;
+}
+
+// --- Directory Watcher ---
+
+// While the window is open, inotify watches every scanned directory so that
+// files created, deleted, renamed or edited outside the app show up without
+// pressing Refresh. Events only schedule a rescan, which the index keeps
+// cheap: the rescan stats the files of a directory that was not listed
+// again, so an edited file gets its size and token count updated.
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | \
+                      IN_ONLYDIR)
+#define WATCH_REFRESH_DELAY_MS 500 // Coalesce bursts of events into one rescan
+
+static int watch_fd = -1;
+static char *watch_root = NULL;     // Project the watches belong to
+static guint watch_source_id = 0;
+static guint watch_refresh_id = 0;
+
+void load_files_from_directory(const char *dir_path, GtkWidget *files_view);
+
+static gboolean on_watch_refresh(gpointer data) {
+    if (running_task) {
+        return G_SOURCE_CONTINUE; // Never interrupt a scan or export; try again later
+    }
+    watch_refresh_id = 0;
+    load_files_from_directory(watch_root, GTK_WIDGET(data));
+    return G_SOURCE_REMOVE;
+}
+
+// Read the pending events of the inotify instance fd (non-blocking).
+// Returns TRUE if any of them may change a scan.
+static gboolean directory_watcher_read_events(int fd) {
+    char buffer[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    gboolean relevant = FALSE;
+    ssize_t len;
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + len; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            // Hidden entries are never listed, so changes to them (.git) do not matter
+            if (!(event->mask & IN_IGNORED) && (event->len == 0 || event->name[0] != '.')) {
+                relevant = TRUE;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return relevant;
+}
+
+static gboolean on_watch_event(GIOChannel *channel, GIOCondition condition, gpointer data) {
+    if (directory_watcher_read_events(watch_fd) && !watch_refresh_id) {
+        watch_refresh_id = g_timeout_add(WATCH_REFRESH_DELAY_MS, on_watch_refresh, data);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Called before scanning dir_path from the GUI. Starts a fresh inotify
+// instance when the project changes. Returns TRUE if the scan has to watch
+// every directory, FALSE if only the ones it lists again.
+static gboolean directory_watcher_prepare(const char *dir_path, GtkWidget *files_view) {
+    if (watch_fd != -1 && watch_root && strcmp(watch_root, dir_path) == 0) {
+        return FALSE;
+    }
+
+    if (watch_source_id) g_source_remove(watch_source_id);
+    if (watch_refresh_id) g_source_remove(watch_refresh_id);
+    watch_source_id = watch_refresh_id = 0;
+    if (watch_fd != -1) close(watch_fd); // Drops all its watches once running scans let go
+    g_free(watch_root);
+    watch_root = g_strdup(dir_path);
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd == -1) {
+        perror("inotify_init1 failed");
+        return FALSE;
+    }
+    GIOChannel *channel = g_io_channel_unix_new(watch_fd);
+    watch_source_id = g_io_add_watch(channel, G_IO_IN, on_watch_event, files_view);
+    g_io_channel_unref(channel);
+    return TRUE;
+}
+
+// Add watches for the directories of index: all of them, or only the ones
+// the scan listed again (new or changed). Runs in the scan's worker thread,
+// on its own descriptor for the inotify instance.
+static void directory_watcher_add(int fd, const ScanIndex *index, gboolean all) {
+    if (fd == -1) return;
+    for (guint i = 0; i < index->dirs->len; i++) {
+        const IndexDir *index_dir = INDEX_DIR(index, i);
+        if (!all && !index_dir->rescanned) continue;
+        if (inotify_add_watch(fd, index_dir->path, WATCH_EVENTS) == -1 && errno == ENOSPC) {
+            fprintf(stderr, "Watching only part of %s: raise fs.inotify.max_user_watches "
+                            "to follow every directory\n", index->root);
+            return;
+        }
+    }
+}
+
+static void scan_task_thread(GTask *gtask, gpointer source, gpointer task_data, GCancellable *cancellable) {
+    BackgroundTask *task = task_data;
+    // Count tokens and sniff content for every project type, so switching
+    // types shows totals without another pass over the files
+    ExtensionFilter source_files;
+    extension_filter_init(&source_files);
+    for (int i = 0; project_types[i].name != NULL; i++) {
+        extension_filter_add_project_type(&source_files, i);
+    }
+
+    // Every root of the workspace is walked at the same time. Roots the
+    // current table already has start from its indexes.
+    char **paths = workspace_split(task->dir_path);
+    guint count = g_strv_length(paths);
+    ScanRoot *roots = g_new0(ScanRoot, count);
+    for (guint i = 0; i < count; i++) {
+        roots[i].path = paths[i];
+        roots[i].options = (ScanOptions){ignore_frame_new_global(paths[i], TRUE, NULL), TRUE,
+                                         &source_files, &source_files};
+        for (guint j = 0; task->previous_table && j < task->previous_table->roots->len; j++) {
+            ScanIndex *previous = FILE_TABLE_ROOT(task->previous_table, j)->index;
+            if (!roots[i].previous && strcmp(previous->root, paths[i]) == 0) {
+                roots[i].previous = scan_index_ref(previous);
+            }
+        }
+    }
+    scan_roots(roots, count, TRUE, cancellable, &task->progress);
+
+    GPtrArray *indexes = g_ptr_array_new_with_free_func((GDestroyNotify)scan_index_unref);
+    char *failed = count == 0 ? g_strdup(task->dir_path) : NULL;
+    for (guint i = 0; i < count; i++) {
+        if (roots[i].index) {
+            directory_watcher_add(task->watch_fd, roots[i].index, task->watch_all);
+            g_ptr_array_add(indexes, scan_index_ref(roots[i].index));
+        } else if (!failed) {
+            failed = g_strdup(paths[i]);
+        }
+        scan_root_clear(&roots[i]);
+    }
+    g_free(roots);
+    g_strfreev(paths);
+    extension_filter_clear(&source_files);
+
+    if (failed) {
+        g_task_return_new_error(gtask, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open directory: %s", failed);
+        g_ptr_array_unref(indexes);
+        g_free(failed);
+        return;
+    }
+    g_task_return_pointer(gtask, indexes, (GDestroyNotify)g_ptr_array_unref);
+}
+
+// Show the files of indexes (ScanIndex *, one per root) that the selected
+// project type allows. The entry after the project types in the list
+// filters every root by the types detected for it, from its files.
+static void show_indexes(GPtrArray *indexes, GtkWidget *files_view) {
+    int type = gtk_combo_box_get_active(GTK_COMBO_BOX(project_type_combo));
+    ContentLimits limits = {DEFAULT_MAX_FILE_SIZE, DEFAULT_MAX_LINE_LENGTH};
+    FileTable *table = file_table_new();
+    for (guint i = 0; i < indexes->len; i++) {
+        ScanIndex *index = g_ptr_array_index(indexes, i);
+        ExtensionFilter filter;
+        extension_filter_init(&filter);
+        if (type == project_type_count()) {
+            // When nothing is recognised, offer the source files of every type
+            guint64 detected = detect_project_types(index->root, index);
+            extension_filter_add_project_types(&filter, detected ? detected : G_MAXUINT64);
+        } else {
+            extension_filter_add_project_type(&filter, type);
+        }
+        file_table_add_index(table, index, &filter, &limits);
+        extension_filter_clear(&filter);
+    }
+
+    populate_file_list(table, files_view);
+    file_table_unref(table);
+}
+
+static void on_scan_finished(GObject *source, GAsyncResult *result, gpointer data) {
+    BackgroundTask *task = g_task_get_task_data(G_TASK(result));
+    GError *error = NULL;
+    GPtrArray *indexes = g_task_propagate_pointer(G_TASK(result), &error);
+
+    if (background_task_finish(result)) {
+        if (!indexes) {
+            report_task_error(error, "Scan cancelled.");
+        } else {
+            // Filter with the project type selected now, which may have
+            // changed while the scan was running
+            show_indexes(indexes, task->files_view);
+            update_stats_tooltip();
+        }
+    }
+    if (indexes) g_ptr_array_unref(indexes);
+    g_clear_error(&error);
+}
+
+// Function to load files from directory, or from every directory of a
+// workspace. The walk runs in the background; the list is replaced once it
+// completes.
+void load_files_from_directory(const char *dir_path, GtkWidget *files_view) {
+    gtk_label_set_text(GTK_LABEL(status_label), "Loading files...");
+
+    BackgroundTask *task = background_task_new("Scanning");
+    task->dir_path = g_strdup(dir_path);
+    task->files_view = files_view;
+    if (file_table) task->previous_table = file_table_ref(file_table);
+    task->watch_all = directory_watcher_prepare(dir_path, files_view);
+    if (watch_fd != -1) task->watch_fd = fcntl(watch_fd, F_DUPFD_CLOEXEC, 0);
+    background_task_start(task, scan_task_thread, on_scan_finished);
+}
+
+// The workspace in the path field. Free the result with g_free().
+char *get_project_path(void) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(project_path_view));
+    GtkTextIter start, end;
+    gtk_text_buffer_get_bounds(buffer, &start, &end);
+    return gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
+}
+
+void set_project_path(const char *workspace) {
+    gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(project_path_view)), workspace, -1);
+}
+
+// Callback for project type combo box
+void on_project_type_changed(GtkWidget *widget, gpointer data) {
+    char *dir_path = get_project_path();
+
+    // The scanned files of this project are all in memory: just filter again.
+    // A scan that is still running picks up the new type when it finishes.
+    if (file_table_is_workspace(file_table, dir_path)) {
+        GPtrArray *indexes = g_ptr_array_new();
+        for (guint i = 0; i < file_table->roots->len; i++) {
+            g_ptr_array_add(indexes, FILE_TABLE_ROOT(file_table, i)->index);
+        }
+        show_indexes(indexes, GTK_WIDGET(data));
+        g_ptr_array_free(indexes, TRUE);
+    } else {
+        load_files_from_directory(dir_path, GTK_WIDGET(data));
+    }
+    g_free(dir_path);
+}
+
+// Select the project type detected for a workspace being opened: the type
+// of a single directory, or "Detect per directory" for several directories
+// or a project of several types. Returns TRUE if the selection changed,
+// which reloads the file list through on_project_type_changed().
+static gboolean select_detected_project_type(const char *workspace) {
+    char **roots = workspace_split(workspace);
+    int type = -1;
+    if (g_strv_length(roots) > 1) {
+        type = project_type_count();
+    } else if (roots[0]) {
+        guint64 types = detect_project_types(roots[0], NULL);
+        if (types != 0) type = (types & (types - 1)) ? project_type_count() : g_bit_nth_lsf(types, -1);
+    }
+    g_strfreev(roots);
+
+    if (type < 0 || type == gtk_combo_box_get_active(GTK_COMBO_BOX(project_type_combo))) return FALSE;
+    gtk_combo_box_set_active(GTK_COMBO_BOX(project_type_combo), type);
+    return TRUE;
+}
+
+// Callback for keys in the path field (data is the files view): Enter
+// loads the workspace, Shift+Enter starts a line for another directory.
+gboolean on_path_key_pressed(GtkWidget *widget, GdkEventKey *event, gpointer data) {
+    if (event->keyval != GDK_KEY_Return && event->keyval != GDK_KEY_KP_Enter) return FALSE;
+    if (event->state & GDK_SHIFT_MASK) return FALSE;
+
+    char *workspace = get_project_path();
+    write_last_directory(workspace);
+    if (!select_detected_project_type(workspace)) {
+        load_files_from_directory(workspace, GTK_WIDGET(data));
+    }
+    g_free(workspace);
+    return TRUE;
+}
+
+// Callback for browse button
+void on_browse_clicked(GtkWidget *widget, gpointer data) {
+    GtkWidget *dialog;
+    GtkFileChooserAction action = GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER;
+    gint res;
+    
+    dialog = gtk_file_chooser_dialog_new("Select Project Directory",
+                                        NULL,
+                                        action,
+                                        "_Cancel",
+                                        GTK_RESPONSE_CANCEL,
+                                        "_Open",
+                                        GTK_RESPONSE_ACCEPT,
+                                        NULL);
+    
+    // Picking several directories makes them a workspace
+    gtk_file_chooser_set_select_multiple(GTK_FILE_CHOOSER(dialog), TRUE);
+
+    res = gtk_dialog_run(GTK_DIALOG(dialog));
+    if (res == GTK_RESPONSE_ACCEPT) {
+        GSList *folders = gtk_file_chooser_get_filenames(GTK_FILE_CHOOSER(dialog));
+        GString *workspace = g_string_new(NULL);
+        for (GSList *folder = folders; folder; folder = folder->next) {
+            if (workspace->len > 0) g_string_append(workspace, WORKSPACE_SEPARATOR);
+            g_string_append(workspace, folder->data);
+        }
+        g_slist_free_full(folders, g_free);
+
+        // Update path field
+        set_project_path(workspace->str);
+
+        // Reload files, through the type list when the detected type differs
+        if (!select_detected_project_type(workspace->str)) {
+            load_files_from_directory(workspace->str, data); // data is the files view
+        }
+
+        // Save the selected directory to config
+        write_last_directory(workspace->str);
+
+        g_string_free(workspace, TRUE);
+    }
+    
+    gtk_widget_destroy(dialog);
+}
+
+// Callback for refresh button
+void on_refresh_clicked(GtkWidget *widget, gpointer data) {
+    char *dir_path = get_project_path();
+    load_files_from_directory(dir_path, GTK_WIDGET(data));
+    g_free(dir_path);
+}
+
+// --- Benchmarking ---
+
+// What --bench reports for each phase of a headless run: wall time, I/O
+// system calls and bytes as the kernel counts them for the whole process
+// (/proc/self/io, so the walker threads are included) and peak RSS.
+typedef struct {
+    gint64 time;            // Monotonic, microseconds
+    guint64 read_calls;
+    guint64 write_calls;
+    guint64 read_bytes;     // Through read-like calls, page cache hits included
+    long max_rss_kb;
+} BenchSample;
+
+static void bench_sample(BenchSample *sample) {
+    memset(sample, 0, sizeof(*sample));
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io) {
+        char name[32];
+        guint64 value;
+        while (fscanf(io, "%31s %" G_GUINT64_FORMAT, name, &value) == 2) {
+            if (strcmp(name, "syscr:") == 0) sample->read_calls = value;
+            else if (strcmp(name, "syscw:") == 0) sample->write_calls = value;
+            else if (strcmp(name, "rchar:") == 0) sample->read_bytes = value;
+        }
+        fclose(io);
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) sample->max_rss_kb = usage.ru_maxrss;
+    sample->time = g_get_monotonic_time(); // Last, so the sampling itself is not timed
+}
+
+// Print one line for the phase between start and end, which handled files
+// files and bytes bytes (what was read or written, depending on the phase)
+static void bench_report(const char *phase, const BenchSample *start, const BenchSample *end,
+                         guint64 files, guint64 bytes) {
+    double seconds = (end->time - start->time) / 1e6;
+    fprintf(stderr, "%-8s %9" G_GUINT64_FORMAT " files %12" G_GUINT64_FORMAT " bytes %10.2f ms"
+            " %11.0f files/s %9.1f MB/s %8" G_GUINT64_FORMAT " read/write calls %8ld KB peak RSS\n",
+            phase, files, bytes, seconds * 1000.0,
+            seconds > 0 ? files / seconds : 0.0,
+            seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0,
+            (end->read_calls + end->write_calls) - (start->read_calls + start->write_calls),
+            end->max_rss_kb);
 }
 
-// Read the last directory from the config file
-char* read_last_directory() {
-    char *config_file = get_config_file_path();
-    if (!config_file) return NULL;
-
-    FILE *file = fopen(config_file, "r");
-    if (!file) {
-        //perror("Could not open config file for reading"); // Don't print error if file just doesn't exist
-        return NULL;
+// Write the spans stats kept as a Chrome trace (the JSON object format),
+// with the counters as a final counter event
+gboolean stats_write_trace(const char *path) {
+    GString *out = g_string_new("{\"traceEvents\":[\n");
+    g_mutex_lock(&stats.lock);
+    for (guint i = 0; i < stats.events->len; i++) {
+        const TraceEvent *event = &g_array_index(stats.events, TraceEvent, i);
+        g_string_append_printf(out, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT
+                               ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":1,\"tid\":%d",
+                               event->name, event->category, event->start, event->duration, event->thread);
+        if (event->detail) {
+            g_string_append(out, ",\"args\":{\"path\":\"");
+            json_escape_append(out, event->detail, strlen(event->detail), FALSE);
+            g_string_append(out, "\"}");
+        }
+        g_string_append(out, "},\n");
     }
+    g_string_append_printf(out, "{\"name\":\"counters\",\"ph\":\"C\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":1,\"args\":{",
+                           g_get_monotonic_time() - stats.origin);
+    for (int i = 0; i < STAT_COUNT; i++) {
+        g_string_append_printf(out, "%s\"%s\":%" G_GINT64_FORMAT, i > 0 ? "," : "", stat_counter_names[i],
+                               __atomic_load_n(&stats.counters[i], __ATOMIC_RELAXED));
+    }
+    g_string_append(out, "}}\n],\"displayTimeUnit\":\"ms\"}\n");
+    g_mutex_unlock(&stats.lock);
 
-    char *path = (char*)malloc(MAX_PATH_LENGTH);
-    if (!path) {
-        fclose(file);
-        perror("malloc failed for reading config");
-        return NULL;
+    GError *error = NULL;
+    gboolean written = g_file_set_contents(path, out->str, out->len, &error);
+    if (!written) {
+        fprintf(stderr, "Error: Cannot write trace %s: %s\n", path, error->message);
+        g_error_free(error);
     }
+    g_string_free(out, TRUE);
+    return written;
+}
 
-    if (fgets(path, MAX_PATH_LENGTH, file) != NULL) {
-        // Remove trailing newline if present
-        size_t len = strlen(path);
-        if (len > 0 && path[len - 1] == '\n') {
-            path[len - 1] = '\0';
-        }
-        fclose(file);
-        // Check if directory still exists
-        struct stat st;
-        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
-             return path;
-        } else {
-             fprintf(stderr, "Warning: Last directory '%s' from config not found or not a directory.\n", path);
-             free(path); // Free memory if path is invalid
+// --- Daemon ---
+
+// With --serve SOCKET the exporter stays running for editor plugins and
+// scripts that export many times a minute. It keeps the scan index of every
+// root it has been asked for in memory, watched with inotify like the GUI
+// does and rescanned (only the directories that changed) once a burst of
+// changes settles, and an export cache of file contents, so a request for
+// unchanged files neither walks the tree nor reads it.
+//
+// The main thread accepts connections and handles inotify; each client is
+// served by a thread of its own, so a slow reader only holds up itself.
+// Requests take the daemon's lock while they look up and filter their
+// roots, and stream the export without it. Walks run outside the lock too:
+// a root being scanned is marked, and only requests for that root wait for
+// the scan to finish. Rescans after inotify events get a thread each. The
+// socket is only accessible to the user running the daemon, since it
+// serves any file that user can read.
+//
+// Requests come over a Unix domain socket, one per connection, as lines of
+// "key value" ended by an empty line:
+//
+//   root DIR               Project directory; repeat for a workspace
+//   type NAMES             Project types, comma-separated (default: detected)
+//   ext EXTS               Extra extensions, comma-separated
+//   file PATH              Export only PATH (as shown in exports; a PATH
+//                          ending in / selects a directory); repeatable
+//   format FORMAT          markdown (default) or jsonl
+//   budget TOKENS          Leave out files, in order, that do not fit
+//   max-size SIZE, max-line N, no-skip
+//   excerpt-size SIZE, excerpt-lines N, outline
+//   dedupe                 Write repeated files as references (off by
+//                          default: the header's TOKENS does not count it)
+//
+// The values mean what the options of the same name do. The reply is a
+// line "OK FILES TOKENS" followed by the export, or "ERROR MESSAGE"; either
+// way the daemon then closes the connection.
+
+#define DAEMON_MAX_REQUEST (64 * 1024)
+#define DAEMON_REQUEST_TIMEOUT_MS 5000
+#define DAEMON_SEND_TIMEOUT_S 30 // A client that reads nothing for this long is dropped
+
+typedef struct {
+    char *path;
+    ScanIndex *index;
+    int watch_fd;           // inotify instance watching the root's directories, or -1
+    gint64 changed_at;      // Monotonic time of the first change not rescanned yet, 0 if none
+    gboolean scanning;      // A thread is walking the root without the lock
+    guint source_files_version; // Of the source_files the index was scanned with
+} DaemonRoot;
+
+typedef struct {
+    GMutex lock;            // Guards roots (and their fields) and source_files
+    GCond scanned;          // Signalled when a root's scan finishes
+    GPtrArray *roots;       // DaemonRoot
+    ExportCache *cache;     // Has its own lock
+    ExtensionFilter source_files; // Every project type, to count tokens and sniff while scanning
+    guint source_files_version;   // Bumped when a request adds to source_files
+    int wake_fd;            // Written to when a root is added or scanned, so the main loop looks again
+} Daemon;
+
+// Parse a positive number, with a K, M or G suffix (powers of 1024) when
+// units is TRUE. Returns FALSE if text is anything else.
+static gboolean parse_count(const char *text, gboolean units, guint64 *value) {
+    char *end = NULL;
+    *value = g_ascii_strtoull(text, &end, 10);
+    if (units && *end) {
+        const char *unit = strchr("KMG", g_ascii_toupper(*end));
+        if (unit) {
+            *value <<= 10 * (unit - "KMG" + 1);
+            end++;
         }
-    } else {
-        free(path); // Free memory if fgets fails or file is empty
     }
+    return *value > 0 && end != text && *end == '\0';
+}
 
-    fclose(file);
-    return NULL; // Return NULL if read failed, file empty, or path invalid
+// Tell the main loop to rebuild its poll set and rescan deadlines
+static void daemon_wake(Daemon *daemon) {
+    if (daemon->wake_fd != -1 && write(daemon->wake_fd, "", 1) == -1) {
+        // The pipe is full: the main loop has a wake-up pending anyway
+    }
 }
 
-// Write the last directory to the config file
-void write_last_directory(const char *path) {
-    if (!path) return;
+// Bring root's index up to date: a walk of the whole tree the first time
+// (from the index saved on disk when there is one), then only of the
+// directories that changed. Call with the lock held and root->scanning
+// set; the lock is released for the walk, and scanning cleared after it.
+static void daemon_root_scan(Daemon *daemon, DaemonRoot *root) {
+    ExtensionFilter source_files;
+    extension_filter_copy(&source_files, &daemon->source_files);
+    guint version = daemon->source_files_version;
+    ScanIndex *previous = root->index ? scan_index_ref(root->index) : NULL;
+    root->changed_at = 0;
+    g_mutex_unlock(&daemon->lock);
 
-    char *config_file = get_config_file_path();
-    if (!config_file) return;
+    ScanRoot scan = {root->path, {ignore_frame_new_global(root->path, TRUE, NULL), TRUE, &source_files, &source_files},
+                     previous, NULL};
+    scan_roots(&scan, 1, TRUE, NULL, NULL);
+    if (scan.index) directory_watcher_add(root->watch_fd, scan.index, previous == NULL);
 
-    FILE *file = fopen(config_file, "w");
-    if (!file) {
-        perror("Could not open config file for writing");
-        return;
+    g_mutex_lock(&daemon->lock);
+    if (scan.index) {
+        scan_index_unref(root->index);
+        root->index = scan_index_ref(scan.index);
+        root->source_files_version = version;
     }
+    root->scanning = FALSE;
+    g_cond_broadcast(&daemon->scanned);
+    g_mutex_unlock(&daemon->lock);
+    scan_root_clear(&scan); // Frees the old index, unless a table still holds it
+    extension_filter_clear(&source_files);
+    daemon_wake(daemon);
+    g_mutex_lock(&daemon->lock);
+}
 
-    fprintf(file, "%s\n", path);
-    fclose(file);
+// Wait for a scan of root that is under way, then scan it if it has no
+// index yet, changed since, or misses extensions added to source_files.
+// Call with the lock held.
+static void daemon_root_update(Daemon *daemon, DaemonRoot *root) {
+    while (root->scanning) g_cond_wait(&daemon->scanned, &daemon->lock);
+    if (root->index && !root->changed_at && root->source_files_version == daemon->source_files_version) return;
+    root->scanning = TRUE;
+    daemon_root_scan(daemon, root);
 }
 
-// Function to read file content
-char* read_file_content(const char *path) {
-    FILE *file = fopen(path, "r");
-    if (!file) {
-        fprintf(stderr, "Cannot open file %s\n", path);
+// The root for path, registered and scanned on first use and rescanned if
+// it changed since. Returns NULL if path is not a directory. Call with the
+// lock held; other requests can take it while the root is scanned.
+static DaemonRoot *daemon_root_get(Daemon *daemon, const char *path) {
+    struct stat st;
+    char *resolved = realpath(path, NULL);
+    if (!resolved || stat(resolved, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        free(resolved);
         return NULL;
     }
-    
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    rewind(file);
-    
-    // Allocate memory for the entire file content plus null terminator
-    char *buffer = (char*) malloc(file_size + 1);
-    if (!buffer) {
-        fprintf(stderr, "Memory allocation failed\n");
-        fclose(file);
-        return NULL;
+
+    DaemonRoot *root = NULL;
+    for (guint i = 0; i < daemon->roots->len && !root; i++) {
+        DaemonRoot *known = g_ptr_array_index(daemon->roots, i);
+        if (strcmp(known->path, resolved) == 0) root = known;
     }
-    
-    // Read file content
-    size_t read_size = fread(buffer, 1, file_size, file);
-    buffer[read_size] = '\0';  // Null-terminate the string
-    
-    fclose(file);
-    return buffer;
+    if (!root) {
+        root = g_new0(DaemonRoot, 1);
+        root->path = g_strdup(resolved);
+        root->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        g_ptr_array_add(daemon->roots, root);
+        daemon_wake(daemon);
+    }
+    free(resolved);
+
+    daemon_root_update(daemon, root);
+    return root->index ? root : NULL;
 }
 
-// Function to determine file language extension
-const char* get_language_extension(const char *filename) {
-    char *dot = strrchr(filename, '.');
-    if (dot) {
-        return dot + 1;  // Return extension without the dot
-    }
-    return "";
+static void daemon_root_free(gpointer data) {
+    DaemonRoot *root = data;
+    if (root->watch_fd != -1) close(root->watch_fd);
+    scan_index_unref(root->index);
+    g_free(root->path);
+    g_free(root);
 }
 
-// Function to check if a file extension is in the allowed list
-int is_extension_allowed(const char *filename) {
-    int project_type_index = gtk_combo_box_get_active(GTK_COMBO_BOX(project_type_combo));
-    if (project_type_index < 0) return 1; // If no project type selected, allow all
-    
-    char *dot = strrchr(filename, '.');
-    if (!dot) return 0; // No extension
-    
-    const char *ext = dot + 1;
-    
-    for (int i = 0; i < project_types[project_type_index].extension_count; i++) {
-        if (strcasecmp(ext, project_types[project_type_index].extensions[i]) == 0) {
-            return 1;
-        }
+static void daemon_reply_error(int fd, const char *message) {
+    char *line = g_strdup_printf("ERROR %s\n", message);
+    if (write(fd, line, strlen(line)) == -1) {
+        // The client is gone; nothing to tell
     }
-    
-    return 0;
+    fprintf(stderr, "Request failed: %s\n", message);
+    g_free(line);
 }
 
-// Function to generate markdown content
-char* generate_markdown_content() {
-    // First calculate the required buffer size
-    size_t total_size = 0;
-    for (int i = 0; i < file_count; i++) {
-        if (files[i].selected) {
-            char *content = read_file_content(files[i].path);
-            if (content) {
-                total_size += strlen(content);
-                free(content);
-            }
-            
-            // Add size for markdown formatting
-            total_size += 1024; // Extra space for formatting
-        }
+// Read a request, up to the empty line that ends it. Returns NULL if the
+// client sent none in time.
+static GString *daemon_read_request(int fd) {
+    GString *request = g_string_new(NULL);
+    char buffer[4096];
+    while (request->len < DAEMON_MAX_REQUEST && !strstr(request->str, "\n\n")) {
+        struct pollfd ready = {fd, POLLIN, 0};
+        if (poll(&ready, 1, DAEMON_REQUEST_TIMEOUT_MS) <= 0) break;
+        ssize_t read_size = read(fd, buffer, sizeof(buffer));
+        if (read_size == -1 && errno == EINTR) continue;
+        if (read_size <= 0) break;
+        g_string_append_len(request, buffer, read_size);
     }
-    
-    // Allocate buffer - handle potential large size
-    if (total_size == 0) total_size = 1; // Allocate at least 1 byte if nothing selected
-    char *buffer = (char*)malloc(total_size);
-    if (!buffer) {
-        fprintf(stderr, "Memory allocation failed for markdown buffer (size: %zu)\n", total_size);
+    if (request->len == 0) {
+        g_string_free(request, TRUE);
         return NULL;
     }
-    
-    buffer[0] = '\0';
-    
-    // Generate markdown content
-    for (int i = 0; i < file_count; i++) {
-        if (files[i].selected) {
-            // Get relative path from project root
-            const char *project_path = gtk_entry_get_text(GTK_ENTRY(project_path_entry));
-            char relative_path[MAX_PATH_LENGTH];
-            
-            if (strncmp(files[i].path, project_path, strlen(project_path)) == 0) {
-                sprintf(relative_path, "%s", files[i].path + strlen(project_path) + 1); // +1 to skip the slash
-            } else {
-                strcpy(relative_path, files[i].filename);
-            }
-            
-            // Write file header with relative path
-            char header[MAX_PATH_LENGTH + 10];
-            sprintf(header, "- %s\n", relative_path);
-            strcat(buffer, header);
-            
-            // Determine language for code block
-            const char *lang = get_language_extension(files[i].filename);
-            char lang_marker[30];
-            sprintf(lang_marker, "```%s\n", lang);
-            strcat(buffer, lang_marker);
-            
-            // Read and write file content
-            char *content = read_file_content(files[i].path);
-            if (content) {
-                strcat(buffer, content);
-                free(content);
-            } else {
-                strcat(buffer, "Error reading file content\n");
-            }
-            
-            // End code block
-            strcat(buffer, "\n```\n\n");
-        }
-    }
-    
-    return buffer;
+    return request;
 }
 
-// Function to save selected files to markdown
-void save_to_markdown() {
-    char *markdown_content = generate_markdown_content();
-    if (!markdown_content) {
-        GtkWidget *dialog = gtk_message_dialog_new(NULL,
-                                                  GTK_DIALOG_MODAL,
-                                                  GTK_MESSAGE_ERROR,
-                                                  GTK_BUTTONS_OK,
-                                                  "Failed to generate markdown content");
-        gtk_dialog_run(GTK_DIALOG(dialog));
-        gtk_widget_destroy(dialog);
+// Answer one request on client, then close it. Runs in the client's thread.
+static void daemon_serve(Daemon *daemon, int client) {
+    gint64 started = g_get_monotonic_time();
+    GString *request = daemon_read_request(client);
+    if (!request) {
+        close(client);
         return;
     }
-    
-    FILE *md_file = fopen(OUTPUT_FILE, "w");
-    if (!md_file) {
-        GtkWidget *dialog = gtk_message_dialog_new(NULL,
-                                                  GTK_DIALOG_MODAL,
-                                                  GTK_MESSAGE_ERROR,
-                                                  GTK_BUTTONS_OK,
-                                                  "Failed to open output file for writing");
-        gtk_dialog_run(GTK_DIALOG(dialog));
-        gtk_widget_destroy(dialog);
-        free(markdown_content);
-        return;
+
+    GPtrArray *roots = g_ptr_array_new();       // DaemonRoot *
+    GPtrArray *type_ids = g_ptr_array_new();    // Project type + 1
+    GPtrArray *extensions = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *files = g_ptr_array_new();
+    ExportFormat format = EXPORT_MARKDOWN;
+    guint64 budget = 0;
+    ContentLimits limits = {DEFAULT_MAX_FILE_SIZE, DEFAULT_MAX_LINE_LENGTH};
+    gboolean skip_files = TRUE;
+    ExcerptPolicy excerpt = {0, 0, FALSE};
+    gboolean dedupe = FALSE;
+    char *error = NULL;
+
+    char **lines = g_strsplit(request->str, "\n", -1);
+    g_mutex_lock(&daemon->lock);
+    for (char **line = lines; *line && **line && **line != '\r' && !error; line++) {
+        g_strchomp(*line);
+        char *value = strchr(*line, ' ');
+        if (value) *value++ = '\0';
+        const char *key = *line;
+        guint64 number = 0;
+        gboolean numeric = strcmp(key, "budget") == 0 || strcmp(key, "max-size") == 0 ||
+                           strcmp(key, "max-line") == 0 || strcmp(key, "excerpt-size") == 0 ||
+                           strcmp(key, "excerpt-lines") == 0;
+        if (numeric && (!value || !parse_count(value, g_str_has_suffix(key, "size"), &number) ||
+                        (strcmp(key, "max-line") == 0 && number > G_MAXUINT16) ||
+                        (strcmp(key, "excerpt-lines") == 0 && number > G_MAXUINT))) {
+            error = g_strdup_printf("%s needs a positive number", key);
+        } else if (strcmp(key, "root") == 0 && value) {
+            DaemonRoot *root = daemon_root_get(daemon, value);
+            if (root) g_ptr_array_add(roots, root);
+            else error = g_strdup_printf("Failed to open directory: %s", value);
+        } else if (strcmp(key, "type") == 0 && value) {
+            char **names = g_strsplit(value, ",", -1);
+            for (char **name = names; *name && !error; name++) {
+                int type = find_project_type(*name);
+                if (type < 0) error = g_strdup_printf("Unknown project type '%s'", *name);
+                else g_ptr_array_add(type_ids, GINT_TO_POINTER(type + 1));
+            }
+            g_strfreev(names);
+        } else if (strcmp(key, "ext") == 0 && value) {
+            char **exts = g_strsplit(value, ",", -1);
+            for (char **ext = exts; *ext; ext++) {
+                const char *bare = (**ext == '.') ? *ext + 1 : *ext;
+                if (*bare) g_ptr_array_add(extensions, g_strdup(bare));
+            }
+            g_strfreev(exts);
+        } else if (strcmp(key, "file") == 0 && value) {
+            g_ptr_array_add(files, value);
+        } else if (strcmp(key, "format") == 0 && value) {
+            int found = -1;
+            for (int i = 0; export_format_names[i] != NULL; i++) {
+                if (g_ascii_strcasecmp(value, export_format_names[i]) == 0) found = i;
+            }
+            if (found < 0) error = g_strdup_printf("Unknown format '%s'", value);
+            else format = found;
+        } else if (strcmp(key, "budget") == 0) {
+            budget = number;
+        } else if (strcmp(key, "max-size") == 0) {
+            limits.max_file_size = number;
+        } else if (strcmp(key, "max-line") == 0) {
+            limits.max_line_length = number;
+        } else if (strcmp(key, "excerpt-size") == 0) {
+            excerpt.max_bytes = number;
+        } else if (strcmp(key, "excerpt-lines") == 0) {
+            excerpt.max_lines = number;
+        } else if (strcmp(key, "no-skip") == 0 && !value) {
+            skip_files = FALSE;
+        } else if (strcmp(key, "outline") == 0 && !value) {
+            excerpt.outline = TRUE;
+        } else if (strcmp(key, "dedupe") == 0 && !value) {
+            dedupe = TRUE;
+        } else {
+            error = g_strdup_printf("Bad request line '%s%s%s'", key, value ? " " : "", value ? value : "");
+        }
     }
-    
-    fprintf(md_file, "%s", markdown_content);
-    fclose(md_file);
-    
-    int selected_count = 0;
-    for (int i = 0; i < file_count; i++) {
-        if (files[i].selected) selected_count++;
+    if (!error && roots->len == 0) error = g_strdup("No root in the request");
+
+    // Files of an extension no request asked for before have not been
+    // sniffed or counted: look at them once, from then on they are kept up
+    // to date like the rest
+    gboolean widened = FALSE;
+    for (guint i = 0; i < extensions->len && !error; i++) {
+        const char *ext = g_ptr_array_index(extensions, i);
+        if (!extension_filter_matches(&daemon->source_files, lookup_known_extension(ext), ext)) {
+            extension_filter_add_extension(&daemon->source_files, ext);
+            widened = TRUE;
+        }
     }
-    
-    if (selected_count > 0) {
-        GtkWidget *dialog = gtk_message_dialog_new(NULL,
-                                                  GTK_DIALOG_MODAL,
-                                                  GTK_MESSAGE_INFO,
-                                                  GTK_BUTTONS_OK,
-                                                  "Saved %d files to %s",
-                                                  selected_count, OUTPUT_FILE);
-        gtk_dialog_run(GTK_DIALOG(dialog));
-        gtk_widget_destroy(dialog);
-    } else {
-        GtkWidget *dialog = gtk_message_dialog_new(NULL,
-                                                  GTK_DIALOG_MODAL,
-                                                  GTK_MESSAGE_WARNING,
-                                                  GTK_BUTTONS_OK,
-                                                  "No files were selected");
-        gtk_dialog_run(GTK_DIALOG(dialog));
-        gtk_widget_destroy(dialog);
+    if (widened) daemon->source_files_version++;
+    for (guint r = 0; r < roots->len && widened; r++) {
+        daemon_root_update(daemon, g_ptr_array_index(roots, r));
     }
-    
-    free(markdown_content);
-}
 
-// Function to copy to clipboard
-void copy_to_clipboard() {
-    char *markdown_content = generate_markdown_content();
-    if (!markdown_content) {
-        GtkWidget *dialog = gtk_message_dialog_new(NULL,
-                                                  GTK_DIALOG_MODAL,
-                                                  GTK_MESSAGE_ERROR,
-                                                  GTK_BUTTONS_OK,
-                                                  "Failed to generate markdown content");
-        gtk_dialog_run(GTK_DIALOG(dialog));
-        gtk_widget_destroy(dialog);
-        return;
-    }
-    
-    gtk_clipboard_set_text(clipboard, markdown_content, -1);
-    free(markdown_content);
-    
-    int selected_count = 0;
-    for (int i = 0; i < file_count; i++) {
-        if (files[i].selected) selected_count++;
+    FileTable *table = NULL;
+    for (guint r = 0; r < roots->len && !error; r++) {
+        DaemonRoot *root = g_ptr_array_index(roots, r);
+        ExtensionFilter filter;
+        extension_filter_init(&filter);
+        for (guint i = 0; i < type_ids->len; i++) {
+            extension_filter_add_project_type(&filter, GPOINTER_TO_INT(g_ptr_array_index(type_ids, i)) - 1);
+        }
+        for (guint i = 0; i < extensions->len; i++) {
+            extension_filter_add_extension(&filter, g_ptr_array_index(extensions, i));
+        }
+        if (type_ids->len == 0 && extensions->len == 0) {
+            guint64 detected = detect_project_types(root->path, root->index);
+            extension_filter_add_project_types(&filter, detected ? detected : G_MAXUINT64);
+        }
+        if (!table) table = file_table_new();
+        file_table_add_index(table, root->index, &filter, skip_files ? &limits : NULL);
+        extension_filter_clear(&filter);
     }
-    
-    if (selected_count > 0) {
-        char status_text[100];
-        sprintf(status_text, "Copied %d files to clipboard", selected_count);
-        gtk_label_set_text(GTK_LABEL(status_label), status_text);
+    g_mutex_unlock(&daemon->lock); // The table holds on to the indexes it uses
+
+    FILE *out = error ? NULL : fdopen(client, "w");
+    if (!error && !out) error = g_strdup_printf("Cannot reply: %s", strerror(errno));
+    if (error) {
+        daemon_reply_error(client, error);
+        close(client);
     } else {
-        GtkWidget *dialog = gtk_message_dialog_new(NULL,
-                                                  GTK_DIALOG_MODAL,
-                                                  GTK_MESSAGE_WARNING,
-                                                  GTK_BUTTONS_OK,
-                                                  "No files were selected");
-        gtk_dialog_run(GTK_DIALOG(dialog));
-        gtk_widget_destroy(dialog);
-    }
-}
+        if (files->len > 0) {
+            g_ptr_array_add(files, NULL);
+            file_table_select_paths(table, (char **)files->pdata);
+        }
+        if (excerpt.max_bytes > 0) {
+            file_table_cap_tokens(table, MIN(estimate_tokens_from_size(excerpt.max_bytes) + TOKENS_PER_FILE_HEADER +
+                                             EXCERPT_MARKER_TOKENS, G_MAXUINT32 - 1));
+        }
+        if (budget > 0) file_table_fit_budget(table, budget);
 
-// Callback for save button
-void on_save_clicked(GtkWidget *widget, gpointer data) {
-    // Update selected status for all files
-    for (int i = 0; i < file_count; i++) {
-        files[i].selected = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(files[i].checkbox));
-    }
-    
-    save_to_markdown();
-}
+        ExportSelection *selection = export_selection_new(table);
+        selection->cache = daemon->cache;
+        selection->excerpt = excerpt;
+        selection->dedupe = dedupe;
 
-// Callback for copy to clipboard button
-void on_copy_clicked(GtkWidget *widget, gpointer data) {
-    // Update selected status for all files
-    for (int i = 0; i < file_count; i++) {
-        files[i].selected = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(files[i].checkbox));
+        fprintf(out, "OK %u %" G_GUINT64_FORMAT "\n", selection->indices->len, table->selected_tokens);
+        ExportSink sink;
+        export_sink_init_file(&sink, out);
+        int exported = export_files(&sink, selection, format, NULL, NULL);
+        gboolean ok = export_sink_finish(&sink) && exported >= 0;
+        ok = fclose(out) == 0 && ok; // Also closes client
+        fprintf(stderr, "%s %d files of %s%s in %.1f ms\n", ok ? "Exported" : "Failed to send",
+                exported, ((DaemonRoot *)g_ptr_array_index(roots, 0))->path, roots->len > 1 ? " and more" : "",
+                (g_get_monotonic_time() - started) / 1000.0);
+        export_selection_free(selection);
     }
-    
-    copy_to_clipboard();
+
+    if (table) file_table_unref(table);
+    g_free(error);
+    g_strfreev(lines);
+    g_ptr_array_free(files, TRUE);
+    g_ptr_array_free(extensions, TRUE);
+    g_ptr_array_free(type_ids, TRUE);
+    g_ptr_array_free(roots, TRUE);
+    g_string_free(request, TRUE);
 }
 
-// Callback for select all button
-void on_select_all_clicked(GtkWidget *widget, gpointer data) {
-    for (int i = 0; i < file_count; i++) {
-        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(files[i].checkbox), TRUE);
-    }
+typedef struct {
+    Daemon *daemon;
+    int client;
+} DaemonClient;
+
+static gpointer daemon_client_thread(gpointer data) {
+    DaemonClient *job = data;
+    daemon_serve(job->daemon, job->client);
+    g_free(job);
+    return NULL;
 }
 
-// Callback for clear all button
-void on_clear_all_clicked(GtkWidget *widget, gpointer data) {
-    for (int i = 0; i < file_count; i++) {
-        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(files[i].checkbox), FALSE);
-    }
+typedef struct {
+    Daemon *daemon;
+    DaemonRoot *root;       // Already marked scanning
+} DaemonRescan;
+
+static gpointer daemon_rescan_thread(gpointer data) {
+    DaemonRescan *job = data;
+    g_mutex_lock(&job->daemon->lock);
+    daemon_root_scan(job->daemon, job->root);
+    g_mutex_unlock(&job->daemon->lock);
+    g_free(job);
+    return NULL;
 }
 
-// Detect project type from project path
-int detect_project_type(const char *project_path) {
-    // Check for Android project
-    char build_gradle_path[MAX_PATH_LENGTH];
-    sprintf(build_gradle_path, "%s/build.gradle", project_path);
-    if (access(build_gradle_path, F_OK) == 0) {
-        return 0; // Android
+// Listen on socket_path, replacing a socket a daemon that is gone left
+// behind. Returns the listening descriptor, or -1.
+static int daemon_listen(const char *socket_path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", socket_path);
+        return -1;
     }
-    
-    // Check for package.json (Node.js/Web)
-    char package_json_path[MAX_PATH_LENGTH];
-    sprintf(package_json_path, "%s/package.json", project_path);
-    if (access(package_json_path, F_OK) == 0) {
-        return 1; // Web/Node.js
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    gboolean bound = fd != -1 && bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    if (fd != -1 && !bound && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        gboolean live = connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        close(probe);
+        if (live) {
+            fprintf(stderr, "Error: Another daemon is serving on %s\n", socket_path);
+            close(fd);
+            return -1;
+        }
+        // Only a stale socket is ours to replace, never a file that is in the way
+        struct stat st;
+        if (lstat(socket_path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Error: %s exists and is not a socket\n", socket_path);
+            close(fd);
+            return -1;
+        }
+        unlink(socket_path);
+        bound = bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
     }
-    
-    // Check for requirements.txt (Python)
-    char requirements_path[MAX_PATH_LENGTH];
-    sprintf(requirements_path, "%s/requirements.txt", project_path);
-    if (access(requirements_path, F_OK) == 0) {
-        return 2; // Python
+    // Nobody can connect before listen(), so the socket is never open to others
+    if (!bound || chmod(socket_path, 0600) == -1 || listen(fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
     }
-    
-    // Check for CMakeLists.txt (C/C++)
-    char cmake_path[MAX_PATH_LENGTH];
-    sprintf(cmake_path, "%s/CMakeLists.txt", project_path);
-    if (access(cmake_path, F_OK) == 0) {
-        return 3; // C/C++
+    return fd;
+}
+
+// Serve export requests on socket_path until killed, starting with the
+// roots in paths (more are added as requests name them)
+static int run_daemon(const char *socket_path, GPtrArray *paths) {
+    signal(SIGPIPE, SIG_IGN); // A client that hangs up must not end the daemon
+    int listen_fd = daemon_listen(socket_path);
+    if (listen_fd == -1) return 1;
+    int wake[2];
+    if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2 failed");
+        close(listen_fd);
+        unlink(socket_path);
+        return 1;
     }
-    
-    // Check for go.mod (Go)
-    char go_mod_path[MAX_PATH_LENGTH];
-    sprintf(go_mod_path, "%s/go.mod", project_path);
-    if (access(go_mod_path, F_OK) == 0) {
-        return 4; // Go
+
+    Daemon daemon;
+    g_mutex_init(&daemon.lock);
+    g_cond_init(&daemon.scanned);
+    daemon.roots = g_ptr_array_new_with_free_func(daemon_root_free);
+    daemon.cache = export_cache_new(EXPORT_CACHE_MAX_BYTES);
+    daemon.wake_fd = wake[1];
+    extension_filter_init(&daemon.source_files);
+    daemon.source_files_version = 0;
+    for (int i = 0; project_types[i].name != NULL; i++) {
+        extension_filter_add_project_type(&daemon.source_files, i);
     }
-    
-    // Check for Cargo.toml (Rust)
-    char cargo_path[MAX_PATH_LENGTH];
-    sprintf(cargo_path, "%s/Cargo.toml", project_path);
-    if (access(cargo_path, F_OK) == 0) {
-        return 5; // Rust
+    g_mutex_lock(&daemon.lock);
+    for (guint i = 0; i < paths->len; i++) {
+        DaemonRoot *root = daemon_root_get(&daemon, g_ptr_array_index(paths, i));
+        if (!root) fprintf(stderr, "Error: Failed to open directory: %s\n", (char *)g_ptr_array_index(paths, i));
+        else fprintf(stderr, "Watching %s (%u files)\n", root->path, root->index->files->len);
     }
-    
-    return -1; // Unknown
-}
+    g_mutex_unlock(&daemon.lock);
+    fprintf(stderr, "Serving on %s\n", socket_path);
 
-// Callback when a file checkbox is toggled
-void on_file_toggled(GtkToggleButton *toggle_button, gpointer user_data) {
-    FileEntry *file_info = (FileEntry*)user_data;
-    file_info->selected = gtk_toggle_button_get_active(toggle_button);
-}
+    GArray *polled = g_array_new(FALSE, FALSE, sizeof(struct pollfd));
+    for (;;) {
+        // The listening socket, the wake-up pipe, then each root's inotify instance
+        g_array_set_size(polled, 0);
+        struct pollfd listen_poll = {listen_fd, POLLIN, 0};
+        struct pollfd wake_poll = {wake[0], POLLIN, 0};
+        g_array_append_val(polled, listen_poll);
+        g_array_append_val(polled, wake_poll);
+        gint64 next_rescan = G_MAXINT64;
+        g_mutex_lock(&daemon.lock);
+        for (guint i = 0; i < daemon.roots->len; i++) {
+            DaemonRoot *root = g_ptr_array_index(daemon.roots, i);
+            struct pollfd watch_poll = {root->watch_fd, POLLIN, 0};
+            g_array_append_val(polled, watch_poll);
+            // A root being scanned wakes the loop when it is done
+            if (root->changed_at && !root->scanning) next_rescan = MIN(next_rescan, root->changed_at + WATCH_REFRESH_DELAY_MS * 1000);
+        }
+        g_mutex_unlock(&daemon.lock);
+        int timeout = next_rescan == G_MAXINT64 ? -1
+                    : (int)MAX(0, (next_rescan - g_get_monotonic_time() + 999) / 1000);
+        if (poll((struct pollfd *)polled->data, polled->len, timeout) == -1 && errno != EINTR) {
+            perror("poll failed");
+            break;
+        }
 
-// Function to load files from directory
-void load_files_from_directory(const char *dir_path, GtkWidget *files_container) {
-    // Clear previous file list
-    for (int i = 0; i < file_count; i++) {
-        if (files[i].checkbox) { // Only destroy if widget was created
-             gtk_widget_destroy(files[i].checkbox);
-             files[i].checkbox = NULL; // Avoid double free on refresh
+        char drain[64];
+        while (read(wake[0], drain, sizeof(drain)) > 0) {
+            // A root was added or scanned; the next round polls and times it
         }
-    }
-    file_count = 0;
 
-    DIR *dir;
-    struct dirent *entry;
-    struct stat file_stat;
+        // Roots added since the poll started are not in polled yet
+        gint64 now = g_get_monotonic_time();
+        g_mutex_lock(&daemon.lock);
+        for (guint i = 0; i + 2 < polled->len; i++) {
+            DaemonRoot *root = g_ptr_array_index(daemon.roots, i);
+            if ((g_array_index(polled, struct pollfd, i + 2).revents & POLLIN) &&
+                directory_watcher_read_events(root->watch_fd) && !root->changed_at) {
+                root->changed_at = now;
+            }
+            // Coalesce a burst of changes into one rescan, as the GUI does
+            if (root->changed_at && !root->scanning && now - root->changed_at >= WATCH_REFRESH_DELAY_MS * 1000) {
+                DaemonRescan *job = g_new(DaemonRescan, 1);
+                job->daemon = &daemon;
+                job->root = root;
+                root->scanning = TRUE;
+                g_thread_unref(g_thread_new("daemon-rescan", daemon_rescan_thread, job));
+            }
+        }
+        g_mutex_unlock(&daemon.lock);
 
-    dir = opendir(dir_path);
-    if (!dir) {
-        char error_msg[200];
-        snprintf(error_msg, sizeof(error_msg), "Failed to open directory: %s", dir_path);
-        gtk_label_set_text(GTK_LABEL(status_label), error_msg);
-        perror("opendir failed");
-        return;
+        if (g_array_index(polled, struct pollfd, 0).revents & POLLIN) {
+            int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client != -1) {
+                // A client that stops reading fails its export instead of keeping its thread forever
+                struct timeval send_timeout = {DAEMON_SEND_TIMEOUT_S, 0};
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+                DaemonClient *job = g_new(DaemonClient, 1);
+                job->daemon = &daemon;
+                job->client = client;
+                g_thread_unref(g_thread_new("daemon-client", daemon_client_thread, job));
+            }
+        }
     }
 
-    gtk_label_set_text(GTK_LABEL(status_label), "Loading files...");
-
-    char current_path[MAX_PATH_LENGTH];
-    strncpy(current_path, dir_path, MAX_PATH_LENGTH -1);
-    current_path[MAX_PATH_LENGTH - 1] = '\0'; // Ensure null termination
+    // Client threads may still be running: the daemon's state is left to
+    // the exit that follows
+    g_array_free(polled, TRUE);
+    close(listen_fd);
+    unlink(socket_path);
+    return 1;
+}
 
-    GList *subdirs = NULL; // List to hold subdirectories for recursive calls
+// --- Command Line Interface ---
 
-    while ((entry = readdir(dir)) != NULL && file_count < MAX_FILES) {
-        // Skip hidden files/directories and ., ..
-        if (entry->d_name[0] == '.') continue;
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s                         Start the graphical interface\n"
+            "       %s --export DIR [options]  Export DIR without starting GTK\n"
+            "       %s --serve SOCKET [--export DIR...]  Serve exports on a Unix socket\n"
+            "\n"
+            "Options:\n"
+            "  -e, --export DIR     Project directory to export; repeat to export several as one workspace\n"
+            "  -t, --type NAMES     Project types, comma-separated (default: detected for each DIR)\n"
+            "  -x, --ext EXTS       Also export these extensions, comma-separated (e.g. md,txt)\n"
+            "  -o, --output FILE    Output file, or - for stdout (default: -)\n"
+            "  -f, --format FORMAT  markdown (default) or jsonl, one JSON object per file\n"
+            "  -z, --compress TYPE  none, gzip or zstd (default: from the output name, e.g. .md.zst)\n"
+            "      --split-size SIZE    Write parts of about SIZE bytes (e.g. 50M) and a manifest\n"
+            "      --split-tokens N     Write parts of about N tokens and a manifest\n"
+            "  -B, --budget TOKENS  Leave out files, in order, until the export fits in about TOKENS\n"
+            "      --max-size SIZE  Leave out files larger than SIZE (default: 1M)\n"
+            "      --max-line N     Leave out files with a line longer than N bytes near the start (default: 2000)\n"
+            "      --no-skip        Export binary, generated and large files too\n"
+            "      --excerpt-size SIZE  Export only the head and tail (SIZE in all) of larger files\n"
+            "      --excerpt-lines N    Export only the first and last N/2 lines of longer files\n"
+            "      --outline        Export only the declarations and signatures of source files\n"
+            "      --no-dedupe      Export every copy of repeated files instead of a reference to the first\n"
+            "  -X, --exclude GLOB   Leave out files and directories matching GLOB (gitignore syntax)\n"
+            "      --no-ignore      Do not read .gitignore/.ignore or skip build and dependency dirs\n"
+            "  -n, --no-index       Walk the whole tree, ignoring and not updating the saved index\n"
+            "  -b, --bench          Print time, throughput, I/O calls and peak memory of each phase to stderr\n"
+            "      --trace FILE     Write a Chrome trace (chrome://tracing, Perfetto) of the scan and export\n"
+            "      --serve SOCKET   Keep running and answer export requests on SOCKET, keeping the\n"
+            "                       scan of each root (the --export DIRs to begin with) up to date\n"
+            "  -l, --list-types     List the known project types\n"
+            "  -h, --help           Show this help\n",
+            prog, prog, prog);
+}
 
-        // Use g_build_filename for safer path construction
-        char *full_path = g_build_filename(current_path, entry->d_name, NULL);
-        if (!full_path) {
-             perror("g_build_filename failed");
-             continue; // Skip this entry
+// Returns TRUE if the arguments ask for a headless run instead of the GUI
+static gboolean is_cli_invocation(int argc, char *argv[]) {
+    static const char *cli_flags[] = {"-e", "--export", "--serve", "-l", "--list-types", "-h", "--help", NULL};
+    for (int i = 1; i < argc; i++) {
+        for (int j = 0; cli_flags[j] != NULL; j++) {
+            size_t len = strlen(cli_flags[j]);
+            if (strncmp(argv[i], cli_flags[j], len) == 0 &&
+                (argv[i][len] == '\0' || argv[i][len] == '=' || cli_flags[j][1] != '-')) {
+                return TRUE;
+            }
         }
+    }
+    return FALSE;
+}
 
-        if (stat(full_path, &file_stat) == -1) {
-            perror("stat failed");
-            g_free(full_path);
-            continue; // Skip this entry
+// Run a headless export. Reuses the scanner and the markdown generator but
+// never calls gtk_init, so it starts instantly and needs no display.
+static int run_cli(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"export",     required_argument, NULL, 'e'},
+        {"type",       required_argument, NULL, 't'},
+        {"ext",        required_argument, NULL, 'x'},
+        {"output",     required_argument, NULL, 'o'},
+        {"format",     required_argument, NULL, 'f'},
+        {"compress",   required_argument, NULL, 'z'},
+        {"split-size", required_argument, NULL, 'S'},
+        {"split-tokens", required_argument, NULL, 'T'},
+        {"budget",     required_argument, NULL, 'B'},
+        {"max-size",   required_argument, NULL, 'M'},
+        {"max-line",   required_argument, NULL, 'L'},
+        {"no-skip",    no_argument,       NULL, 'A'},
+        {"excerpt-size", required_argument, NULL, 'C'},
+        {"excerpt-lines", required_argument, NULL, 'N'},
+        {"outline",    no_argument,       NULL, 'O'},
+        {"no-dedupe",  no_argument,       NULL, 'D'},
+        {"exclude",    required_argument, NULL, 'X'},
+        {"no-ignore",  no_argument,       NULL, 'I'},
+        {"no-index",   no_argument,       NULL, 'n'},
+        {"bench",      no_argument,       NULL, 'b'},
+        {"trace",      required_argument, NULL, 'R'},
+        {"serve",      required_argument, NULL, 'V'},
+        {"list-types", no_argument,       NULL, 'l'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    GPtrArray *export_dirs = g_ptr_array_new();
+    GPtrArray *type_names = g_ptr_array_new();
+    GPtrArray *extra_extensions = g_ptr_array_new();
+    GPtrArray *excludes = g_ptr_array_new();
+    gboolean use_ignore = TRUE;
+    const char *output = "-";
+    gboolean use_index = TRUE;
+    gboolean bench = FALSE;
+    const char *trace_path = NULL;
+    const char *serve_path = NULL;
+    guint64 budget = 0;
+    ExportFormat format = EXPORT_MARKDOWN;
+    int compression = -1; // From the output name
+    guint64 split_bytes = 0;
+    guint64 split_tokens = 0;
+    ContentLimits limits = {DEFAULT_MAX_FILE_SIZE, DEFAULT_MAX_LINE_LENGTH};
+    gboolean skip_files = TRUE;
+    ExcerptPolicy excerpt = {0, 0, FALSE};
+    gboolean dedupe = TRUE;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "e:t:x:X:o:f:z:B:nblh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'e': g_ptr_array_add(export_dirs, optarg); break;
+            case 't': g_ptr_array_add(type_names, optarg); break;
+            case 'x': g_ptr_array_add(extra_extensions, optarg); break;
+            case 'o': output = optarg; break;
+            case 'f':
+            case 'z': {
+                const char **names = (opt == 'f') ? export_format_names : compression_names;
+                int found = -1;
+                for (int i = 0; names[i] != NULL; i++) {
+                    if (g_ascii_strcasecmp(optarg, names[i]) == 0) found = i;
+                }
+                if (found < 0) {
+                    fprintf(stderr, "Error: Unknown %s '%s'.\n", opt == 'f' ? "format" : "compression", optarg);
+                    return 2;
+                }
+                if (opt == 'f') format = found; else compression = found;
+                break;
+            }
+            case 'S':
+            case 'T':
+            case 'M':
+            case 'L':
+            case 'C':
+            case 'N': {
+                guint64 value;
+                if (!parse_count(optarg, opt == 'S' || opt == 'M' || opt == 'C', &value) ||
+                    (opt == 'L' && value > G_MAXUINT16) || (opt == 'N' && value > G_MAXUINT)) {
+                    const char *name = opt == 'S' ? "split-size" : opt == 'T' ? "split-tokens" :
+                                       opt == 'M' ? "max-size" : opt == 'L' ? "max-line" :
+                                       opt == 'C' ? "excerpt-size" : "excerpt-lines";
+                    fprintf(stderr, "Error: --%s needs a positive number, not '%s'.\n", name, optarg);
+                    return 2;
+                }
+                switch (opt) {
+                    case 'S': split_bytes = value; break;
+                    case 'T': split_tokens = value; break;
+                    case 'M': limits.max_file_size = value; break;
+                    case 'L': limits.max_line_length = value; break;
+                    case 'C': excerpt.max_bytes = value; break;
+                    default:  excerpt.max_lines = value; break;
+                }
+                break;
+            }
+            case 'B': {
+                if (!parse_count(optarg, FALSE, &budget)) {
+                    fprintf(stderr, "Error: --budget needs a positive number of tokens, not '%s'.\n", optarg);
+                    return 2;
+                }
+                break;
+            }
+            case 'X': g_ptr_array_add(excludes, optarg); break;
+            case 'I': use_ignore = FALSE; break;
+            case 'A': skip_files = FALSE; break;
+            case 'O': excerpt.outline = TRUE; break;
+            case 'D': dedupe = FALSE; break;
+            case 'n': use_index = FALSE; break;
+            case 'b': bench = TRUE; break;
+            case 'R': trace_path = optarg; break;
+            case 'V': serve_path = optarg; break;
+            case 'l':
+                for (int i = 0; project_types[i].name != NULL; i++) {
+                    printf("%s\n", project_types[i].name);
+                }
+                return 0;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 2;
         }
+    }
 
-        if (S_ISDIR(file_stat.st_mode)) {
-            // Add subdirectory path to the list for later processing
-            subdirs = g_list_prepend(subdirs, full_path); // Prepend transfers ownership
-        } else if (S_ISREG(file_stat.st_mode)) {
-            if (is_extension_allowed(entry->d_name)) {
-                strncpy(files[file_count].filename, entry->d_name, 255);
-                files[file_count].filename[255] = '\0';
-                strncpy(files[file_count].path, full_path, MAX_PATH_LENGTH - 1);
-                files[file_count].path[MAX_PATH_LENGTH - 1] = '\0';
+    if (serve_path) {
+        int result = run_daemon(serve_path, export_dirs);
+        g_ptr_array_free(export_dirs, TRUE);
+        return result;
+    }
+    if (export_dirs->len == 0) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    gboolean to_stdout = strcmp(output, "-") == 0;
+    if ((split_bytes > 0 || split_tokens > 0) && to_stdout) {
+        fprintf(stderr, "Error: --split-size and --split-tokens need --output FILE.\n");
+        return 2;
+    }
+    if (compression < 0) {
+        compression = COMPRESS_NONE;
+        for (int i = COMPRESS_GZIP; i <= COMPRESS_ZSTD; i++) {
+            if (!to_stdout && g_str_has_suffix(output, compression_suffixes[i])) compression = i;
+        }
+    }
 
-                // Create checkbox for the file
-                files[file_count].checkbox = gtk_check_button_new_with_label(entry->d_name);
-                files[file_count].selected = TRUE; // Default to selected
-                gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(files[file_count].checkbox), TRUE);
+    // Every --type and --ext adds to the filter of every root
+    GArray *type_ids = g_array_new(FALSE, FALSE, sizeof(int));
+    GPtrArray *extensions = g_ptr_array_new_with_free_func(g_free);
+    int status = 0;
+    for (guint i = 0; i < type_names->len && status == 0; i++) {
+        char **names = g_strsplit(g_ptr_array_index(type_names, i), ",", -1);
+        for (char **name = names; *name && status == 0; name++) {
+            int project_type_index = find_project_type(*name);
+            if (project_type_index < 0) {
+                fprintf(stderr, "Error: Unknown project type '%s' (see --list-types).\n", *name);
+                status = 2;
+            } else {
+                g_array_append_val(type_ids, project_type_index);
+            }
+        }
+        g_strfreev(names);
+    }
+    for (guint i = 0; i < extra_extensions->len; i++) {
+        char **exts = g_strsplit(g_ptr_array_index(extra_extensions, i), ",", -1);
+        for (char **ext = exts; *ext; ext++) {
+            const char *bare = (**ext == '.') ? *ext + 1 : *ext;
+            if (*bare) g_ptr_array_add(extensions, g_strdup(bare));
+        }
+        g_strfreev(exts);
+    }
 
-                // Connect toggle signal
-                g_signal_connect(files[file_count].checkbox, "toggled", G_CALLBACK(on_file_toggled), &files[file_count]);
+    // Without them, each root gets the project types detected for it
+    guint root_count = export_dirs->len;
+    ExtensionFilter *filters = g_new(ExtensionFilter, root_count);
+    for (guint r = 0; r < root_count; r++) {
+        const char *export_dir = g_ptr_array_index(export_dirs, r);
+        extension_filter_init(&filters[r]);
+        for (guint i = 0; i < type_ids->len; i++) {
+            extension_filter_add_project_type(&filters[r], g_array_index(type_ids, int, i));
+        }
+        for (guint i = 0; i < extensions->len; i++) {
+            extension_filter_add_extension(&filters[r], g_ptr_array_index(extensions, i));
+        }
+        if (status == 0 && type_names->len == 0 && extra_extensions->len == 0) {
+            guint64 detected = detect_project_types(export_dir, NULL);
+            if (detected == 0) {
+                fprintf(stderr, "Error: Could not detect the project type of %s, please pass --type.\n", export_dir);
+                status = 2;
+            } else {
+                extension_filter_add_project_types(&filters[r], detected);
+            }
+        }
+    }
+    g_ptr_array_free(type_names, TRUE);
+    g_ptr_array_free(extra_extensions, TRUE);
+    g_array_free(type_ids, TRUE);
+    g_ptr_array_free(extensions, TRUE);
 
-                gtk_box_pack_start(GTK_BOX(files_container), files[file_count].checkbox, FALSE, FALSE, 0);
-                gtk_widget_show(files[file_count].checkbox);
+    // The roots are scanned at the same time and their files laid out in
+    // one table, root after root
+    ScanRoot *roots = g_new0(ScanRoot, root_count);
+    FileTable *table = NULL;
+    guint scanned = 0;
+    BenchSample scan_start, scan_end, filter_end, export_end;
+    if (status == 0) {
+        if (bench || trace_path) stats_enable(trace_path != NULL);
+        bench_sample(&scan_start);
+        g_ptr_array_add(excludes, NULL);
+        for (guint r = 0; r < root_count; r++) {
+            const char *export_dir = g_ptr_array_index(export_dirs, r);
+            roots[r].path = export_dir;
+            roots[r].options = (ScanOptions){ignore_frame_new_global(export_dir, use_ignore, (char **)excludes->pdata),
+                                             use_ignore, budget > 0 ? &filters[r] : NULL,
+                                             skip_files ? &filters[r] : NULL};
+        }
+        scan_roots(roots, root_count, use_index, NULL, NULL);
+        bench_sample(&scan_end);
 
-                file_count++;
+        table = file_table_new();
+        for (guint r = 0; r < root_count && status == 0; r++) {
+            if (!roots[r].index) {
+                fprintf(stderr, "Error: Failed to open directory: %s\n", roots[r].path);
+                status = 1;
+            } else {
+                scanned += roots[r].index->files->len;
+                file_table_add_index(table, roots[r].index, &filters[r], skip_files ? &limits : NULL);
             }
-             g_free(full_path); // Free path if it was a file
-        } else {
-             g_free(full_path); // Free path if neither dir nor file
         }
     }
-    closedir(dir);
+    for (guint r = 0; r < root_count; r++) {
+        scan_root_clear(&roots[r]);
+        extension_filter_clear(&filters[r]);
+    }
+    g_free(roots);
+    g_free(filters);
+    g_ptr_array_free(excludes, TRUE);
+    g_ptr_array_free(export_dirs, TRUE);
+    if (status != 0) {
+        if (table) file_table_unref(table);
+        return status;
+    }
 
-    // Process subdirectories recursively
-    GList *iterator = NULL;
-    for(iterator = subdirs; iterator; iterator = g_list_next(iterator)) {
-        if (file_count >= MAX_FILES) {
-            fprintf(stderr, "Warning: Maximum file limit (%d) reached. Some files might be skipped.\n", MAX_FILES);
-            g_free(iterator->data); // Free remaining paths in the list
-            continue;
-        }
-        load_files_from_directory((char*)iterator->data, files_container);
-        g_free(iterator->data); // Free the path string after processing
+    if (table->skipped > 0) {
+        fprintf(stderr, "Skipped %u binary, generated or large files (--no-skip exports them)\n", table->skipped);
+    }
+    if (excerpt.max_bytes > 0) {
+        file_table_cap_tokens(table, MIN(estimate_tokens_from_size(excerpt.max_bytes) + TOKENS_PER_FILE_HEADER +
+                                         EXCERPT_MARKER_TOKENS, G_MAXUINT32 - 1));
     }
-    g_list_free(subdirs); // Free the list structure itself
+    if (budget > 0) {
+        guint candidates = file_table_count(table) - table->skipped;
+        guint dropped = file_table_fit_budget(table, budget);
+        fprintf(stderr, "Budget: kept %u of %u files, ~%" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " tokens\n",
+                candidates - dropped, candidates, table->selected_tokens, budget);
+    }
+    bench_sample(&filter_end);
 
-    if (file_count == 0) {
-         gtk_label_set_text(GTK_LABEL(status_label), "No allowed files found in the selected directory.");
+    // Split output, and JSONL written to a file, come with a manifest;
+    // anything else is a single stream
+    ExportSink sink;
+    FILE *out = NULL;
+    if (!to_stdout && (split_bytes > 0 || split_tokens > 0 || format == EXPORT_JSONL)) {
+        export_sink_init_split(&sink, output, format, compression, split_bytes, split_tokens);
     } else {
-        char status_msg[100];
-        snprintf(status_msg, sizeof(status_msg), "Loaded %d files. Ready.", file_count);
-        gtk_label_set_text(GTK_LABEL(status_label), status_msg);
+        out = to_stdout ? stdout : fopen(output, "w");
+        if (!out) {
+            fprintf(stderr, "Error: Cannot open %s for writing: %s\n", output, strerror(errno));
+            file_table_unref(table);
+            return 1;
+        }
+        export_sink_init_compressed(&sink, out, compression);
     }
-}
 
-// Callback for project type combo box
-void on_project_type_changed(GtkWidget *widget, gpointer data) {
-    // Reload files with new filter
-    const char *dir_path = gtk_entry_get_text(GTK_ENTRY(project_path_entry));
-    load_files_from_directory(dir_path, GTK_WIDGET(data));
-}
+    guint found = file_table_count(table);
+    ExportSelection *selection = export_selection_new(table);
+    selection->excerpt = excerpt;
+    file_table_unref(table);
+    selection->dedupe = dedupe;
+    int exported = export_files(&sink, selection, format, NULL, NULL);
+    if (!export_sink_finish(&sink)) exported = -1;
+    int close_result = !out ? 0 : (out == stdout) ? fflush(out) : fclose(out);
+    bench_sample(&export_end);
 
-// Callback for browse button
-void on_browse_clicked(GtkWidget *widget, gpointer data) {
-    GtkWidget *dialog;
-    GtkFileChooserAction action = GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER;
-    gint res;
-    
-    dialog = gtk_file_chooser_dialog_new("Select Project Directory",
-                                        NULL,
-                                        action,
-                                        "_Cancel",
-                                        GTK_RESPONSE_CANCEL,
-                                        "_Open",
-                                        GTK_RESPONSE_ACCEPT,
-                                        NULL);
-    
-    res = gtk_dialog_run(GTK_DIALOG(dialog));
-    if (res == GTK_RESPONSE_ACCEPT) {
-        GtkFileChooser *chooser = GTK_FILE_CHOOSER(dialog);
-        char *folder_path = gtk_file_chooser_get_filename(chooser);
-        
-        // Update path entry
-        gtk_entry_set_text(GTK_ENTRY(project_path_entry), folder_path);
-        
-        // Reload files
-        load_files_from_directory(folder_path, data); // data is files_container
+    if (exported < 0 || close_result != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", output);
+        export_selection_free(selection);
+        return 1;
+    }
 
-        // Save the selected directory to config
-        write_last_directory(folder_path);
+    if (bench) {
+        // Also time building the whole export in memory
+        BenchSample clipboard_start, clipboard_end;
+        bench_sample(&clipboard_start);
+        char *content = generate_markdown_content(selection, NULL, NULL);
+        bench_sample(&clipboard_end);
+        size_t content_len = content ? strlen(content) : 0;
+        g_free(content);
 
-        g_free(folder_path);
+        bench_report("scan", &scan_start, &scan_end, scanned, scan_end.read_bytes - scan_start.read_bytes);
+        bench_report("filter", &scan_end, &filter_end, found, 0);
+        bench_report("export", &filter_end, &export_end, exported, sink.bytes_written);
+        bench_report("memory", &clipboard_start, &clipboard_end, exported, content_len);
+
+        GString *summary = g_string_new(NULL);
+        stats_summary(summary);
+        fputs(summary->str, stderr);
+        g_string_free(summary, TRUE);
     }
-    
-    gtk_widget_destroy(dialog);
-}
+    export_selection_free(selection);
+    if (trace_path && !stats_write_trace(trace_path)) return 1;
 
-// Callback for refresh button
-void on_refresh_clicked(GtkWidget *widget, gpointer data) {
-    const char *dir_path = gtk_entry_get_text(GTK_ENTRY(project_path_entry));
-    load_files_from_directory(dir_path, GTK_WIDGET(data));
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -631,23 +6348,34 @@ int main(int argc, char *argv[]) {
     GtkWidget *main_box;
     GtkWidget *path_box;
     GtkWidget *path_label;
+    GtkWidget *path_scroll;
     GtkWidget *browse_button;
     GtkWidget *refresh_button;
     GtkWidget *type_box;
     GtkWidget *type_label;
     GtkWidget *scrolled_window;
-    GtkWidget *files_vbox;
+    GtkWidget *files_view;
     GtkWidget *button_box;
     GtkWidget *select_all_button;
     GtkWidget *clear_all_button;
     GtkWidget *save_button;
     GtkWidget *copy_button;
     
+    // Markers and the type list refer to types by ProjectTypeId: every ID
+    // needs its entry in project_types
+    g_assert(project_type_count() == PROJECT_TYPE_COUNT);
+
+    // Headless export mode: never touches GTK, so it works without a display
+    if (is_cli_invocation(argc, argv)) {
+        return run_cli(argc, argv);
+    }
+    
     // Initialize GTK
     gtk_init(&argc, &argv);
     
     // Get default clipboard
     clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
+    export_cache = export_cache_new(EXPORT_CACHE_MAX_BYTES);
     
     // --- Read last directory from config ---
     if (ensure_config_dir_exists() != 0) {
@@ -668,13 +6396,29 @@ int main(int argc, char *argv[]) {
     // Path selection
     path_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
     path_label = gtk_label_new("Project Path:");
-    project_path_entry = gtk_entry_new();
-    gtk_entry_set_text(GTK_ENTRY(project_path_entry), last_dir ? last_dir : ""); // Set from config or empty
+    project_path_view = gtk_text_view_new();
+    set_project_path(last_dir ? last_dir : ""); // Set from config or empty
+    gtk_text_view_set_accepts_tab(GTK_TEXT_VIEW(project_path_view), FALSE);
+    gtk_widget_set_tooltip_text(project_path_view,
+                                "A project directory, or several on separate lines (pick them together in "
+                                "Browse, or add a line with Shift+Enter) to scan and export them together. "
+                                "Enter loads them");
+    // Grows a line per directory, and scrolls past a few
+    path_scroll = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(path_scroll), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_shadow_type(GTK_SCROLLED_WINDOW(path_scroll), GTK_SHADOW_IN);
+    gtk_scrolled_window_set_propagate_natural_height(GTK_SCROLLED_WINDOW(path_scroll), TRUE);
+    gtk_scrolled_window_set_max_content_height(GTK_SCROLLED_WINDOW(path_scroll), 100);
+    gtk_container_add(GTK_CONTAINER(path_scroll), project_path_view);
     browse_button = gtk_button_new_with_label("Browse");
     refresh_button = gtk_button_new_with_label("Refresh");
     
+    // Keep the label and buttons on the first line of a workspace
+    gtk_widget_set_valign(path_label, GTK_ALIGN_START);
+    gtk_widget_set_valign(browse_button, GTK_ALIGN_START);
+    gtk_widget_set_valign(refresh_button, GTK_ALIGN_START);
     gtk_box_pack_start(GTK_BOX(path_box), path_label, FALSE, FALSE, 5);
-    gtk_box_pack_start(GTK_BOX(path_box), project_path_entry, TRUE, TRUE, 5);
+    gtk_box_pack_start(GTK_BOX(path_box), path_scroll, TRUE, TRUE, 5);
     gtk_box_pack_start(GTK_BOX(path_box), browse_button, FALSE, FALSE, 5);
     gtk_box_pack_start(GTK_BOX(path_box), refresh_button, FALSE, FALSE, 5);
     
@@ -685,16 +6429,42 @@ int main(int argc, char *argv[]) {
     type_label = gtk_label_new("Project Type:");
     project_type_combo = gtk_combo_box_text_new();
     
-    // Add project types
+    // Add project types, then the choice to detect the type of each directory
     for (int i = 0; project_types[i].name != NULL; i++) {
         gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(project_type_combo), project_types[i].name);
     }
-    gtk_combo_box_set_active(GTK_COMBO_BOX(project_type_combo), 0); // Default to Android
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(project_type_combo), "Detect per directory");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(project_type_combo), PROJECT_ANDROID); // Default
     
     gtk_box_pack_start(GTK_BOX(type_box), type_label, FALSE, FALSE, 5);
     gtk_box_pack_start(GTK_BOX(type_box), project_type_combo, FALSE, FALSE, 5);
     
-    // Status label
+    // Token budget
+    GtkWidget *budget_label = gtk_label_new("Token Budget:");
+    budget_spin = gtk_spin_button_new_with_range(0, 10000000, 1000); // 0 means no budget
+    GtkWidget *fit_button = gtk_button_new_with_label("Fit");
+    gtk_box_pack_start(GTK_BOX(type_box), budget_label, FALSE, FALSE, 5);
+    gtk_box_pack_start(GTK_BOX(type_box), budget_spin, FALSE, FALSE, 5);
+    gtk_box_pack_start(GTK_BOX(type_box), fit_button, FALSE, FALSE, 5);
+
+    // How much of each file goes into the export
+    GtkWidget *content_label = gtk_label_new("Content:");
+    content_combo = gtk_combo_box_text_new();
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(content_combo), "Whole files");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(content_combo), "Head and tail");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(content_combo), "Outline");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(content_combo), 0);
+    gtk_widget_set_tooltip_text(content_combo, "Head and tail: files over 64 KB or 1000 lines keep only their start and end.\n"
+                                               "Outline: only the declarations and signatures of source files.");
+    gtk_box_pack_start(GTK_BOX(type_box), content_label, FALSE, FALSE, 5);
+    gtk_box_pack_start(GTK_BOX(type_box), content_combo, FALSE, FALSE, 5);
+
+    // Status label, with the estimated tokens of the selection next to it and
+    // a switch for timing stats, shown as the status label's tooltip
+    stats_check = gtk_check_button_new_with_label("Stats");
+    gtk_box_pack_end(GTK_BOX(type_box), stats_check, FALSE, FALSE, 5);
+    token_label = gtk_label_new("~0 tokens");
+    gtk_box_pack_end(GTK_BOX(type_box), token_label, FALSE, FALSE, 5);
     status_label = gtk_label_new("Ready");
     gtk_box_pack_end(GTK_BOX(type_box), status_label, TRUE, TRUE, 5);
     
@@ -707,8 +6477,8 @@ int main(int argc, char *argv[]) {
                                   GTK_POLICY_AUTOMATIC);
     gtk_box_pack_start(GTK_BOX(main_box), scrolled_window, TRUE, TRUE, 5);
     
-    files_vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
-    gtk_container_add(GTK_CONTAINER(scrolled_window), files_vbox);
+    files_view = create_files_view();
+    gtk_container_add(GTK_CONTAINER(scrolled_window), files_view);
     
     // Button box
     button_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
@@ -716,32 +6486,39 @@ int main(int argc, char *argv[]) {
     clear_all_button = gtk_button_new_with_label("Clear All");
     save_button = gtk_button_new_with_label("Save to Markdown");
     copy_button = gtk_button_new_with_label("Copy to Clipboard");
+    cancel_button = gtk_button_new_with_label("Cancel");
+    gtk_widget_set_sensitive(cancel_button, FALSE); // Only while a scan or export runs
     
     gtk_box_pack_end(GTK_BOX(button_box), save_button, FALSE, FALSE, 5);
     gtk_box_pack_end(GTK_BOX(button_box), copy_button, FALSE, FALSE, 5);
     gtk_box_pack_end(GTK_BOX(button_box), clear_all_button, FALSE, FALSE, 5);
     gtk_box_pack_end(GTK_BOX(button_box), select_all_button, FALSE, FALSE, 5);
+    gtk_box_pack_start(GTK_BOX(button_box), cancel_button, FALSE, FALSE, 5);
     
     gtk_box_pack_start(GTK_BOX(main_box), button_box, FALSE, FALSE, 5);
     
     // Connect signals
-    g_signal_connect(browse_button, "clicked", G_CALLBACK(on_browse_clicked), files_vbox);
-    g_signal_connect(refresh_button, "clicked", G_CALLBACK(on_refresh_clicked), files_vbox);
-    g_signal_connect(project_type_combo, "changed", G_CALLBACK(on_project_type_changed), files_vbox);
-    g_signal_connect(select_all_button, "clicked", G_CALLBACK(on_select_all_clicked), NULL);
-    g_signal_connect(clear_all_button, "clicked", G_CALLBACK(on_clear_all_clicked), NULL);
+    g_signal_connect(browse_button, "clicked", G_CALLBACK(on_browse_clicked), files_view);
+    g_signal_connect(refresh_button, "clicked", G_CALLBACK(on_refresh_clicked), files_view);
+    g_signal_connect(project_path_view, "key-press-event", G_CALLBACK(on_path_key_pressed), files_view);
+    g_signal_connect(project_type_combo, "changed", G_CALLBACK(on_project_type_changed), files_view);
+    g_signal_connect(select_all_button, "clicked", G_CALLBACK(on_select_all_clicked), files_view);
+    g_signal_connect(clear_all_button, "clicked", G_CALLBACK(on_clear_all_clicked), files_view);
+    g_signal_connect(fit_button, "clicked", G_CALLBACK(on_fit_budget_clicked), files_view);
+    g_signal_connect(stats_check, "toggled", G_CALLBACK(on_stats_toggled), NULL);
+    g_signal_connect(budget_spin, "value-changed", G_CALLBACK(on_budget_changed), NULL);
     g_signal_connect(save_button, "clicked", G_CALLBACK(on_save_clicked), NULL);
     g_signal_connect(copy_button, "clicked", G_CALLBACK(on_copy_clicked), NULL);
+    g_signal_connect(cancel_button, "clicked", G_CALLBACK(on_cancel_clicked), NULL);
     
     // Initial load of files from the last directory
     if (last_dir) {
-        // Detect and set project type for the last directory
-        int detected_type = detect_project_type(last_dir);
-         if (detected_type != -1) {
-            gtk_combo_box_set_active(GTK_COMBO_BOX(project_type_combo), detected_type);
-         }
-        load_files_from_directory(last_dir, files_vbox);
-        free(last_dir); // Free the memory allocated by read_last_directory
+        // Detect and set project type for the last directory; changing it
+        // loads the files
+        if (!select_detected_project_type(last_dir)) {
+            load_files_from_directory(last_dir, files_view);
+        }
+        g_free(last_dir); // Free the memory allocated by read_last_directory
     } else {
          // Optional: Set a default message if no last directory
          gtk_label_set_text(GTK_LABEL(status_label), "Browse to select a project directory.");
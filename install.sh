@@ -16,6 +16,14 @@ if ! pkg-config --exists gtk+-3.0; then
     exit 1
 fi
 
+echo "Checking for zlib and zstd development libraries..."
+if ! pkg-config --exists zlib libzstd; then
+    echo -e "${RED}zlib or zstd development libraries not found.${NC}"
+    echo "Please run the following command:"
+    echo "  sudo pacman -S zlib zstd"
+    exit 1
+fi
+
 # Compile the application
 echo "Compiling the application..."
 make clean && make